@@ -2,6 +2,14 @@
 // Created by Ondrej Ac (xacond00)
 #include "ray.h"
 #include "vec.h"
+
+// Slab test on entry and exit distances of a ray, shared by the scalar and SIMD box tests
+// Flat boxes have tmin == tmax and still count as hit, for lanes returns the mask of hit lanes
+template <class T>
+inline auto slab_hit(const T &tmin, const T &tmax, const T &t) {
+    return (tmin <= tmax) & (tmax > T(0)) & (tmin < t);
+}
+
 struct AABB{
     AABB() : pmin(InfF), pmax(-InfF){}
     AABB(Vec3f pmin, Vec3f pmax): pmin{pmin},pmax(pmax){}
@@ -24,12 +32,12 @@ struct AABB{
     // Returns that ray intersects
     bool ray_test(const Ray& r, Float t = InfF)const{
         auto [mint, maxt] = bounds_check(r);
-		return mint < maxt && maxt > 0 && mint < t;
+		return slab_hit(mint, maxt, t);
     }
 
     bool ray_dist(const Ray& r, Float &t)const{
         auto [mint, maxt] = bounds_check(r);
-		if(mint < maxt && maxt > 0 && mint < t){
+		if(slab_hit(mint, maxt, t)){
             t = mint;
             return true;
         }
@@ -38,7 +46,7 @@ struct AABB{
 
     bool intersect(const Ray &r, HitInfo &rec) {
 		auto [mint, maxt] = bounds_check(r);
-        if (mint < maxt && maxt > 0 && mint < rec.t()) {
+        if (slab_hit(mint, maxt, rec.t())) {
 			rec.tuv[0] = mint;
 			return true;
 		}
@@ -89,6 +97,11 @@ struct AABB{
         return (pmin + pmax) * Float(0.5);
     }
 
+    // False for the default (inverted) box
+    bool valid()const{
+        return pmin[0] <= pmax[0] && pmin[1] <= pmax[1] && pmin[2] <= pmax[2];
+    }
+
     Float area()const{
         Vec3f S = pmax - pmin;
 		return dot(S, S.lrotate());
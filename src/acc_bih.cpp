@@ -10,12 +10,36 @@
 #define STACK_SIZE 64
 
 bool AccelBih::intersect(const Ray &ray_query, HitInfo &hit_info) const
+{
+    NoStats stats;
+    return traverse_closest(ray_query, hit_info, stats);
+}
+
+bool AccelBih::intersect_stats(const Ray &ray_query, HitInfo &hit_info, TraceStats &stats) const
+{
+    return traverse_closest(ray_query, hit_info, stats);
+}
+
+bool AccelBih::ray_test(const Ray &ray_query, Float t_max) const
+{
+    NoStats stats;
+    return traverse_any(ray_query, t_max, stats);
+}
+
+bool AccelBih::ray_test_stats(const Ray &ray_query, Float t_max, TraceStats &stats) const
+{
+    return traverse_any(ray_query, t_max, stats);
+}
+
+template <class Stats>
+bool AccelBih::traverse_closest(const Ray &ray_query, HitInfo &hit_info, Stats &stats) const
 {
     struct stack_item { Uint node_index; Float entry_t; };
     stack_item stack[STACK_SIZE];
     Uint sp = 0;
 
     // Root-box test
+    stats.box();
     if (!nodes[0].bounds.ray_test(ray_query, hit_info.t()))
         return false;
     stack[sp++] = {0, hit_info.t()};
@@ -26,15 +50,19 @@ bool AccelBih::intersect(const Ray &ray_query, HitInfo &hit_info) const
         if (t_cur > hit_info.t()) continue;
 
         const BihNode &node = nodes[node_idx];
+        stats.node();
         if (node.is_leaf()) {
             // test each polygon
-            for (Uint i = node.index_range[0]; i < node.index_range[1]; ++i)
+            for (Uint i = node.index_range[0]; i < node.index_range[1]; ++i) {
+                stats.tri();
                 if (poly(i).intersect(ray_query, hit_info))
                     any_hit = true;
+            }
             continue;
         }
 
         // compute child intervals
+        stats.box(2);
         bool hit_left, hit_right;
         Float enter_left, enter_right;
         compute_child_hit_intervals(
@@ -64,24 +92,30 @@ bool AccelBih::intersect(const Ray &ray_query, HitInfo &hit_info) const
 }
 
 
-bool AccelBih::ray_test(const Ray &ray_query, Float t_max) const
+template <class Stats>
+bool AccelBih::traverse_any(const Ray &ray_query, Float t_max, Stats &stats) const
 {
     Uint stack[STACK_SIZE];
     Uint sp = 0;
 
+    stats.box();
     if (!nodes[0].bounds.ray_test(ray_query, t_max))
         return false;
     stack[sp++] = 0;
 
     while (sp) {
         const BihNode &node = nodes[stack[--sp]];
+        stats.node();
         if (node.is_leaf()) {
-            for (Uint i = node.index_range[0]; i < node.index_range[1]; ++i)
+            for (Uint i = node.index_range[0]; i < node.index_range[1]; ++i) {
+                stats.tri();
                 if (poly(i).ray_test(ray_query, t_max))
                     return true;
+            }
             continue;
         }
 
+        stats.box(2);
         bool hit_left, hit_right;
         Float enter_left, enter_right;
         compute_child_hit_intervals(
@@ -109,13 +143,34 @@ void AccelBih::build()
     nodes.emplace_back(m_scene.m_bbox, Vec2u(0, m_scene.poly_cnt()));
 
     Float total_cost = 0.0f;
+    prepare_prims();
     build_node_recursive(0, total_cost);
+    release_prims();
     last_build_cost  = total_cost;
+    cache_poly();
     m_built          = true;
 
     last_build_time = timer(build_timer);
 }
 
+bool AccelBih::save(BinWriter &out) const
+{
+    out.write(m_poly);
+    out.write(nodes);
+    out.write(last_build_cost);
+    out.write(last_build_time);
+    return out.ok();
+}
+
+bool AccelBih::load(BinReader &in)
+{
+    if (!in.read(m_poly) || !in.read(nodes) || !in.read(last_build_cost) || !in.read(last_build_time) || nodes.empty())
+        return false;
+    cache_poly();
+    m_built = true;
+    return true;
+}
+
 
 // SAH splitting & binning
 std::pair<Float,Uint> AccelBih::find_split_sah(const Vec2u &index_range, const AABB  &bounds, uint8_t &out_axis, Float &out_plane)
@@ -123,13 +178,13 @@ std::pair<Float,Uint> AccelBih::find_split_sah(const Vec2u &index_range, const A
     struct BinLayer   { AABB bound; Uint count = 0; };
     struct SplitLayer { Float area = 0; Uint count = 0; };
 
-    constexpr Uint BINS = 32;
+    const Uint BINS = bin_cnt();
     Float best_cost = InfF;
     out_axis  = 0;
     out_plane = (bounds.pmin[0] + bounds.pmax[0]) * 0.5f;
 
     for (Uint axis = 0; axis < 3; ++axis) {
-        BinLayer bins[BINS];
+        BinLayer bins[max_bins];
         Float extent = bounds.pmax[axis] - bounds.pmin[axis];
         if (extent < Eps6F)
             continue;
@@ -137,15 +192,15 @@ std::pair<Float,Uint> AccelBih::find_split_sah(const Vec2u &index_range, const A
 
         // bin by centroid
         for (Uint i = index_range[0]; i < index_range[1]; ++i) {
-            auto tri_bb = vert(i).bbox();
-            Int bidx = Int((tri_bb.center()[axis] - bounds.pmin[axis]) * inv_scale);
+            auto tri_bb = prim_bbox(i).padded();
+            Int bidx = Int((prim_mid(i, axis) - bounds.pmin[axis]) * inv_scale);
             bidx = std::clamp(bidx, 0, Int(BINS - 1));
             bins[bidx].count++;
             bins[bidx].bound.expand(tri_bb);
         }
 
         // prefix/suffix sweeps
-        SplitLayer left_sl[BINS-1], right_sl[BINS-1];
+        SplitLayer left_sl[max_bins-1], right_sl[max_bins-1];
         BinLayer acc_l, acc_r;
         for (Uint i = 0; i < BINS-1; ++i) {
             acc_l.bound.expand(bins[i].bound);
@@ -182,7 +237,9 @@ std::pair<Float,Uint> AccelBih::find_split_sah(const Vec2u &index_range, const A
             m_poly.begin() + split_idx,
             m_poly.begin() + index_range[1],
             [axis=out_axis,this](Uint a, Uint b){
-                return vert(a).bbox().center()[axis] < vert(b).bbox().center()[axis];
+                // a, b are scene polygons, not positions in poly_index
+                Uint pa = a - m_range[0], pb = b - m_range[0];
+                return m_prims.pmin[axis][pa] + m_prims.pmax[axis][pa] < m_prims.pmin[axis][pb] + m_prims.pmax[axis][pb];
             }
         );
         best_cost = 0.0f;  // force subdivision
@@ -196,7 +253,7 @@ Uint AccelBih::partition_polygons(const Vec2u &index_range, uint8_t axis, Float
     Int i = index_range[0];
     Int j = index_range[1] - 1;
     while (i <= j) {
-        if (vert(i).bbox().center()[axis] < plane_split)
+        if (prim_mid(i, axis) < plane_split)
             ++i;
         else
             std::swap(m_poly[i], m_poly[j--]);
@@ -217,6 +274,7 @@ void AccelBih::build_node_recursive(Uint node_index, Float &cost_accum)
 
     if (cnt <= max_leaf_polygons) {
         cost_accum += leaf_cost;
+        add_progress(cnt);
         return;
     }
 
@@ -225,15 +283,16 @@ void AccelBih::build_node_recursive(Uint node_index, Float &cost_accum)
     auto [sah_cost, mid] = find_split_sah(node.index_range, bb, axis, plane);
     if (mid == start || mid == end || sah_cost >= leaf_cost) {
         cost_accum += leaf_cost;
+        add_progress(cnt);
         return;
     }
 
     // compute split-interval bounds
     Float lmax = -InfF, rmin = InfF;
     for (Uint i = start; i < mid; ++i)
-        lmax = std::max(lmax, vert(i).bbox().pmax[axis]);
+        lmax = std::max(lmax, prim_bbox(i).padded().pmax[axis]);
     for (Uint i = mid; i < end;   ++i)
-        rmin = std::min(rmin, vert(i).bbox().pmin[axis]);
+        rmin = std::min(rmin, prim_bbox(i).padded().pmin[axis]);
 
     node.split_axis = axis;
     node.left_max   = lmax;
@@ -242,9 +301,9 @@ void AccelBih::build_node_recursive(Uint node_index, Float &cost_accum)
     // create children
     Vec2u left_range(start, mid), right_range(mid, end);
     Uint left_idx  = nodes.size();
-    nodes.emplace_back(bbox_in(left_range),  left_range);
+    nodes.emplace_back(prim_bbox_in(left_range),  left_range);
     Uint right_idx = nodes.size();
-    nodes.emplace_back(bbox_in(right_range), right_range);
+    nodes.emplace_back(prim_bbox_in(right_range), right_range);
 
     node.index_range = Vec2u(right_idx, left_idx);
 
@@ -359,6 +418,8 @@ void AccelBih::update()
 
     if (refit_cost > 1.2f * last_build_cost)
         build();
+    else
+        cache_poly();
 
     m_built = true;
 }
@@ -21,14 +21,14 @@
 class AccelBih : public Accel {
 public:
     /**
-     * @brief Runs build() on construct.
+     * @brief Doesn't build, that is left to make_accel().
      * @param m_scene
      * @param max_leaf_polygons Threshold for leaf node size before splitting.
+     * @param params Build settings, bins sets the SAH bin count.
      */
-    explicit AccelBih(const Scene &m_scene, Uint max_leaf_polygons = 4)
-        : Accel(m_scene, Accel_t::BIH), max_leaf_polygons(max_leaf_polygons)
+    explicit AccelBih(const Scene &m_scene, Uint max_leaf_polygons = 4, const BuildParams &params = BuildParams())
+        : Accel(m_scene, Accel_t::BIH, params), max_leaf_polygons(max_leaf_polygons)
     {
-        build();
     }
 
     /**
@@ -47,6 +47,18 @@ public:
      */
     bool ray_test(const Ray &ray_query, Float t_max = InfF) const override;
 
+    /**
+     * @brief intersect() counting visited nodes and box/polygon tests.
+     * @param stats Counters to add to.
+     */
+    bool intersect_stats(const Ray &ray_query, HitInfo &hit_info, TraceStats &stats) const override;
+
+    /**
+     * @brief ray_test() counting visited nodes and box/polygon tests.
+     * @param stats Counters to add to.
+     */
+    bool ray_test_stats(const Ray &ray_query, Float t_max, TraceStats &stats) const override;
+
     /**
      * @brief Refits the BIH for dynamic scene; rebuilds if too costly.
      * @warning Not testetd.
@@ -58,6 +70,20 @@ public:
      */
     void build() override;
 
+    /**
+     * @brief Stores nodes and polygon order for the scene cache.
+     * @param out Cache file writer.
+     * @return True if written.
+     */
+    bool save(BinWriter &out) const override;
+
+    /**
+     * @brief Restores nodes and polygon order written by save().
+     * @param in Cache file reader.
+     * @return True if the structure is usable.
+     */
+    bool load(BinReader &in) override;
+
 private:
     /**
      * @brief BIH node, storing either a polygon indices range or child indices.
@@ -80,6 +106,20 @@ private:
     };
 
 
+    /**
+     * @brief Closest-hit traversal kernel.
+     * @tparam Stats TraceStats to count traversal steps, NoStats compiles the counting out.
+     */
+    template <class Stats>
+    bool traverse_closest(const Ray &ray_query, HitInfo &hit_info, Stats &stats) const;
+
+    /**
+     * @brief Any-hit traversal kernel.
+     * @tparam Stats TraceStats to count traversal steps, NoStats compiles the counting out.
+     */
+    template <class Stats>
+    bool traverse_any(const Ray &ray_query, Float t_max, Stats &stats) const;
+
     /**
      * @brief Finds best split hyperplane using SAH heuristic.
      * @param index_range polygon index range [start,end) in poly_index.
@@ -129,6 +169,7 @@ private:
 
     size_t nodes_cnt()  const override { return nodes.size(); }
     double build_time() const override { return last_build_time; }
+    size_t mem_size()   const override { return poly_mem() + nodes.size() * sizeof(BihNode); }
 
     std::vector<BihNode> nodes;                // All BIH nodes in flat array
     Uint                 max_leaf_polygons;    // Leaf split threshold
@@ -0,0 +1,302 @@
+/**
+ * @file acc_bih_compact.cpp
+ * @brief Compact Bounding Interval Hierarchy acceleration structure implementation.
+ * @author Marek Konečný
+ * @date 2025-05-07
+ */
+#include "acc_bih_compact.h"
+#include <algorithm>
+
+#define STACK_SIZE 64
+#define MAX_DEPTH  60
+
+bool AccelBihCompact::intersect(const Ray &ray_query, HitInfo &hit_info) const
+{
+    NoStats stats;
+    return traverse_closest(ray_query, hit_info, stats);
+}
+
+bool AccelBihCompact::intersect_stats(const Ray &ray_query, HitInfo &hit_info, TraceStats &stats) const
+{
+    return traverse_closest(ray_query, hit_info, stats);
+}
+
+bool AccelBihCompact::ray_test(const Ray &ray_query, Float t_max) const
+{
+    NoStats stats;
+    return traverse_any(ray_query, t_max, stats);
+}
+
+bool AccelBihCompact::ray_test_stats(const Ray &ray_query, Float t_max, TraceStats &stats) const
+{
+    return traverse_any(ray_query, t_max, stats);
+}
+
+bool AccelBihCompact::clip_root(const Ray &r, Float t_max, Float &t_near, Float &t_far) const
+{
+    Vec3f t0 = (root_bounds.pmin - r.O) * r.iD;
+    Vec3f t1 = (root_bounds.pmax - r.O) * r.iD;
+    t_near = std::max(min(t0, t1).max(), Float(0));
+    t_far  = std::min(max(t0, t1).min(), t_max);
+    return !nodes.empty() && t_near <= t_far;
+}
+
+template <class Stats>
+bool AccelBihCompact::traverse_closest(const Ray &ray_query, HitInfo &hit_info, Stats &stats) const
+{
+    struct stack_item { Uint node_index; Float t_near, t_far; };
+    stack_item stack[STACK_SIZE];
+    Uint sp = 0;
+
+    // Only the root has a box, children are clipped by planes
+    Float t_near, t_far;
+    stats.box();
+    if (!clip_root(ray_query, hit_info.t(), t_near, t_far))
+        return false;
+
+    bool any_hit = false;
+    Uint node_index = 0;
+    while (true) {
+        const BihNode &node = nodes[node_index];
+        stats.node();
+        if (node.is_leaf()) {
+            Float t = hit_info.t();
+            intersect_leaf(node.items[0], node.items[0] + node.items[1], ray_query, hit_info, stats);
+            any_hit |= hit_info.t() < t;
+        } else {
+            // near child is the left one for positive direction
+            Uint  axis       = node.axis();
+            Uint  s          = ray_query.iD[axis] < 0;
+            Float t_near_cut = (node.clip[s]     - ray_query.O[axis]) * ray_query.iD[axis];
+            Float t_far_cut  = (node.clip[1 - s] - ray_query.O[axis]) * ray_query.iD[axis];
+            Uint  near_child = node.left_child() + s;
+            Uint  far_child  = node.left_child() + 1 - s;
+            bool  hit_near   = t_near <= t_near_cut;
+            bool  hit_far    = t_far_cut <= t_far;
+
+            if (hit_near) {
+                if (hit_far)
+                    stack[sp++] = { far_child, std::max(t_near, t_far_cut), t_far };
+                node_index = near_child;
+                t_far = std::min(t_far, t_near_cut);
+                continue;
+            }
+            if (hit_far) {
+                node_index = far_child;
+                t_near = std::max(t_near, t_far_cut);
+                continue;
+            }
+        }
+
+        // pop the next node, that is not behind the closest hit
+        do {
+            if (!sp)
+                return any_hit;
+            --sp;
+        } while (stack[sp].t_near > hit_info.t());
+        node_index = stack[sp].node_index;
+        t_near     = stack[sp].t_near;
+        t_far      = std::min(stack[sp].t_far, hit_info.t());
+    }
+}
+
+
+template <class Stats>
+bool AccelBihCompact::traverse_any(const Ray &ray_query, Float t_max, Stats &stats) const
+{
+    struct stack_item { Uint node_index; Float t_near, t_far; };
+    stack_item stack[STACK_SIZE];
+    Uint sp = 0;
+
+    Float t_near, t_far;
+    stats.box();
+    if (!clip_root(ray_query, t_max, t_near, t_far))
+        return false;
+
+    Uint node_index = 0;
+    while (true) {
+        const BihNode &node = nodes[node_index];
+        stats.node();
+        if (node.is_leaf()) {
+            if (test_leaf(node.items[0], node.items[0] + node.items[1], ray_query, t_max, stats))
+                return true;
+        } else {
+            Uint  axis       = node.axis();
+            Uint  s          = ray_query.iD[axis] < 0;
+            Float t_near_cut = (node.clip[s]     - ray_query.O[axis]) * ray_query.iD[axis];
+            Float t_far_cut  = (node.clip[1 - s] - ray_query.O[axis]) * ray_query.iD[axis];
+            Uint  near_child = node.left_child() + s;
+            Uint  far_child  = node.left_child() + 1 - s;
+            bool  hit_near   = t_near <= t_near_cut;
+            bool  hit_far    = t_far_cut <= t_far;
+
+            if (hit_near) {
+                if (hit_far)
+                    stack[sp++] = { far_child, std::max(t_near, t_far_cut), t_far };
+                node_index = near_child;
+                t_far = std::min(t_far, t_near_cut);
+                continue;
+            }
+            if (hit_far) {
+                node_index = far_child;
+                t_near = std::max(t_near, t_far_cut);
+                continue;
+            }
+        }
+
+        if (!sp)
+            return false;
+        --sp;
+        node_index = stack[sp].node_index;
+        t_near     = stack[sp].t_near;
+        t_far      = stack[sp].t_far;
+    }
+}
+
+
+void AccelBihCompact::build()
+{
+    double build_timer = timer();
+
+    // polygon bounds are needed by every partition step, so they are computed once
+    Uint cnt = m_poly.size();
+    prepare_prims();
+    root_bounds = prim_bbox_in(Vec2u(0, cnt)).padded();
+
+    nodes.clear();
+    nodes.reserve(2 * cnt / std::max(m_params.leaf_size, Uint(1)) + 1);
+    nodes.emplace_back();
+
+    last_build_cost = 0.0f;
+    build_node_recursive(0, 0, cnt, root_bounds, root_bounds, 0);
+    release_prims();
+    cache_poly();
+    m_built = true;
+
+    last_build_time = timer(build_timer);
+}
+
+void AccelBihCompact::leaf_ranges(std::vector<Vec2u> &leaves) const
+{
+    for (const BihNode &node : nodes) {
+        if (node.is_leaf())
+            leaves.push_back({node.items[0], node.items[0] + node.items[1]});
+    }
+}
+
+bool AccelBihCompact::save(BinWriter &out) const
+{
+    out.write(m_poly);
+    out.write(nodes);
+    out.write(root_bounds);
+    out.write(last_build_cost);
+    out.write(last_build_time);
+    return out.ok();
+}
+
+bool AccelBihCompact::load(BinReader &in)
+{
+    if (!in.read(m_poly) || !in.read(nodes) || !in.read(root_bounds) || !in.read(last_build_cost) ||
+        !in.read(last_build_time) || nodes.empty())
+        return false;
+    cache_poly();
+    m_built = true;
+    return true;
+}
+
+
+// Recursive build, splits the grid cell in the middle of its longest axis
+void AccelBihCompact::build_node_recursive(Uint node_index, Uint start, Uint end, AABB node_bounds, AABB grid_bounds,
+                                           Uint depth)
+{
+    Uint max_leaf = std::max(m_params.leaf_size, Uint(1));
+    while (end - start > max_leaf && depth < MAX_DEPTH) {
+        Uint  axis  = grid_bounds.longest_axis();
+        Float split = (grid_bounds.pmin[axis] + grid_bounds.pmax[axis]) * 0.5f;
+        // cell too small to be split again (polygons with equal centers)
+        if (!(split > grid_bounds.pmin[axis] && split < grid_bounds.pmax[axis]))
+            break;
+
+        // in-place partition by bounding box centers, clip planes are gathered on the way
+        Uint  i = start, j = end;
+        Float left_max = -InfF, right_min = InfF;
+        const Float *lo = m_prims.pmin[axis].data();
+        const Float *hi = m_prims.pmax[axis].data();
+        while (i < j) {
+            Uint p = m_poly[i] - m_range[0];
+            if (lo[p] + hi[p] < 2 * split) {
+                left_max = std::max(left_max, hi[p] + EpsF);
+                ++i;
+            } else {
+                right_min = std::min(right_min, lo[p] - EpsF);
+                std::swap(m_poly[i], m_poly[--j]);
+            }
+        }
+
+        // all polygons on one side: continue in that half of the cell without making a node
+        if (i == start) {
+            grid_bounds.pmin[axis] = split;
+            continue;
+        }
+        if (i == end) {
+            grid_bounds.pmax[axis] = split;
+            continue;
+        }
+
+        Uint left_idx = nodes.size();
+        nodes.emplace_back();
+        nodes.emplace_back();
+        nodes[node_index].clip[0] = left_max;
+        nodes[node_index].clip[1] = right_min;
+        nodes[node_index].flags   = left_idx << 2 | axis;
+
+        AABB left_bounds = node_bounds, right_bounds = node_bounds;
+        AABB left_grid   = grid_bounds, right_grid   = grid_bounds;
+        left_bounds.pmax[axis]  = left_max;
+        right_bounds.pmin[axis] = right_min;
+        left_grid.pmax[axis]    = split;
+        right_grid.pmin[axis]   = split;
+        build_node_recursive(left_idx,     start, i,   left_bounds,  left_grid,  depth + 1);
+        build_node_recursive(left_idx + 1, i,     end, right_bounds, right_grid, depth + 1);
+        return;
+    }
+
+    BihNode &leaf = nodes[node_index];
+    leaf.items[0] = start;
+    leaf.items[1] = end - start;
+    leaf.flags    = 3;
+    last_build_cost += node_bounds.area() * leaf_cost(end - start);
+    add_progress(end - start);
+}
+
+
+// Refit clip planes bottom-up
+AABB AccelBihCompact::refit_node(Uint node_index)
+{
+    BihNode &node = nodes[node_index];
+    if (node.is_leaf()) {
+        AABB bounds;
+        for (Uint i = node.items[0]; i < node.items[0] + node.items[1]; ++i)
+            bounds.expand(vert(i).bbox());
+        return bounds;
+    }
+    AABB left  = refit_node(node.left_child());
+    AABB right = refit_node(node.left_child() + 1);
+    node.clip[0] = left.pmax[node.axis()];
+    node.clip[1] = right.pmin[node.axis()];
+    return left + right;
+}
+
+void AccelBihCompact::update()
+{
+    if (nodes.empty())
+        return build();
+    double refit_timer = timer();
+    root_bounds = refit_node(0);
+    cache_poly();
+    m_refit.refits++;
+    m_refit.time = timer(refit_timer);
+}
+
+#undef STACK_SIZE
+#undef MAX_DEPTH
@@ -0,0 +1,155 @@
+/**
+ * @file acc_bih_compact.h
+ * @brief Compact Bounding Interval Hierarchy acceleration structure header.
+ *
+ * Canonical variant of the BIH paper (Wächter, Keller 2006):
+ * https://citeseerx.ist.psu.edu/document?repid=rep1&type=pdf&doi=e69d95ce461af2b88c7d3822b7be52eea8dd3af7
+ * Nodes keep only the two clip planes, splits are taken from the global bounds grid.
+ * AccelBih stays as the SAH variant.
+ *
+ * @author Marek Konečný
+ * @date 2025-05-07
+ */
+#pragma once
+
+#include "accel.h"
+#include <vector>
+
+/**
+ * @brief BIH with 12-byte nodes and O(n log n) in-place global grid build.
+ */
+class AccelBihCompact : public Accel {
+public:
+    /**
+     * @brief Doesn't build, that is left to make_accel().
+     * @param m_scene
+     * @param params Build settings, leaf_size limits polygons in a leaf.
+     */
+    explicit AccelBihCompact(const Scene &m_scene, const BuildParams &params = BuildParams())
+        : Accel(m_scene, Accel_t::BIHCompact, params)
+    {
+    }
+
+    /**
+     * @brief Intersect a ray with all polygons, recording the closest hit.
+     * @param ray_query Query ray.
+     * @param hit_info Hit information.
+     * @return True if any polygon is hit.
+     */
+    bool intersect(const Ray &ray_query, HitInfo &hit_info) const override;
+
+    /**
+     * @brief Test whether ray hits any polygon.
+     * @param ray_query Query ray.
+     * @param t_max Maximum ray parameter (distance).
+     * @return True if ray hits something before t_max.
+     */
+    bool ray_test(const Ray &ray_query, Float t_max = InfF) const override;
+
+    /**
+     * @brief intersect() counting visited nodes and box/polygon tests.
+     * @param stats Counters to add to.
+     */
+    bool intersect_stats(const Ray &ray_query, HitInfo &hit_info, TraceStats &stats) const override;
+
+    /**
+     * @brief ray_test() counting visited nodes and box/polygon tests.
+     * @param stats Counters to add to.
+     */
+    bool ray_test_stats(const Ray &ray_query, Float t_max, TraceStats &stats) const override;
+
+    /**
+     * @brief Moves clip planes to the moved polygons, the tree topology is kept.
+     */
+    void update() override;
+
+    /**
+     * @brief Full BIH rebuild.
+     */
+    void build() override;
+
+    /**
+     * @brief Leaves as ranges of m_poly, for leaf packs.
+     * @param leaves Output ranges.
+     */
+    void leaf_ranges(std::vector<Vec2u> &leaves) const override;
+
+    /**
+     * @brief Stores nodes and polygon order for the scene cache.
+     * @param out Cache file writer.
+     * @return True if written.
+     */
+    bool save(BinWriter &out) const override;
+
+    /**
+     * @brief Restores nodes and polygon order written by save().
+     * @param in Cache file reader.
+     * @return True if the structure is usable.
+     */
+    bool load(BinReader &in) override;
+
+    size_t nodes_cnt()  const override { return nodes.size(); }
+    double build_time() const override { return last_build_time; }
+    Float  sah_cost()   const override { return root_bounds.area() > 0 ? last_build_cost / root_bounds.area() : 0; }
+    size_t mem_size()   const override { return poly_mem() + nodes.size() * sizeof(BihNode); }
+
+private:
+    /**
+     * @brief BIH node, children are stored in pairs (right = left + 1).
+     * @note  12B.
+     */
+    struct BihNode {
+        union {
+            Float clip[2];   // Inner: upper bound of left child, lower bound of right child
+            Uint  items[2];  // Leaf: first polygon in m_poly, polygon count
+        };
+        Uint flags;          // Low 2 bits: split axis (0=x,1=y,2=z) or 3 for leaf, rest: left child index
+
+        inline bool is_leaf()    const { return (flags & 3) == 3; }
+        inline Uint axis()       const { return flags & 3; }
+        inline Uint left_child() const { return flags >> 2; }
+    };
+
+    /**
+     * @brief Closest-hit traversal kernel.
+     * @tparam Stats TraceStats to count traversal steps, NoStats compiles the counting out.
+     */
+    template <class Stats>
+    bool traverse_closest(const Ray &ray_query, HitInfo &hit_info, Stats &stats) const;
+
+    /**
+     * @brief Any-hit traversal kernel.
+     * @tparam Stats TraceStats to count traversal steps, NoStats compiles the counting out.
+     */
+    template <class Stats>
+    bool traverse_any(const Ray &ray_query, Float t_max, Stats &stats) const;
+
+    /**
+     * @brief Clips the ray by the root bounds.
+     * @param t_max  Current maximum t.
+     * @param t_near Returned entry t.
+     * @param t_far  Returned exit t.
+     * @return True if the ray passes the root bounds before t_max.
+     */
+    bool clip_root(const Ray &ray_query, Float t_max, Float &t_near, Float &t_far) const;
+
+    /**
+     * @brief Recursively splits polygons [start,end) in place by the middle of the grid cell.
+     * @param node_index Index in nodes of the current node.
+     * @param node_bounds Bounds of the node given by clip planes of its ancestors.
+     * @param grid_bounds Cell of the global bounds grid, halved on every split.
+     * @param depth Depth of the node.
+     */
+    void build_node_recursive(Uint node_index, Uint start, Uint end, AABB node_bounds, AABB grid_bounds, Uint depth);
+
+    /**
+     * @brief Recomputes clip planes of the subtree, returns its bounds.
+     * @param node_index Root of the subtree.
+     */
+    AABB refit_node(Uint node_index);
+
+    std::vector<BihNode> nodes;                // All BIH nodes in flat array
+    AABB                 root_bounds;          // Bounds of all polygons, clip planes start from them
+    Float                last_build_cost  = 0; // SAH cost of leaves from last build
+    double               last_build_time  = 0; // Last build time
+};
@@ -1,6 +1,9 @@
 #include "acc_bvh.h"
+#include "morton.h"
+#include <algorithm>
+#include <future>
 
-std::pair<Float, Uint> AccelBvh::split_poly(const Vec2u &rng, const AABB &bbox) {
+std::pair<Float, Uint> AccelBvh::split_poly(const Vec2u &rng, const AABB &bbox, Uint &axis) {
 	struct bins {
 		AABB box;
 		Uint cnt = 0;
@@ -10,33 +13,64 @@ std::pair<Float, Uint> AccelBvh::split_poly(const Vec2u &rng, const AABB &bbox)
 		Uint cnt = 0;
 	};
 
-	Uint axis = bbox.longest_axis();
+	axis = bbox.longest_axis();
 	Float fplane = bbox.center()[axis];
 	Float fcost = 1e30f;
-	constexpr Uint no_bins = 32;
-	// For each axist
-	for (Uint a = 0; a < 3; a++) {
-		// Create n bins
-		bins bin[no_bins];
-		// Compute scale for indexing
-		Float scale = no_bins / (bbox.pmax[a] - bbox.pmin[a]);
+	const Uint no_bins = bin_cnt();
+	// Bins for all 3 axes
+	struct binning {
+		bins bin[3][max_bins];
+	};
+	// Compute scale for indexing
+	Vec3f scale = Float(no_bins) / (bbox.pmax - bbox.pmin);
 
-		// Fill bin bboxes with all polygons in rng
-		for (Uint i = rng[0]; i < rng[1]; i++) {
-			auto box = vert(i);
-			Int id = (box.center()[a] - bbox.pmin[a]) * scale;
-			id = std::max(std::min(id, Int(no_bins - 1)), 0);
-			bin[id].cnt++;
-			for(Uint k = 0; k < 3; k++){
-				bin[id].box.expand(box.data[k]);
+	// Fill bin bboxes with polygons in (beg, end)
+	auto fill = [&](Uint beg, Uint end, binning &b) {
+		for (Uint i = beg; i < end; i++) {
+			AABB box = prim_bbox(i);
+			Vec3f c = prim_cent(i);
+			for (Uint a = 0; a < 3; a++) {
+				Int id = (c[a] - bbox.pmin[a]) * scale[a];
+				id = std::max(std::min(id, Int(no_bins - 1)), 0);
+				b.bin[a][id].cnt++;
+				b.bin[a][id].box.expand(box);
+			}
+		}
+	};
+
+	binning all;
+	Uint size = rng[1] - rng[0];
+	if (m_params.parallel && size >= bin_task_size) {
+		// Bin chunks on separate threads and merge them afterwards
+		Uint tasks = std::max(1u, std::min(std::thread::hardware_concurrency(), size / (bin_task_size / 4)));
+		std::vector<binning> part(tasks);
+		std::vector<std::future<void>> fut;
+		for (Uint t = 0; t < tasks; t++) {
+			Uint beg = rng[0] + size_t(size) * t / tasks;
+			Uint end = rng[0] + size_t(size) * (t + 1) / tasks;
+			fut.push_back(std::async(std::launch::async, fill, beg, end, std::ref(part[t])));
+		}
+		for (Uint t = 0; t < tasks; t++) {
+			fut[t].wait();
+			for (Uint a = 0; a < 3; a++) {
+				for (Uint i = 0; i < no_bins; i++) {
+					all.bin[a][i].box.expand(part[t].bin[a][i].box);
+					all.bin[a][i].cnt += part[t].bin[a][i].cnt;
+				}
 			}
 		}
+	} else {
+		fill(rng[0], rng[1], all);
+	}
 
-		layer L[no_bins - 1], R[no_bins - 1];
+	// For each axis
+	for (Uint a = 0; a < 3; a++) {
+		const bins *bin = all.bin[a];
+		layer L[max_bins - 1], R[max_bins - 1];
 		bins lbin, rbin;
 
 		// Test all possible bin combinations
-		for (Int i = 0; i < no_bins - 1; i++) {
+		for (Uint i = 0; i < no_bins - 1; i++) {
 			lbin.box.expand(bin[i].box);
 			rbin.box.expand(bin[no_bins - 1 - i].box);
 			L[i].area = lbin.box.area();
@@ -50,7 +84,7 @@ std::pair<Float, Uint> AccelBvh::split_poly(const Vec2u &rng, const AABB &bbox)
 		// Find the best split combination
 		for (Uint i = 0; i < no_bins - 1; i++) {
 			plane += step;
-			Float cost = L[i].area * L[i].cnt + R[i].area * R[i].cnt;
+			Float cost = L[i].area * leaf_cost(L[i].cnt) + R[i].area * leaf_cost(R[i].cnt);
 			if (cost < fcost) {
 				axis = a;
 				fplane = plane;
@@ -61,28 +95,564 @@ std::pair<Float, Uint> AccelBvh::split_poly(const Vec2u &rng, const AABB &bbox)
 	Uint split = sort_poly(rng, axis, fplane);
 	return {fcost, split};
 }
-void AccelBvh::split_bvh(Uint node, Float &build_cost) {
+void AccelBvh::split_bvh(Uint node, Float &build_cost, Uint depth) {
 	const AABB &bbox = m_bvh[node].bbox;
 	Uint be = m_bvh[node].rng[0];
 	Uint en = m_bvh[node].rng[1];
 	Uint size = en - be;
-	float pcost = bbox.area() * size;
+	Float pcost = bbox.area() * leaf_cost(size);
 
 	if (size > m_node_size) {
-		auto [cost, mi] = split_poly(m_bvh[node].rng, bbox);
-		if (mi > be && mi < en && cost < pcost) {
-			m_bvh[node].rng = {m_bvh.size() + 1, m_bvh.size()};
-			Vec2u left(be, mi);
-			Vec2u right(mi, en);
-			m_bvh.emplace_back(bbox_in(left), left);
-			m_bvh.emplace_back(bbox_in(right), right);
-			split_bvh(m_bvh[node].rng[0], build_cost);
-			split_bvh(m_bvh[node].rng[1], build_cost);
+		Uint axis;
+		auto [cost, mi] = split_poly(m_bvh[node].rng, bbox, axis);
+		if (mi > be && mi < en && cost < bbox.area() * leaf_cost(size)) {
+			Uint left = alloc_nodes();
+			Vec2u lrng(be, mi);
+			Vec2u rrng(mi, en);
+			m_bvh[left] = Node(prim_bbox_in(lrng), lrng);
+			m_bvh[left + 1] = Node(prim_bbox_in(rrng), rrng);
+			m_bvh[node].set_children(left, axis);
+			if (depth < m_task_depth && size >= task_size) {
+				// Left subtree goes to a new task, right one stays on this thread
+				Float lcost = 0;
+				auto task = std::async(std::launch::async, [&]() { split_bvh(left, lcost, depth + 1); });
+				split_bvh(left + 1, build_cost, depth + 1);
+				task.wait();
+				build_cost += lcost;
+			} else {
+				split_bvh(left, build_cost, depth + 1);
+				split_bvh(left + 1, build_cost, depth + 1);
+			}
 		} else
 			{
 				build_cost += pcost;
+				add_progress(size);
 				//println(cost,pcost, m_bvh[node].rng[1] - m_bvh[node].rng[0]);
 			}
-	} else
+	} else {
 		build_cost += pcost;
+		add_progress(size);
+	}
+}
+
+void AccelBvh::build_lbvh(Float &build_cost) {
+	Uint n = m_poly.size();
+	// Normalize centers to the bounds of all centers
+	AABB cbox;
+	for (Uint i = 0; i < n; i++) {
+		cbox.expand(prim_cent(i));
+	}
+	Vec3f scale = rcp(max(cbox.pmax - cbox.pmin, Vec3f(Eps6F)));
+	m_codes.resize(n);
+	auto encode = [&](Uint beg, Uint end) {
+		for (Uint i = beg; i < end; i++) {
+			m_codes[i] = morton3((prim_cent(i) - cbox.pmin) * scale);
+		}
+	};
+	if (m_params.parallel && n >= bin_task_size) {
+		Uint tasks = std::thread::hardware_concurrency();
+		std::vector<std::future<void>> fut;
+		for (Uint t = 0; t < tasks; t++) {
+			fut.push_back(std::async(std::launch::async, encode, size_t(n) * t / tasks, size_t(n) * (t + 1) / tasks));
+		}
+		for (auto &f : fut)
+			f.wait();
+	} else {
+		encode(0, n);
+	}
+	radix_sort(m_codes, m_poly, 30);
+
+	if (m_params.bvh_build == BvhBuild_t::LBVH) {
+		emit_lbvh(0, build_cost);
+	} else {
+		// Group runs of equal top bits into clusters
+		m_sorted = m_poly;
+		m_sorted_codes = m_codes;
+		m_clusters.clear();
+		for (Uint i = 0; i < n;) {
+			Uint j = i + 1;
+			while (j < n && (m_codes[j] >> cluster_bits) == (m_codes[i] >> cluster_bits))
+				j++;
+			m_clusters.push_back({Vec2u(i, j), prim_bbox_in(Vec2u(i, j))});
+			i = j;
+		}
+		emit_hlbvh(0, Vec2u(0, m_clusters.size()), build_cost);
+	}
+	m_codes = {};
+	m_sorted_codes = {};
+	m_sorted = {};
+	m_clusters = {};
+}
+
+void AccelBvh::split_lazy(Uint node) {
+	const AABB &bbox = m_bvh[node].bbox;
+	Uint be = m_bvh[node].rng[0];
+	Uint en = m_bvh[node].rng[1];
+	Uint size = en - be;
+	if (size > m_node_size && m_level[node] < lazy_depth) {
+		Uint axis;
+		auto [cost, mi] = split_poly(m_bvh[node].rng, bbox, axis);
+		if (mi > be && mi < en && cost < bbox.area() * leaf_cost(size)) {
+			Uint left = alloc_nodes();
+			Vec2u lrng(be, mi);
+			Vec2u rrng(mi, en);
+			m_bvh[left] = Node(prim_bbox_in(lrng), lrng);
+			m_bvh[left + 1] = Node(prim_bbox_in(rrng), rrng);
+			for (Uint c : {left, left + 1}) {
+				m_level[c] = m_level[node] + 1;
+				m_state[c].store(Pending, std::memory_order_relaxed);
+			}
+			m_bvh[node].set_children(left, axis);
+			return;
+		}
+	}
+	// Splits above reordered the polygons, so cached copies of the leaf are refreshed
+	recache_leaf(m_bvh[node].rng);
+	add_progress(size);
+}
+
+AABB AccelBvh::emit_lbvh(Uint node, Float &build_cost, Uint depth) {
+	Uint be = m_bvh[node].rng[0];
+	Uint en = m_bvh[node].rng[1];
+	Uint size = en - be;
+	if (size <= m_node_size) {
+		AABB box = prim_bbox_in(m_bvh[node].rng);
+		m_bvh[node].bbox = box;
+		build_cost += box.area() * leaf_cost(size);
+		add_progress(size);
+		return box;
+	}
+	// Split, where the highest differing bit flips, equal codes are split in the middle
+	Uint mi = (be + en) / 2;
+	Uint axis = 0;
+	uint32_t diff = m_codes[be] ^ m_codes[en - 1];
+	if (diff) {
+		axis = morton_axis(highest_bit(diff));
+		uint32_t bit = 1u << highest_bit(diff);
+		auto it = std::partition_point(m_codes.begin() + be, m_codes.begin() + en, [bit](uint32_t c) { return !(c & bit); });
+		mi = it - m_codes.begin();
+	}
+	Uint left = alloc_nodes();
+	m_bvh[left] = Node(AABB(), Vec2u(be, mi));
+	m_bvh[left + 1] = Node(AABB(), Vec2u(mi, en));
+	m_bvh[node].set_children(left, axis);
+	AABB lbox, rbox;
+	if (depth < m_task_depth && size >= task_size) {
+		Float lcost = 0;
+		auto task = std::async(std::launch::async, [&]() { lbox = emit_lbvh(left, lcost, depth + 1); });
+		rbox = emit_lbvh(left + 1, build_cost, depth + 1);
+		task.wait();
+		build_cost += lcost;
+	} else {
+		lbox = emit_lbvh(left, build_cost, depth + 1);
+		rbox = emit_lbvh(left + 1, build_cost, depth + 1);
+	}
+	m_bvh[node].bbox = lbox + rbox;
+	return m_bvh[node].bbox;
+}
+
+AABB AccelBvh::emit_hlbvh(Uint node, Vec2u cl, Float &build_cost, Uint depth) {
+	Uint be = m_bvh[node].rng[0];
+	Uint en = m_bvh[node].rng[1];
+	if (cl[1] - cl[0] == 1 || en - be <= m_node_size) {
+		// Move cluster polygons to their final place and continue with LBVH
+		Uint dst = be;
+		for (Uint c = cl[0]; c < cl[1]; c++) {
+			for (Uint i = m_clusters[c].rng[0]; i < m_clusters[c].rng[1]; i++, dst++) {
+				m_poly[dst] = m_sorted[i];
+				m_codes[dst] = m_sorted_codes[i];
+			}
+		}
+		return emit_lbvh(node, build_cost, depth);
+	}
+
+	struct bins {
+		AABB box;
+		Uint cnt = 0;
+	};
+	const Uint no_bins = bin_cnt();
+	AABB cbox;
+	for (Uint c = cl[0]; c < cl[1]; c++) {
+		cbox.expand(m_clusters[c].box.center());
+	}
+	// Binned SAH over cluster centers
+	Uint axis = cbox.longest_axis();
+	Int fbin = -1;
+	Float fcost = 1e30f;
+	Vec3f scale = Float(no_bins) / max(cbox.pmax - cbox.pmin, Vec3f(Eps6F));
+	auto bin_of = [&](const Cluster &c, Uint a) {
+		Int id = (c.box.center()[a] - cbox.pmin[a]) * scale[a];
+		return std::max(std::min(id, Int(no_bins - 1)), 0);
+	};
+	for (Uint a = 0; a < 3; a++) {
+		bins bin[max_bins];
+		for (Uint c = cl[0]; c < cl[1]; c++) {
+			auto &b = bin[bin_of(m_clusters[c], a)];
+			b.box.expand(m_clusters[c].box);
+			b.cnt += m_clusters[c].rng[1] - m_clusters[c].rng[0];
+		}
+		Float rarea[max_bins];
+		Uint rcnt[max_bins];
+		bins acc;
+		for (Int i = no_bins - 1; i > 0; i--) {
+			acc.box.expand(bin[i].box);
+			acc.cnt += bin[i].cnt;
+			rarea[i] = acc.box.area();
+			rcnt[i] = acc.cnt;
+		}
+		acc = bins();
+		for (Uint i = 1; i < no_bins; i++) {
+			acc.box.expand(bin[i - 1].box);
+			acc.cnt += bin[i - 1].cnt;
+			if (!acc.cnt || !rcnt[i])
+				continue;
+			Float cost = acc.box.area() * leaf_cost(acc.cnt) + rarea[i] * leaf_cost(rcnt[i]);
+			if (cost < fcost) {
+				fcost = cost;
+				fbin = i;
+				axis = a;
+			}
+		}
+	}
+	Uint cmid = (cl[0] + cl[1]) / 2;
+	if (fbin >= 0) {
+		auto it = std::partition(m_clusters.begin() + cl[0], m_clusters.begin() + cl[1],
+								 [&](const Cluster &c) { return bin_of(c, axis) < fbin; });
+		cmid = it - m_clusters.begin();
+	}
+	Uint mi = be;
+	for (Uint c = cl[0]; c < cmid; c++) {
+		mi += m_clusters[c].rng[1] - m_clusters[c].rng[0];
+	}
+
+	Uint left = alloc_nodes();
+	m_bvh[left] = Node(AABB(), Vec2u(be, mi));
+	m_bvh[left + 1] = Node(AABB(), Vec2u(mi, en));
+	m_bvh[node].set_children(left, axis);
+	AABB lbox, rbox;
+	if (depth < m_task_depth && en - be >= task_size) {
+		Float lcost = 0;
+		auto task = std::async(std::launch::async, [&]() { lbox = emit_hlbvh(left, Vec2u(cl[0], cmid), lcost, depth + 1); });
+		rbox = emit_hlbvh(left + 1, Vec2u(cmid, cl[1]), build_cost, depth + 1);
+		task.wait();
+		build_cost += lcost;
+	} else {
+		lbox = emit_hlbvh(left, Vec2u(cl[0], cmid), build_cost, depth + 1);
+		rbox = emit_hlbvh(left + 1, Vec2u(cmid, cl[1]), build_cost, depth + 1);
+	}
+	m_bvh[node].bbox = lbox + rbox;
+	return m_bvh[node].bbox;
+}
+
+void AccelBvh::build_sbvh(Float &build_cost) {
+	Uint n = m_poly.size();
+	std::vector<SbvhRef> refs(n);
+	AABB root;
+	for (Uint i = 0; i < n; i++) {
+		refs[i] = {m_poly[i], prim_bbox(i)};
+		root.expand(refs[i].box);
+	}
+	m_root_area = root.area();
+	m_dup_left = Int(n * m_params.sbvh_budget);
+	m_ref_cnt = 0;
+	m_poly.resize(n + m_dup_left);
+	m_bvh[0].bbox = root;
+	split_sbvh(0, refs, build_cost);
+	m_poly.resize(m_ref_cnt);
+	m_poly.shrink_to_fit();
+}
+
+void AccelBvh::split_sbvh(Uint node, std::vector<SbvhRef> &refs, Float &build_cost, Uint depth) {
+	struct bins {
+		AABB box;
+		Uint cnt = 0;
+		Uint enter = 0;
+		Uint exit = 0;
+	};
+	const Uint no_bins = bin_cnt();
+	const AABB bbox = m_bvh[node].bbox;
+	Uint size = refs.size();
+	Float pcost = bbox.area() * leaf_cost(size);
+
+	// Best split so far
+	Float fcost = pcost;
+	Uint faxis = 0;
+	Int fbin = -1;
+	bool spatial = false;
+
+	if (size > m_node_size) {
+		// Object split, binned by centers of reference boxes
+		AABB cbox;
+		for (auto &ref : refs)
+			cbox.expand(ref.box.center());
+		Vec3f cscale = Float(no_bins) / max(cbox.pmax - cbox.pmin, Vec3f(Eps6F));
+		auto obin = [&](const SbvhRef &ref, Uint a) {
+			Int id = (ref.box.center()[a] - cbox.pmin[a]) * cscale[a];
+			return std::max(std::min(id, Int(no_bins - 1)), 0);
+		};
+		AABB lbest, rbest;
+		for (Uint a = 0; a < 3; a++) {
+			bins bin[max_bins];
+			for (auto &ref : refs) {
+				auto &b = bin[obin(ref, a)];
+				b.box.expand(ref.box);
+				b.cnt++;
+			}
+			AABB rbox[max_bins];
+			Uint rcnt[max_bins];
+			bins acc;
+			for (Int i = no_bins - 1; i > 0; i--) {
+				acc.box.expand(bin[i].box);
+				acc.cnt += bin[i].cnt;
+				rbox[i] = acc.box;
+				rcnt[i] = acc.cnt;
+			}
+			acc = bins();
+			for (Uint i = 1; i < no_bins; i++) {
+				acc.box.expand(bin[i - 1].box);
+				acc.cnt += bin[i - 1].cnt;
+				if (!acc.cnt || !rcnt[i])
+					continue;
+				Float cost = acc.box.area() * leaf_cost(acc.cnt) + rbox[i].area() * leaf_cost(rcnt[i]);
+				if (cost < fcost) {
+					fcost = cost;
+					faxis = a;
+					fbin = i;
+					lbest = acc.box;
+					rbest = rbox[i];
+				}
+			}
+		}
+
+		// Spatial split, only when object children overlap enough and budget remains
+		AABB overlap(max(lbest.pmin, rbest.pmin), min(lbest.pmax, rbest.pmax));
+		bool try_spatial = fbin < 0 || (overlap.valid() && overlap.area() > m_params.sbvh_alpha * m_root_area);
+		if (try_spatial && m_dup_left > 0) {
+			Vec3f step = (bbox.pmax - bbox.pmin) / Float(no_bins);
+			for (Uint a = 0; a < 3; a++) {
+				if (step[a] <= 0)
+					continue;
+				auto sbin = [&](Float x) {
+					Int id = (x - bbox.pmin[a]) / step[a];
+					return std::max(std::min(id, Int(no_bins - 1)), 0);
+				};
+				bins bin[max_bins];
+				for (auto &ref : refs) {
+					Int b0 = sbin(ref.box.pmin[a]);
+					Int b1 = sbin(ref.box.pmax[a]);
+					bin[b0].enter++;
+					bin[b1].exit++;
+					if (b0 == b1) {
+						bin[b0].box.expand(ref.box);
+						continue;
+					}
+					// Chop the reference into bins
+					auto V = m_scene.get_vert(ref.idx);
+					for (Int b = b0; b <= b1; b++) {
+						AABB slab = ref.box;
+						slab.pmin[a] = std::max(slab.pmin[a], bbox.pmin[a] + step[a] * b);
+						slab.pmax[a] = std::min(slab.pmax[a], bbox.pmin[a] + step[a] * (b + 1));
+						AABB part = V.clip_bbox(slab);
+						if (part.valid())
+							bin[b].box.expand(part);
+					}
+				}
+				AABB rbox[max_bins];
+				Uint rcnt[max_bins];
+				bins acc;
+				for (Int i = no_bins - 1; i > 0; i--) {
+					acc.box.expand(bin[i].box);
+					acc.cnt += bin[i].exit;
+					rbox[i] = acc.box;
+					rcnt[i] = acc.cnt;
+				}
+				acc = bins();
+				for (Uint i = 1; i < no_bins; i++) {
+					acc.box.expand(bin[i - 1].box);
+					acc.cnt += bin[i - 1].enter;
+					if (!acc.cnt || !rcnt[i])
+						continue;
+					Float cost = acc.box.area() * leaf_cost(acc.cnt) + rbox[i].area() * leaf_cost(rcnt[i]);
+					if (cost < fcost) {
+						fcost = cost;
+						faxis = a;
+						fbin = i;
+						spatial = true;
+					}
+				}
+			}
+		}
+	}
+
+	if (fbin >= 0 && fcost < pcost) {
+		std::vector<SbvhRef> lrefs, rrefs;
+		lrefs.reserve(size);
+		rrefs.reserve(size);
+		if (spatial) {
+			Float plane = bbox.pmin[faxis] + (bbox.pmax[faxis] - bbox.pmin[faxis]) * fbin / Float(no_bins);
+			for (auto &ref : refs) {
+				if (ref.box.pmax[faxis] <= plane) {
+					lrefs.push_back(ref);
+				} else if (ref.box.pmin[faxis] >= plane) {
+					rrefs.push_back(ref);
+				} else if (m_dup_left.fetch_sub(1) > 0) {
+					// Straddling reference is split into two clipped ones
+					auto V = m_scene.get_vert(ref.idx);
+					AABB lbox = ref.box, rbox = ref.box;
+					lbox.pmax[faxis] = plane;
+					rbox.pmin[faxis] = plane;
+					lbox = V.clip_bbox(lbox);
+					rbox = V.clip_bbox(rbox);
+					if (lbox.valid())
+						lrefs.push_back({ref.idx, lbox.padded()});
+					if (rbox.valid())
+						rrefs.push_back({ref.idx, rbox.padded()});
+					if (!lbox.valid() && !rbox.valid())
+						(ref.box.center()[faxis] < plane ? lrefs : rrefs).push_back(ref);
+				} else {
+					// Out of budget, keep it whole
+					(ref.box.center()[faxis] < plane ? lrefs : rrefs).push_back(ref);
+				}
+			}
+		} else {
+			AABB cbox;
+			for (auto &ref : refs)
+				cbox.expand(ref.box.center());
+			Float scale = no_bins / std::max(cbox.pmax[faxis] - cbox.pmin[faxis], Eps6F);
+			for (auto &ref : refs) {
+				Int id = (ref.box.center()[faxis] - cbox.pmin[faxis]) * scale;
+				id = std::max(std::min(id, Int(no_bins - 1)), 0);
+				(id < fbin ? lrefs : rrefs).push_back(ref);
+			}
+		}
+		if (!lrefs.empty() && !rrefs.empty()) {
+			refs = {};
+			AABB lbox, rbox;
+			for (auto &ref : lrefs)
+				lbox.expand(ref.box);
+			for (auto &ref : rrefs)
+				rbox.expand(ref.box);
+			Uint left = alloc_nodes();
+			m_bvh[left] = Node(lbox, Vec2u(0, 0));
+			m_bvh[left + 1] = Node(rbox, Vec2u(0, 0));
+			m_bvh[node].set_children(left, faxis);
+			if (depth < m_task_depth && size >= task_size) {
+				Float lcost = 0;
+				auto task = std::async(std::launch::async, [&]() { split_sbvh(left, lrefs, lcost, depth + 1); });
+				split_sbvh(left + 1, rrefs, build_cost, depth + 1);
+				task.wait();
+				build_cost += lcost;
+			} else {
+				split_sbvh(left, lrefs, build_cost, depth + 1);
+				split_sbvh(left + 1, rrefs, build_cost, depth + 1);
+			}
+			return;
+		}
+		// Failed split, everything goes to a single leaf
+		refs.clear();
+		refs.insert(refs.end(), lrefs.begin(), lrefs.end());
+		refs.insert(refs.end(), rrefs.begin(), rrefs.end());
+		size = refs.size();
+		pcost = bbox.area() * leaf_cost(size);
+	}
+
+	// Leaf, append references to m_poly
+	Uint beg = m_ref_cnt.fetch_add(size);
+	for (Uint i = 0; i < size; i++) {
+		m_poly[beg + i] = refs[i].idx;
+	}
+	m_bvh[node].rng = {beg, beg + size};
+	build_cost += pcost;
+	add_progress(size);
+	refs = {};
+}
+
+Float AccelBvh::refit_bvh(Uint node, Uint depth) {
+	Node &n = m_bvh[node];
+	// Subtrees without moved vertices keep their boxes
+	if (n.empty() || !m_scene.dirty(m_vspan[node]))
+		return 0;
+	Float old = n.bbox.area();
+	if (n.leaf()) {
+		n.bbox = bbox_in(n.rng);
+		recache_leaf(n.rng);
+		return (n.bbox.area() - old) * node_cost(n);
+	}
+	Uint left = n.left();
+	Float delta = 0;
+	if (depth < m_task_depth) {
+		Float ldelta = 0;
+		auto task = std::async(std::launch::async, [&]() { ldelta = refit_bvh(left, depth + 1); });
+		delta += refit_bvh(left + 1, depth + 1);
+		task.wait();
+		delta += ldelta;
+	} else {
+		delta += refit_bvh(left, depth + 1);
+		delta += refit_bvh(left + 1, depth + 1);
+	}
+	delta += rotate_bvh(node);
+	n.bbox = m_bvh[left].bbox + m_bvh[left + 1].bbox;
+	m_height[node] = std::max(m_height[left], m_height[left + 1]) + 1;
+	return delta + n.bbox.area() - old;
+}
+
+// Tree rotations (Kopta et al. 2012), children of node are refit already
+// Only the box of the sibling receiving the grandchild changes, the node keeps its box
+Float AccelBvh::rotate_bvh(Uint node) {
+	Uint l = m_bvh[node].left();
+	Float best = 0;
+	Uint child = 0, grand = 0, side = 0;
+	for (Uint a : {l, l + 1}) {
+		Uint b = a == l ? l + 1 : l;
+		const Node &sib = m_bvh[b];
+		if (!sib.parent())
+			continue;
+		for (Uint g : {sib.left(), sib.right()}) {
+			Uint keep = g == sib.left() ? sib.right() : sib.left();
+			Float gain = sib.bbox.area() - (m_bvh[a].bbox + m_bvh[keep].bbox).area();
+			// Small gains would only swap nodes back and forth between updates
+			if (gain > best && gain > 0.01f * sib.bbox.area()) {
+				best = gain;
+				child = a;
+				grand = g;
+				side = b;
+			}
+		}
+	}
+	if (best <= 0)
+		return 0;
+	swap_nodes(child, grand);
+	Node &sib = m_bvh[side];
+	sib.bbox = m_bvh[sib.left()].bbox + m_bvh[sib.right()].bbox;
+	m_vspan[side] = span_union(m_vspan[sib.left()], m_vspan[sib.right()]);
+	m_height[side] = std::max(m_height[sib.left()], m_height[sib.right()]) + 1;
+	fix_axis(side);
+	fix_axis(node);
+	m_rotations++;
+	return -best;
+}
+
+void AccelBvh::swap_nodes(Uint a, Uint b) {
+	std::swap(m_bvh[a], m_bvh[b]);
+	std::swap(m_vspan[a], m_vspan[b]);
+	std::swap(m_height[a], m_height[b]);
+	for (Uint i : {a, b}) {
+		if (m_bvh[i].parent()) {
+			m_parent[m_bvh[i].left()] = i;
+			m_parent[m_bvh[i].right()] = i;
+		}
+	}
+}
+
+void AccelBvh::fix_axis(Uint node) {
+	Uint l = m_bvh[node].left();
+	Vec3f d = m_bvh[l + 1].bbox.center() - m_bvh[l].bbox.center();
+	Uint axis = 0;
+	for (Uint a = 1; a < 3; a++) {
+		if (std::abs(d[a]) > std::abs(d[axis]))
+			axis = a;
+	}
+	if (d[axis] < 0)
+		swap_nodes(l, l + 1);
+	m_bvh[node].set_children(l, axis);
 }
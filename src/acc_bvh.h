@@ -1,10 +1,13 @@
 #pragma once
 // Created by Ondrej Ac (xacond00)
 #include "accel.h"
+#include "packet.h"
+#include <atomic>
+#include <thread>
 // BVH tree
 // Uses binned BVH building and fast updates
 class AccelBvh : public Accel {
-
+  protected:
 	// 32B BVH node
 	struct Node {
 		Node() {}
@@ -18,17 +21,69 @@ class AccelBvh : public Accel {
 		bool leaf() const { return rng[0] < rng[1]; }
 		bool parent() const { return rng[0] > rng[1]; }
 		bool empty() const { return rng[0] == rng[1]; }
+		// Children are allocated next to each other, parent keeps the left one in rng[1]
+		// and the split axis in rng[0] = left + 1 + axis
+		void set_children(Uint left, Uint axis) { rng = {left + 1 + axis, left}; }
+		Uint left() const { return rng[1]; }
+		Uint right() const { return rng[1] + 1; }
+		Uint axis() const { return rng[0] - rng[1] - 1; }
+		// Child lying first along the split axis in ray direction
+		Uint near(const Ray &r) const { return rng[1] + r.sgn[axis()]; }
+		Uint far(const Ray &r) const { return rng[1] + 1 - r.sgn[axis()]; }
+	};
+
+	// SBVH polygon reference with bounds of its (clipped) part
+	struct SbvhRef {
+		Uint idx;
+		AABB box;
 	};
 
   public:
-	AccelBvh(const Scene &scene, Uint node_size = 8) : Accel(scene, Accel_t::BVH), m_node_size(node_size) {
-		build();
-	}
+	AccelBvh(const Scene &scene, Uint node_size = 8, const BuildParams &params = BuildParams())
+		: Accel(scene, Accel_t::BVH, params), m_node_size(node_size) {}
+	// Over one mesh of the scene, for the bottom level of AccelTlas
+	AccelBvh(const Scene &scene, Vec2u range, Uint node_size, const BuildParams &params)
+		: Accel(scene, Accel_t::BVH, range, params), m_node_size(node_size) {}
 
 	// virtual ~AccelBvh() {}
 
 	bool intersect(const Ray &r, HitInfo &rec) const override {
-#if 0
+		NoStats st;
+		return closest_hit(r, rec, st);
+	}
+	bool intersect_stats(const Ray &r, HitInfo &rec, TraceStats &st) const override { return closest_hit(r, rec, st); }
+
+	template <class S>
+	bool closest_hit(const Ray &r, HitInfo &rec, S &st) const {
+		// Fixed stack could overflow on degenerate trees, lazy tree has no parent links
+		if (!m_lazy && (m_traversal == Traversal_t::Stackless || m_depth + 1 >= 64))
+			return traverse_stackless<false>(r, rec, rec.t(), st);
+		if (m_traversal == Traversal_t::Ordered)
+			return intersect_ordered(r, rec, st);
+		constexpr Uint stack_size = 64;
+		Uint stack[stack_size];
+		Uint sptr = 0;
+		stack[sptr++] = 0;
+		while (sptr) {
+			const Node &node = node_at(stack[--sptr]);
+			st.node();
+			st.box();
+			if (node.bbox.ray_test(r, rec.t())) {
+				if (node.parent()) {
+					stack[sptr++] = node.right();
+					stack[sptr++] = node.left();
+				} else {
+					intersect_leaf(node.rng[0], node.rng[1], r, rec, st);
+				}
+			}
+		}
+		return rec.idx != Uint(-1);
+	}
+
+	// Front to back traversal, near child along the split axis is visited first
+	// Entries are culled on pop, once their entry distance is behind the closest hit
+	template <class S>
+	bool intersect_ordered(const Ray &r, HitInfo &rec, S &st) const {
 		constexpr Uint stack_size = 64;
 		struct Stack {
 			Uint idx;
@@ -36,76 +91,102 @@ class AccelBvh : public Accel {
 		};
 		Stack stack[stack_size];
 		Uint sptr = 0;
-
-		stack[sptr++] = {0, rec.t()}; //, rec.t()};
-		if (!m_bvh[0].bbox.ray_test(r, stack[0].t))
+		Float t = rec.t();
+		st.box();
+		if (!m_bvh[0].bbox.ray_dist(r, t))
 			return false;
+		stack[sptr++] = {0, t};
 		while (sptr) {
-			Stack st = stack[--sptr];
-			if (st.t > rec.t())
+			Stack top = stack[--sptr];
+			if (top.t >= rec.t())
 				continue;
-			const Node &node = m_bvh[st.idx];
+			const Node &node = node_at(top.idx);
+			st.node();
 			if (node.parent()) {
-				float t1 = rec.t(), t2 = rec.t();
-				bool h1 = m_bvh[node.rng[1]].bbox.ray_dist(r, t1);
-				bool h2 = m_bvh[node.rng[0]].bbox.ray_dist(r, t2);
-				if (h1 && h2) {
-					bool lt = t1 > t2;
-					if (lt) {
-						std::swap(t1, t2);
-					}
-					stack[sptr++] = {node.rng[lt], t2};
-					stack[sptr++] = {node.rng[!lt], t1};
-				} else if (h1)
-					stack[sptr++] = {node.rng[1], t1};
-				else if (h2)
-					stack[sptr++] = {node.rng[0], t2};
+				Uint near = node.near(r), far = node.far(r);
+				Float tn = rec.t(), tf = rec.t();
+				st.box(2);
+				if (m_bvh[far].bbox.ray_dist(r, tf))
+					stack[sptr++] = {far, tf};
+				if (m_bvh[near].bbox.ray_dist(r, tn))
+					stack[sptr++] = {near, tn};
 			} else {
-				for (Uint i = node.rng[0]; i < node.rng[1]; i++) {
-					poly(i).intersect(r, rec);
-				}
+				intersect_leaf(node.rng[0], node.rng[1], r, rec, st);
 			}
 		}
-#else
+		return rec.idx != Uint(-1);
+	}
+
+	// Closest hits of a coherent packet, results go to p.rec
+	// Node is skipped once the interval test or all active rays of the packet miss it,
+	// near child is chosen by direction signs of the first ray
+	void intersect_packet(RayPacket &p) const {
+		p.finalize();
+		if (m_depth + 1 >= 64) {
+			for (Uint i = 0; i < p.cnt; i++)
+				intersect(p.rays[i], p.rec[i]);
+			return;
+		}
 		constexpr Uint stack_size = 64;
-		Uint stack[stack_size];
+		struct Stack {
+			Uint idx;
+			uint64_t mask;
+		};
+		Stack stack[stack_size];
 		Uint sptr = 0;
-		stack[sptr++] = 0;
+		stack[sptr++] = {0, p.active()};
 		while (sptr) {
-			const Node &node = m_bvh[stack[--sptr]];
-			if (node.bbox.ray_test(r, rec.t())) {
-				if (node.parent()) {
-					stack[sptr++] = node.rng[0];
-					stack[sptr++] = node.rng[1];
-				} else {
-					for (Uint i = node.rng[0]; i < node.rng[1]; i++) {
-						poly(i).intersect(r, rec);
+			Stack st = stack[--sptr];
+			const Node &node = node_at(st.idx);
+			if (!p.interval_test(node.bbox))
+				continue;
+			uint64_t mask = p.hit(node.bbox, st.mask);
+			if (!mask)
+				continue;
+			if (node.parent()) {
+				Uint sgn = p.sgn[node.axis()];
+				stack[sptr++] = {node.left() + 1 - sgn, mask};
+				stack[sptr++] = {node.left() + sgn, mask};
+			} else {
+				for (Uint i = node.rng[0]; i < node.rng[1]; i++) {
+					Poly tri = poly(i);
+					for (uint64_t m = mask; m; m &= m - 1) {
+						Uint k = RayPacket::lane_first64(m);
+						tri.intersect(p.rays[k], p.rec[k]);
 					}
 				}
+				p.update(mask);
 			}
 		}
-
-#endif
-		return rec.idx != -1;
 	}
 
+	// Any hit is enough, so children are not ordered
 	bool ray_test(const Ray &r, Float t = InfF) const override {
+		NoStats st;
+		return any_hit(r, t, st);
+	}
+	bool ray_test_stats(const Ray &r, Float t, TraceStats &st) const override { return any_hit(r, t, st); }
+
+	template <class S>
+	bool any_hit(const Ray &r, Float t, S &st) const {
+		if (!m_lazy && (m_traversal == Traversal_t::Stackless || m_depth + 1 >= 1024)) {
+			HitInfo rec;
+			return traverse_stackless<true>(r, rec, t, st);
+		}
 		constexpr Uint stack_size = 1024;
 		Uint stack[stack_size];
 		Uint sptr = 0;
 		stack[sptr++] = 0;
 		while (sptr) {
-			const Node &node = m_bvh[stack[--sptr]];
+			const Node &node = node_at(stack[--sptr]);
+			st.node();
+			st.box();
 			if (node.bbox.ray_test(r, t)) {
 				if (node.parent()) {
-					stack[sptr++] = node.rng[0];
-					stack[sptr++] = node.rng[1];
-				} else {
-					for (Uint i = node.rng[0]; i < node.rng[1]; i++) {
-						if (poly(i).ray_test(r, t)) {
-							return true;
-						}
-					}
+					stack[sptr++] = node.right();
+					stack[sptr++] = node.left();
+				} else if (test_leaf(node.rng[0], node.rng[1], r, t, st)) {
+					return true;
 				}
 			}
 		}
@@ -114,32 +195,139 @@ class AccelBvh : public Accel {
 
 	int hit_edge(const Ray &r) const override {
 		constexpr Uint stack_size = 1024;
+		if (m_depth + 1 >= stack_size)
+			return -1;
 		Uint stack[stack_size];
 		Uint sptr = 0;
 		stack[sptr++] = 0;
 		int depth = 0;
 		while (sptr) {
-			const Node &node = m_bvh[stack[--sptr]];
+			const Node &node = node_at(stack[--sptr]);
 			auto [hit, edge] = node.bbox.hit_edge2(r);
 			if(edge){
 				return depth;
 			}
 			if (hit && node.parent()) {
 				depth++;
-				stack[sptr++] = node.rng[0];
-				stack[sptr++] = node.rng[1];
+				stack[sptr++] = node.right();
+				stack[sptr++] = node.left();
 			}
 		}
 		return -1;
 	}
 
+	// Stackless traversal following parent links (Hapala et al. 2011)
+	// The only per-ray state is current node and where we came from
+	// With any == true returns on the first hit before t, otherwise finds closest hit in rec
+	template <bool any, class S>
+	bool traverse_stackless(const Ray &r, HitInfo &rec, Float t, S &st) const {
+		enum { FromParent, FromSibling, FromChild } state = FromParent;
+		auto tmax = [&]() { return any ? t : rec.t(); };
+		// Returns true, when any-hit traversal can end
+		auto visit_leaf = [&](const Node &node) {
+			if constexpr (any)
+				return test_leaf(node.rng[0], node.rng[1], r, t, st);
+			intersect_leaf(node.rng[0], node.rng[1], r, rec, st);
+			return false;
+		};
+		st.node();
+		st.box();
+		if (!m_bvh[0].bbox.ray_test(r, tmax()))
+			return false;
+		if (!m_bvh[0].parent())
+			return visit_leaf(m_bvh[0]) || rec.idx != Uint(-1);
+		Uint cur = m_bvh[0].near(r);
+		while (true) {
+			if (state == FromChild) {
+				if (cur == 0)
+					break;
+				Uint par = m_parent[cur];
+				if (cur == m_bvh[par].near(r)) {
+					cur = m_bvh[par].far(r);
+					state = FromSibling;
+				} else {
+					cur = par;
+				}
+				continue;
+			}
+			const Node &node = m_bvh[cur];
+			st.node();
+			st.box();
+			bool hit = node.bbox.ray_test(r, tmax());
+			if (hit && node.parent()) {
+				cur = node.near(r);
+				state = FromParent;
+				continue;
+			}
+			if (hit && visit_leaf(node))
+				return true;
+			// Continue with the far sibling of the near child, otherwise go up
+			if (state == FromParent) {
+				cur = m_bvh[m_parent[cur]].far(r);
+				state = FromSibling;
+			} else {
+				cur = m_parent[cur];
+				state = FromChild;
+			}
+		}
+		return rec.idx != Uint(-1);
+	}
+
+	// Fills parent links and tree depth, children always follow their parent in m_bvh
+	// Links children to parents, finds subtree heights, vertex spans and SAH of all nodes
+	// Children don't have to follow their parents in the array after tree rotations
+	void link_nodes() {
+		m_parent.assign(m_bvh.size(), 0);
+		m_height.assign(m_bvh.size(), 0);
+		m_vspan.assign(m_bvh.size(), Vec2u(Uint(-1), 0));
+		// Parents first
+		std::vector<Uint> order;
+		order.reserve(m_bvh.size());
+		order.push_back(0);
+		for (Uint k = 0; k < order.size(); k++) {
+			const Node &node = m_bvh[order[k]];
+			if (node.parent()) {
+				for (Uint c : {node.left(), node.right()}) {
+					m_parent[c] = order[k];
+					order.push_back(c);
+				}
+			}
+		}
+		m_update_cost = 0;
+		for (Uint k = order.size(); k-- > 0;) {
+			Uint i = order[k];
+			const Node &node = m_bvh[i];
+			if (node.parent()) {
+				m_height[i] = std::max(m_height[node.left()], m_height[node.right()]) + 1;
+				m_vspan[i] = span_union(m_vspan[node.left()], m_vspan[node.right()]);
+			} else if (node.leaf()) {
+				m_vspan[i] = leaf_span(node.rng);
+			}
+			if (!node.empty())
+				m_update_cost += node.bbox.area() * node_cost(node);
+		}
+		m_depth = m_height[0];
+	}
+
+	void set_traversal(Traversal_t traversal) { m_traversal = traversal; }
+
+	// Leaves of the lazy tree don't exist yet, so it has no leaf packs
+	void leaf_ranges(std::vector<Vec2u> &leaves) const override {
+		if (m_lazy)
+			return;
+		for (const Node &node : m_bvh) {
+			if (node.leaf())
+				leaves.push_back(node.rng);
+		}
+	}
+
 	// Partially sorts poly indices in rng (beg, end)
 	// Returns split index where they meet
 	Uint sort_poly(const Vec2u &rng, Uint axis, Float plane) {
 		Int i = rng[0];
 		Int j = rng[1] - 1;
 		while (i <= j) {
-			if (vert(i).center()[axis] < plane)
+			if (prim_cent(i, axis) < plane)
 				i++;
 			else
 				std::swap(m_poly[i], m_poly[j--]);
@@ -148,60 +336,257 @@ class AccelBvh : public Accel {
 	}
 	// Split polygons according to binned SAH metric
 	// Returns cost and split index
-	std::pair<Float, Uint> split_poly(const Vec2u &rng, const AABB &bbox);
+	std::pair<Float, Uint> split_poly(const Vec2u &rng, const AABB &bbox, Uint &axis);
+
+	// Linear BVH over morton codes of polygon centers
+	// HLBVH variant builds top levels with binned SAH over morton clusters
+	void build_lbvh(Float &build_cost);
+
+	// Emits LBVH hierarchy of node from sorted m_codes, returns its bbox
+	AABB emit_lbvh(Uint node, Float &build_cost, Uint depth = 0);
+
+	// Splits clusters (beg, end) of node with binned SAH, returns its bbox
+	AABB emit_hlbvh(Uint node, Vec2u clusters, Float &build_cost, Uint depth = 0);
+
+	// Spatial split BVH, straddling polygons may be referenced by both children
+	void build_sbvh(Float &build_cost);
+
+	// Split node with references refs, either by objects or by space
+	void split_sbvh(Uint node, std::vector<SbvhRef> &refs, Float &build_cost, Uint depth = 0);
 
 	// Split bvh node
 	// Supposes the node already exists
-	void split_bvh(Uint node, Float &build_cost);
+	// Subtrees above the task threshold get built in parallel up to depth m_task_depth
+	void split_bvh(Uint node, Float &build_cost, Uint depth = 0);
 
+	// Lazy build: node idx, pending nodes are split first
+	// Traversal is const, but splitting a pending node only adds to the tree
+	const Node &node_at(Uint idx) const {
+		if (m_lazy && m_state[idx].load(std::memory_order_acquire) != Ready)
+			const_cast<AccelBvh *>(this)->refine(idx);
+		return m_bvh[idx];
+	}
+	// First thread reaching a pending node splits it, others wait until its children are ready
+	void refine(Uint idx) {
+		uint8_t state = Pending;
+		if (m_state[idx].compare_exchange_strong(state, Busy, std::memory_order_acquire)) {
+			split_lazy(idx);
+			m_state[idx].store(Ready, std::memory_order_release);
+			return;
+		}
+		while (m_state[idx].load(std::memory_order_acquire) != Ready)
+			std::this_thread::yield();
+	}
+	// One binned SAH split of a pending node into two pending children, or a leaf
+	void split_lazy(Uint node);
+	// Lazy tree is not complete until every node was reached
+	bool lazy() const { return m_lazy; }
+
+	// Refits subtrees using moved vertices in parallel and rotates their nodes to keep SAH from drifting
+	// Falls back to build(), when SAH of all nodes still grows over 1.2x of the built tree
 	void update_bvh() {
 		double t1 = timer();
-		float cost = 0;
-		for (int i = m_bvh.size() - 1; i >= 0; i--) {
-			auto &node = m_bvh[i];
-			if (node.leaf()) {
-				node.bbox = bbox_in(node.rng);
-				cost += node.bbox.area() * (node.rng[1] - node.rng[0]);
-			} else {
-				node.bbox = m_bvh[node.rng[0]].bbox + m_bvh[node.rng[1]].bbox;
-			}
-		}
-		// print("Cost", cost, m_build_cost);
-		if (cost > 1.2 * m_build_cost)
+		m_task_depth = task_depth();
+		m_rotations = 0;
+		m_update_cost += refit_bvh(0, 0);
+		m_depth = m_height[0];
+		m_refit.rotations = m_rotations;
+		if (m_update_cost > 1.2f * m_fit_cost) {
 			build();
-		else
-			m_update_cost = cost;
+			m_refit.rebuilds++;
+		} else {
+			m_refit.refits++;
+		}
+		m_refit.time = timer(t1);
 	}
 
+	// Lazy tree has no refit data, it starts over from the root instead
 	void update() override {
+		if (m_lazy) {
+			double t1 = timer();
+			build();
+			m_refit.rebuilds++;
+			m_refit.time = timer(t1);
+			return;
+		}
 		update_bvh();
 		m_built = true;
 	};
 
 	void build() override {
 		double build_timer = timer();
+		m_progress.store(0);
+		// Wide trees are collapsed from the complete binary tree
+		m_lazy = m_params.bvh_build == BvhBuild_t::Lazy && m_type == Accel_t::BVH;
 
+		// Preallocate for the worst case, so parallel tasks can append nodes
 		m_bvh.clear();
-		m_bvh.reserve(1024);
-		m_bvh.emplace_back(m_scene.m_bbox, Vec2u(0, m_poly.size()));
+		size_t max_refs = m_poly.size();
+		if (m_params.bvh_build == BvhBuild_t::SBVH) {
+			// References are recreated from scratch
+			for (Uint i = 0; i < m_poly.size(); i++)
+				m_poly[i] = m_range[0] + i;
+			max_refs += m_poly.size() * m_params.sbvh_budget;
+		}
+		m_bvh.resize(std::max<size_t>(1, 2 * max_refs));
+		m_bvh[0] = Node(range_bbox(), Vec2u(0, m_poly.size()));
+		m_node_cnt = 1;
+		m_task_depth = task_depth();
+		prepare_prims();
+		if (m_lazy) {
+			// Only the root exists, prims stay for the splits during traversal
+			m_state = std::vector<std::atomic<uint8_t>>(m_bvh.size());
+			m_level.assign(m_bvh.size(), 0);
+			m_state[0].store(Pending);
+			m_parent = {};
+			m_vspan = {};
+			m_height = {};
+			m_depth = 0;
+			m_build_cost = 0;
+			cache_poly();
+			m_built = true;
+			m_build_time = timer(build_timer);
+			return;
+		}
+		m_state = std::vector<std::atomic<uint8_t>>();
+		m_level = {};
 		Float cost = 0;
-		split_bvh(0, cost);
+		if (m_params.bvh_build == BvhBuild_t::Binned || m_params.bvh_build == BvhBuild_t::Lazy)
+			split_bvh(0, cost);
+		else if (m_params.bvh_build == BvhBuild_t::SBVH)
+			build_sbvh(cost);
+		else
+			build_lbvh(cost);
+		release_prims();
+		m_bvh.resize(m_node_cnt);
+		m_bvh.shrink_to_fit();
+		link_nodes();
 		m_build_cost = cost;
-		m_update_cost = cost;
+		m_fit_cost = m_update_cost;
+		cache_poly();
 		m_built = true;
 
 		m_build_time = timer(build_timer);
 	}
 
+	bool save(BinWriter &out) const override {
+		if (m_lazy)
+			return false;
+		out.write(m_poly);
+		out.write(m_bvh);
+		out.write(m_build_cost);
+		out.write(m_build_time);
+		return out.ok();
+	}
+
+	bool load(BinReader &in) override {
+		if (!in.read(m_poly) || !in.read(m_bvh) || !in.read(m_build_cost) || !in.read(m_build_time) || m_bvh.empty())
+			return false;
+		for (Uint idx : m_poly)
+			if (idx >= m_scene.poly_cnt())
+				return false;
+		m_node_cnt = m_bvh.size();
+		link_nodes();
+		m_fit_cost = m_update_cost;
+		cache_poly();
+		m_built = true;
+		return true;
+	}
+
 	// Getters
-	size_t nodes_cnt()  const override { return m_bvh.size(); }
+	size_t nodes_cnt()  const override { return m_lazy ? m_node_cnt.load() : m_bvh.size(); }
 	double build_time() const override { return m_build_time; }
+	size_t mem_size() const override {
+		return poly_mem() + m_bvh.size() * sizeof(Node) + m_parent.size() * sizeof(Uint) + m_vspan.size() * sizeof(Vec2u) +
+			   m_height.size() * sizeof(uint16_t) + m_state.size() + m_level.size() + m_prims.mem_size();
+	}
+	Float sah_cost() const override { return m_build_cost / m_bvh[0].bbox.area(); }
+
+  protected:
+	// For structures derived from the binary tree, doesn't build
+	AccelBvh(const Scene &scene, Accel_t type, Uint node_size, const BuildParams &params)
+		: Accel(scene, type, params), m_node_size(node_size) {}
 
+	// Run of polygons sharing the top morton bits
+	struct Cluster {
+		Vec2u rng;
+		AABB box;
+	};
+	static constexpr Uint cluster_bits = 15;
+
+	enum LazyState : uint8_t { Ready, Pending, Busy };
+	// Lazy splits stop here, so the fixed traversal stacks can't overflow
+	static constexpr Uint lazy_depth = 60;
+
+	// Depth of the tree, up to which subtrees are built / refit on separate threads
+	Uint task_depth() const {
+		Uint depth = 0;
+		if (m_params.parallel) {
+			while ((1u << depth) < std::thread::hardware_concurrency())
+				depth++;
+			depth += 2;
+		}
+		return depth;
+	}
+
+	// SAH weight of the node area, traversal step for inner nodes
+	Float node_cost(const Node &node) const { return node.leaf() ? leaf_cost(node.rng[1] - node.rng[0]) : Float(1); }
+	static Vec2u span_union(Vec2u a, Vec2u b) { return Vec2u(std::min(a[0], b[0]), std::max(a[1], b[1])); }
+	// Range of vertices used by polygons of a leaf
+	Vec2u leaf_span(Vec2u rng) const {
+		Vec2u span(Uint(-1), 0);
+		for (Uint i = rng[0]; i < rng[1]; i++) {
+			const Vec3u &tri = m_scene.m_poly[m_poly[i]];
+			for (Uint k = 0; k < 3; k++)
+				span = span_union(span, Vec2u(tri[k], tri[k] + 1));
+		}
+		return span;
+	}
+
+	// Refits the subtree, returns the change of its SAH
+	Float refit_bvh(Uint node, Uint depth);
+	// Swaps a child of node with a grandchild from the other side, when it shrinks the other side
+	Float rotate_bvh(Uint node);
+	// Swaps subtrees at positions a and b
+	void swap_nodes(Uint a, Uint b);
+	// Sets split axis to the one separating children the most, with the lower child on the left
+	void fix_axis(Uint node);
+
+	// Atomically reserves a pair of sibling nodes
+	Uint alloc_nodes() { return m_node_cnt.fetch_add(2, std::memory_order_relaxed); }
+
+	// Minimal poly count to build subtree / bin polygons on separate threads
+	static constexpr Uint task_size = 1 << 12;
+	static constexpr Uint bin_task_size = 1 << 16;
+
+  public:
 	std::vector<Node> m_bvh;
+	std::vector<Uint> m_parent;
+	std::vector<Vec2u> m_vspan;		 // Vertices used by the subtree, for refits of moved ranges
+	std::vector<uint16_t> m_height; // Height of the subtree
+	std::atomic<Uint> m_node_cnt = 0;
+	std::atomic<Uint> m_rotations = 0;
+	Uint m_depth = 0;
+	Traversal_t m_traversal = Traversal_t::Ordered;
+	Uint m_task_depth = 0;
 	Uint m_node_size = 8;
-	Float m_update_cost = 0;
+	Float m_update_cost = 0; // SAH of all nodes after the last update
+	Float m_fit_cost = 0;	 // SAH of all nodes after the last build
 	Float m_build_cost = 0;
 	double m_build_time = 0;
+	// Temporary LBVH build data
+	std::vector<uint32_t> m_codes;
+	std::vector<uint32_t> m_sorted_codes;
+	std::vector<Uint> m_sorted;
+	std::vector<Cluster> m_clusters;
+	// Temporary SBVH build data
+	std::atomic<Uint> m_ref_cnt = 0;
+	std::atomic<Int> m_dup_left = 0;
+	Float m_root_area = 0;
+	// Lazy build data, nodes are Ready when state is empty
+	bool m_lazy = false;
+	std::vector<std::atomic<uint8_t>> m_state;
+	std::vector<uint8_t> m_level; // Depth of the node
 	// This points to the actual indices of triangles
 	// Need to use m_scene
 };
\ No newline at end of file
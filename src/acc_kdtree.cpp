@@ -8,10 +8,10 @@
  #include "acc_kdtree.h"
  #include <algorithm>
  
- AccelKdTree::AccelKdTree(const Scene& scene, unsigned inputNodeSize)
-     : Accel(scene, Accel_t::KdTree), nodeSize(inputNodeSize)
+ AccelKdTree::AccelKdTree(const Scene& scene, unsigned inputNodeSize, const BuildParams& params)
+     : Accel(scene, Accel_t::KdTree, params), nodeSize(inputNodeSize)
  {
-     build();
+     /* built by make_accel() */
  }
  
  /* override */
@@ -26,6 +26,12 @@
      return buildTime;
  }
  
+ /* override */
+ size_t AccelKdTree::mem_size() const
+ {
+     return poly_mem() + m_kdtree.size() * sizeof(Node);
+ }
+ 
  /* override */
  void AccelKdTree::update()
  {
@@ -43,48 +49,138 @@
      m_kdtree.emplace_back(m_scene.m_bbox, Vec2u(0, m_poly.size()));
  
      float cost = 0;
+     prepare_prims();
      splitKdtree(0, cost);
+     release_prims();
      buildCost = cost;
      updateCost = cost;
+     cache_poly();
      m_built = true;
  
      buildTime = timer(elapsedTime);
  }
  
+ /* override */
+ void AccelKdTree::leaf_ranges(std::vector<Vec2u>& leaves) const
+ {
+     for (const Node& node : m_kdtree)
+     {
+         if (node.isLeaf)
+         {
+             leaves.push_back(node.range);
+         }
+     }
+ }
+
+ /* override */
+ bool AccelKdTree::save(BinWriter& out) const
+ {
+     out.write(m_poly);
+     out.write(m_kdtree);
+     out.write(buildCost);
+     out.write(buildTime);
+     return out.ok();
+ }
+
+ /* override */
+ bool AccelKdTree::load(BinReader& in)
+ {
+     if (!in.read(m_poly) || !in.read(m_kdtree) || !in.read(buildCost) || !in.read(buildTime) || m_kdtree.empty())
+     {
+         return false;
+     }
+     updateCost = buildCost;
+     cache_poly();
+     m_built = true;
+     return true;
+ }
+
  /* override */
  bool AccelKdTree::intersect(const Ray& r, HitInfo& rec) const
  {
-     unsigned stack[64];
+     NoStats stats;
+     return closestHit(r, rec, stats);
+ }
+
+ /* override */
+ bool AccelKdTree::intersect_stats(const Ray& r, HitInfo& rec, TraceStats& stats) const
+ {
+     return closestHit(r, rec, stats);
+ }
+
+ /* override */
+ bool AccelKdTree::ray_test(const Ray& r, float t) const
+ {
+     NoStats stats;
+     return anyHit(r, t, stats);
+ }
+
+ /* override */
+ bool AccelKdTree::ray_test_stats(const Ray& r, float t, TraceStats& stats) const
+ {
+     return anyHit(r, t, stats);
+ }
+
+ template <class Stats>
+ bool AccelKdTree::closestHit(const Ray& r, HitInfo& rec, Stats& stats) const
+ {
+     struct StackEntry
+     {
+         unsigned idx;
+         float t;
+     };
+     StackEntry stack[64];
      unsigned sptr = 0;
-     stack[sptr++] = 0;
+
+     float rootT = rec.t();
+     stats.box();
+     if (!m_kdtree[0].box.ray_dist(r, rootT))
+     {
+         return false;
+     }
+     stack[sptr++] = {0, rootT};
  
-     /* traverse tree */
+     /* traverse tree front to back */
      while (sptr)
      {
-         const Node& node = m_kdtree[stack[--sptr]];
- 
-         /* check for ray x aabb collision */
-         if (node.box.ray_test(r, rec.t()))
+         StackEntry entry = stack[--sptr];
+
+         /* skip nodes entered behind the closest hit */
+         if (entry.t >= rec.t())
          {
-             if (node.isLeaf)
+             continue;
+         }
+         const Node& node = m_kdtree[entry.idx];
+         stats.node();
+
+         if (node.isLeaf)
+         {
+             intersect_leaf(node.range[0], node.range[1], r, rec, stats);
+         }
+         else
+         {
+             /* near child along split axis goes on top of the stack */
+             bool negative = r.sgn[node.axis];
+             unsigned nearChild = negative ? node.rightChild : node.leftChild;
+             unsigned farChild = negative ? node.leftChild : node.rightChild;
+             float nearT = rec.t();
+             float farT = rec.t();
+             stats.box(2);
+             if (m_kdtree[farChild].box.ray_dist(r, farT))
              {
-                 for (unsigned i = node.range[0]; i < node.range[1]; i++)
-                 {
-                     poly(i).intersect(r, rec);
-                 }
+                 stack[sptr++] = {farChild, farT};
              }
-             else
+             if (m_kdtree[nearChild].box.ray_dist(r, nearT))
              {
-                 stack[sptr++] = node.leftChild;
-                 stack[sptr++] = node.rightChild;
+                 stack[sptr++] = {nearChild, nearT};
              }
          }
      }
      return rec.idx != -1;
  }
  
- /* override */
- bool AccelKdTree::ray_test(const Ray& r, float t) const
+ template <class Stats>
+ bool AccelKdTree::anyHit(const Ray& r, float t, Stats& stats) const
  {
      unsigned stack[1024];
      unsigned sptr = 0;
@@ -94,18 +190,17 @@
      while (sptr)
      {
          const Node& node = m_kdtree[stack[--sptr]];
+         stats.node();
+         stats.box();
  
          /* check for ray x aabb collision */
          if (node.box.ray_test(r, t))
          {
              if (node.isLeaf)
              {
-                 for (unsigned i = node.range[0]; i < node.range[1]; i++)
+                 if (test_leaf(node.range[0], node.range[1], r, t, stats))
                  {
-                     if (poly(i).ray_test(r, t))
-                     {
-                         return true;
-                     }
+                     return true;
                  }
              }
              else
@@ -118,9 +213,9 @@
      return false;
  }
  
- std::pair<float, unsigned> AccelKdTree::splitPolygons(const Vec2u& range, const AABB& bbox)
+ std::pair<float, unsigned> AccelKdTree::splitPolygons(const Vec2u& range, const AABB& bbox, unsigned& axisOut)
  {
-     constexpr unsigned binCount = 32;
+     const unsigned binCount = bin_cnt();
      struct binStruct
      {
          AABB bounds;
@@ -134,7 +229,7 @@
     /* find best split axis (X, Y, or Z) */
      for (unsigned axis = 0; axis < 3; ++axis)
      {
-         binStruct bins[binCount];
+         binStruct bins[max_bins];
          float binSize = bbox.pmax[axis] - bbox.pmin[axis];
 
          /* ignore axis with zero length */ 
@@ -148,8 +243,8 @@
         /* bin polygons */
          for (unsigned i = range[0]; i < range[1]; ++i)
          {
-             const AABB& box = vert(i).bbox();
-             int binIdx = int((box.center()[axis] - bbox.pmin[axis]) * scale);
+             AABB box = prim_bbox(i).padded();
+             int binIdx = int((prim_mid(i, axis) - bbox.pmin[axis]) * scale);
              binIdx = std::clamp(binIdx, 0, int(binCount - 1));
              bins[binIdx].count++;
              bins[binIdx].bounds.expand(box);
@@ -159,12 +254,12 @@
          AABB leftBox;
          unsigned leftCount = 0;
  
-         AABB rightBoxes[binCount];
-         unsigned rightCounts[binCount] = {};
+         AABB rightBoxes[max_bins];
+         unsigned rightCounts[max_bins] = {};
  
          for (int i = binCount - 1; i >= 0; --i)
          {
-             if (i < binCount - 1)
+             if (i < int(binCount) - 1)
              {
                  rightBoxes[i] = rightBoxes[i + 1];
                  rightCounts[i] = rightCounts[i + 1];
@@ -179,7 +274,8 @@
              leftBox.expand(bins[i - 1].bounds);
              leftCount += bins[i - 1].count;
  
-             float cost = leftBox.area() * leftCount + rightBoxes[i].area() * rightCounts[i];
+             /* leaf cost accounts for SIMD packs */
+             float cost = leftBox.area() * leaf_cost(leftCount) + rightBoxes[i].area() * leaf_cost(rightCounts[i]);
              if (cost < bestCost)
              {
                  bestCost = cost;
@@ -191,33 +287,36 @@
  
     /* split polygons based on chosen axis and plane */
      unsigned splitIdx = sortPolygons(range, bestAxis, bestPlane);
+     axisOut = bestAxis;
      return {bestCost, splitIdx};
  }
  
  void AccelKdTree::splitKdtree(unsigned nodeIdx, float& buildCost)
  {
-     Node& node = m_kdtree[nodeIdx];
-     const AABB& bbox = node.box;
-     unsigned start = node.range[0];
-     unsigned end = node.range[1];
+     /* copies, emplace_back below may reallocate the nodes */
+     const AABB bbox = m_kdtree[nodeIdx].box;
+     const Vec2u range = m_kdtree[nodeIdx].range;
+     unsigned start = range[0];
+     unsigned end = range[1];
      unsigned size = end - start;
      float currentNodeCost = bbox.area() * size;
  
      if (size > nodeSize) {
-         auto [cost, mi] = splitPolygons(node.range, bbox);
+         unsigned axis = 0;
+         auto [cost, mi] = splitPolygons(range, bbox, axis);
  
-         if (mi > start && mi < end && cost < currentNodeCost)
+         if (mi > start && mi < end && cost < bbox.area() * leaf_cost(size))
          {
              Vec2u leftRange(start, mi);
              Vec2u rightRange(mi, end);
  
              unsigned leftIdx = m_kdtree.size();
-             m_kdtree.emplace_back(bbox_in(leftRange), leftRange);
+             m_kdtree.emplace_back(prim_bbox_in(leftRange), leftRange);
  
              unsigned rightIdx = m_kdtree.size();
-             m_kdtree.emplace_back(bbox_in(rightRange), rightRange);
+             m_kdtree.emplace_back(prim_bbox_in(rightRange), rightRange);
  
-             node = Node(bbox, leftIdx, rightIdx);
+             m_kdtree[nodeIdx] = Node(bbox, leftIdx, rightIdx, axis);
  
              splitKdtree(leftIdx, buildCost);
              splitKdtree(rightIdx, buildCost);
@@ -225,11 +324,13 @@
          else
          {
              buildCost += currentNodeCost;
+             add_progress(size);
          }
      }
      else
      {
          buildCost += currentNodeCost;
+         add_progress(size);
      }
  }
  
@@ -237,7 +338,7 @@
  {
      auto isPolygonInLeftTree = [&](int idx)
      {
-         return vert(idx).bbox().center()[axis] < plane;
+         return prim_mid(idx, axis) < plane;
      };
  
      int left = range[0];
@@ -289,5 +390,6 @@
      else
      {
          updateCost = totalCost;
+         cache_poly();
      }
  }
\ No newline at end of file
@@ -18,6 +18,8 @@
         bool isLeaf = false;
         unsigned leftChild;
         unsigned rightChild;
+        /* split axis, picks the near child for ordered traversal */
+        unsigned axis = 0;
  
 		/* constructors */
          Node() = default;
@@ -26,23 +28,29 @@
         {
             /* empty */
         }
-         Node(const AABB& b, unsigned left, unsigned right)
-             : box(b), isLeaf(false), leftChild(left), rightChild(right)
+         Node(const AABB& b, unsigned left, unsigned right, unsigned splitAxis)
+             : box(b), isLeaf(false), leftChild(left), rightChild(right), axis(splitAxis)
         {
             /* empty */
         }
      };
  
  public:
-     AccelKdTree(const Scene& scene, unsigned inputNodeSize = 8);
+     AccelKdTree(const Scene& scene, unsigned inputNodeSize = 8, const BuildParams& params = BuildParams());
  
      size_t nodes_cnt() const override;
      double build_time() const override;
+     size_t mem_size() const override;
  
      bool intersect(const Ray& r, HitInfo& rec) const override;
      bool ray_test(const Ray& r, float t = InfF) const override;
+     bool intersect_stats(const Ray& r, HitInfo& rec, TraceStats& stats) const override;
+     bool ray_test_stats(const Ray& r, float t, TraceStats& stats) const override;
      void update() override;
      void build() override;
+     void leaf_ranges(std::vector<Vec2u>& leaves) const override;
+     bool save(BinWriter& out) const override;
+     bool load(BinReader& in) override;
  
  private:
     std::vector<Node> m_kdtree;
@@ -51,8 +59,14 @@
     float buildCost = 0;
     double buildTime = 0;
 
+     /* traversal kernels, counters compile out with NoStats */
+     template <class Stats>
+     bool closestHit(const Ray& r, HitInfo& rec, Stats& stats) const;
+     template <class Stats>
+     bool anyHit(const Ray& r, float t, Stats& stats) const;
+
      unsigned sortPolygons(const Vec2u& range, unsigned axis, float plane);
-     std::pair<float, unsigned> splitPolygons(const Vec2u& range, const AABB& bbox);
+     std::pair<float, unsigned> splitPolygons(const Vec2u& range, const AABB& bbox, unsigned& axis);
      void splitKdtree(unsigned node, float& buildCost);
      void updateKdtree();
  };
\ No newline at end of file
@@ -0,0 +1,385 @@
+#pragma once
+// Created by Ondrej Ac (xacond00)
+#include "acc_bvh.h"
+#include "simd.h"
+#include <algorithm>
+#include <cmath>
+// Compressed wide BVH (BVH8Q)
+// Collapses the binary SAH tree like AccelWbvh, but child boxes are stored in 8 bits per plane
+// relative to the node frame (origin + power of two scale per axis), rounded outwards
+// Inner children are stored first, then leaves, so child and polygon indices are implicit
+template <Uint W>
+class AccelQbvh : public AccelBvh {
+	using Lane = Lane_t<W>;
+
+	// 80B for W = 8 (256B for the uncompressed BVH8 node)
+	struct alignas(16) QNode {
+		Vec3f origin;
+		int8_t exp[3] = {};
+		uint8_t inner = 0;		// Children [0, inner) are nodes
+		uint8_t used = 0;		// Children [inner, used) are leaves
+		Uint child = 0;			// First inner child node
+		Uint prim = 0;			// First polygon of the leaves, they follow each other
+		uint8_t cnt[W] = {};	// Polygon count of each leaf
+		uint8_t lo[3][W] = {};
+		uint8_t hi[3][W] = {};
+
+		// 2^exp built directly from float bits
+		Float scale(Uint a) const {
+			uint32_t bits = uint32_t(exp[a] + 127) << 23;
+			Float f;
+			memcpy(&f, &bits, 4);
+			return f;
+		}
+		AABB box(Uint i) const {
+			AABB b;
+			for (Uint a = 0; a < 3; a++) {
+				b.pmin[a] = origin[a] + lo[a][i] * scale(a);
+				b.pmax[a] = origin[a] + hi[a][i] * scale(a);
+			}
+			return b;
+		}
+		// Returns mask of children hit before t, entry distances go to mint
+		// Ray is moved into the node frame instead of decoding the boxes
+		Uint hit(const Vec3f &O, const Vec3f &iD, Float t, Lane &mint) const {
+			Lane tmin(0), tmax(t);
+			for (Uint a = 0; a < 3; a++) {
+				Lane sc(scale(a) * iD[a]);
+				Lane of((origin[a] - O[a]) * iD[a]);
+				Lane t1 = Lane::load_u8(lo[a]) * sc + of;
+				Lane t2 = Lane::load_u8(hi[a]) * sc + of;
+				tmin = max(tmin, min(t1, t2));
+				tmax = min(tmax, max(t1, t2));
+			}
+			mint = tmin;
+			return (tmin <= tmax) & ((1u << used) - 1);
+		}
+	};
+
+	struct Stack {
+		Uint child;
+		Uint cnt;
+		Float t;
+	};
+
+	// Child while collapsing: binary node, or run of polygons too long for one leaf
+	struct Entry {
+		AABB box;
+		Uint bnode;
+		Vec2u rng;
+		bool inner;
+	};
+
+	static constexpr Uint max_leaf = 255;
+
+  public:
+	AccelQbvh(const Scene &scene, Uint node_size = 8, const BuildParams &params = BuildParams())
+		: AccelBvh(scene, Accel_t::BVH8Q, node_size, params) {}
+
+	bool intersect(const Ray &r, HitInfo &rec) const override {
+		NoStats st;
+		return closest_hit(r, rec, st);
+	}
+	bool intersect_stats(const Ray &r, HitInfo &rec, TraceStats &st) const override { return closest_hit(r, rec, st); }
+
+	// One wide node visit counts W box tests
+	template <class S>
+	bool closest_hit(const Ray &r, HitInfo &rec, S &st) const {
+		constexpr Uint stack_size = 64 * W;
+		Stack stack[stack_size];
+		Uint sptr = 0;
+		stack[sptr++] = {0, 0, 0};
+		const Vec3f iD = safe_inv(r);
+		while (sptr) {
+			Stack top = stack[--sptr];
+			if (top.t >= rec.t())
+				continue;
+			st.node();
+			if (top.cnt) {
+				intersect_leaf(top.child, top.child + top.cnt, r, rec, st);
+				continue;
+			}
+			const QNode &node = m_qbvh[top.child];
+			st.box(W);
+			Lane mint;
+			Uint mask = node.hit(r.O, iD, rec.t(), mint);
+			if (!mask)
+				continue;
+			Float t[W];
+			mint.store(t);
+			// Push hit children sorted far to near, so the nearest one is popped first
+			Uint beg = sptr;
+			while (mask) {
+				Uint i = lane_first(mask);
+				mask &= mask - 1;
+				Stack item = child_entry(node, i, t[i]);
+				Uint j = sptr++;
+				while (j > beg && stack[j - 1].t < item.t) {
+					stack[j] = stack[j - 1];
+					j--;
+				}
+				stack[j] = item;
+			}
+		}
+		return rec.idx != Uint(-1);
+	}
+
+	bool ray_test(const Ray &r, Float t = InfF) const override {
+		NoStats st;
+		return any_hit(r, t, st);
+	}
+	bool ray_test_stats(const Ray &r, Float t, TraceStats &st) const override { return any_hit(r, t, st); }
+
+	template <class S>
+	bool any_hit(const Ray &r, Float t, S &st) const {
+		constexpr Uint stack_size = 64 * W;
+		Stack stack[stack_size];
+		Uint sptr = 0;
+		stack[sptr++] = {0, 0, 0};
+		const Vec3f iD = safe_inv(r);
+		while (sptr) {
+			Stack top = stack[--sptr];
+			st.node();
+			if (top.cnt) {
+				if (test_leaf(top.child, top.child + top.cnt, r, t, st))
+					return true;
+				continue;
+			}
+			const QNode &node = m_qbvh[top.child];
+			st.box(W);
+			Lane mint;
+			Uint mask = node.hit(r.O, iD, t, mint);
+			while (mask) {
+				Uint i = lane_first(mask);
+				mask &= mask - 1;
+				stack[sptr++] = child_entry(node, i, 0);
+			}
+		}
+		return false;
+	}
+
+	int hit_edge(const Ray &r) const override {
+		struct Item {
+			Uint node;
+			int depth;
+		};
+		std::vector<Item> stack = {{0, 0}};
+		while (!stack.empty()) {
+			Item top = stack.back();
+			stack.pop_back();
+			const QNode &node = m_qbvh[top.node];
+			for (Uint i = 0; i < node.used; i++) {
+				auto [hit, edge] = node.box(i).hit_edge2(r);
+				if (edge)
+					return top.depth;
+				if (hit && i < node.inner)
+					stack.push_back({node.child + i, top.depth + 1});
+			}
+		}
+		return -1;
+	}
+
+	// Polygons are reordered for the compressed leaves, so the binary tree is dropped
+	// and every update rebuilds
+	void update() override {
+		double t1 = timer();
+		build();
+		m_refit.rebuilds++;
+		m_refit.time = timer(t1);
+	}
+
+	// Leaves of the compressed nodes, none while the binary tree is being built
+	void leaf_ranges(std::vector<Vec2u> &leaves) const override {
+		for (const QNode &node : m_qbvh) {
+			Uint beg = node.prim;
+			for (Uint i = node.inner; i < node.used; i++) {
+				leaves.push_back({beg, beg + node.cnt[i]});
+				beg += node.cnt[i];
+			}
+		}
+	}
+
+	void build() override {
+		double build_timer = timer();
+		m_qbvh.clear();
+		AccelBvh::build();
+		m_sah = AccelBvh::sah_cost();
+		collapse();
+		m_bvh = {};
+		m_parent = {};
+		m_vspan = {};
+		m_height = {};
+		cache_poly();
+		m_build_time = timer(build_timer);
+	}
+
+	bool save(BinWriter &out) const override {
+		out.write(m_poly);
+		out.write(m_qbvh);
+		out.write(m_sah);
+		out.write(m_build_time);
+		return out.ok();
+	}
+
+	bool load(BinReader &in) override {
+		if (!in.read(m_poly) || !in.read(m_qbvh) || !in.read(m_sah) || !in.read(m_build_time) || m_qbvh.empty())
+			return false;
+		cache_poly();
+		m_built = true;
+		return true;
+	}
+
+	size_t nodes_cnt() const override { return m_qbvh.size(); }
+	size_t mem_size() const override { return poly_mem() + m_qbvh.size() * sizeof(QNode); }
+	Float sah_cost() const override { return m_sah; }
+
+	std::vector<QNode> m_qbvh;
+
+  private:
+	// Infinite inverse directions would give 0 * inf in the node frame
+	static Vec3f safe_inv(const Ray &r) {
+		Vec3f iD;
+		for (Uint a = 0; a < 3; a++)
+			iD[a] = std::min(std::max(r.iD[a], Float(-1e30)), Float(1e30));
+		return iD;
+	}
+
+	static Stack child_entry(const QNode &node, Uint i, Float t) {
+		if (i < node.inner)
+			return {node.child + i, 0, t};
+		Uint beg = node.prim;
+		for (Uint k = node.inner; k < i; k++)
+			beg += node.cnt[k];
+		return {beg, node.cnt[i], t};
+	}
+
+	// Rebuilds compressed nodes and polygon order from the binary tree
+	void collapse() {
+		m_qbvh.clear();
+		m_qbvh.reserve(2 * m_bvh.size() / W + 1);
+		m_qbvh.emplace_back();
+		m_order.clear();
+		m_order.reserve(m_poly.size());
+		Entry root = entry(0);
+		if (root.inner) {
+			collapse_node(0, root);
+		} else {
+			// Whole scene in one leaf
+			std::vector<Entry> ch;
+			if (root.rng[1] > root.rng[0])
+				ch.push_back(root);
+			fill_node(0, ch);
+		}
+		m_poly.swap(m_order);
+		m_order = {};
+	}
+
+	Entry entry(Uint bnode) const {
+		const Node &n = m_bvh[bnode];
+		Entry e{n.bbox, bnode, n.rng, n.parent()};
+		e.inner |= n.leaf() && n.rng[1] - n.rng[0] > max_leaf;
+		return e;
+	}
+
+	// Splits e into its children
+	void open(const Entry &e, std::vector<Entry> &out) const {
+		const Node &n = m_bvh[e.bnode];
+		if (n.parent()) {
+			for (Uint c : {n.left(), n.right()}) {
+				if (!m_bvh[c].empty())
+					out.push_back(entry(c));
+			}
+			return;
+		}
+		// Long leaf is cut into up to W runs
+		Uint size = e.rng[1] - e.rng[0];
+		Uint parts = std::min(W, (size + max_leaf - 1) / max_leaf);
+		for (Uint p = 0; p < parts; p++) {
+			Vec2u rng(e.rng[0] + size_t(size) * p / parts, e.rng[0] + size_t(size) * (p + 1) / parts);
+			out.push_back({bbox_in(rng), e.bnode, rng, rng[1] - rng[0] > max_leaf});
+		}
+	}
+
+	// Fills compressed node from inner entry e
+	void collapse_node(Uint qnode, const Entry &e) {
+		std::vector<Entry> ch;
+		open(e, ch);
+		// Open inner child with the largest surface until node is full
+		while (ch.size() < W) {
+			Int best = -1;
+			Float best_area = -1;
+			for (Uint i = 0; i < ch.size(); i++) {
+				if (ch[i].inner && ch[i].box.area() > best_area) {
+					best = i;
+					best_area = ch[i].box.area();
+				}
+			}
+			if (best < 0)
+				break;
+			std::vector<Entry> sub;
+			open(ch[best], sub);
+			if (ch.size() - 1 + sub.size() > W)
+				break;
+			ch.erase(ch.begin() + best);
+			ch.insert(ch.end(), sub.begin(), sub.end());
+		}
+		std::stable_partition(ch.begin(), ch.end(), [](const Entry &c) { return c.inner; });
+		fill_node(qnode, ch);
+		Uint first = m_qbvh[qnode].child;
+		for (Uint i = 0; i < m_qbvh[qnode].inner; i++)
+			collapse_node(first + i, ch[i]);
+	}
+
+	// Quantizes child boxes, allocates inner children and appends leaf polygons
+	void fill_node(Uint qnode, const std::vector<Entry> &ch) {
+		QNode node;
+		AABB frame;
+		for (auto &c : ch)
+			frame.expand(c.box);
+		if (ch.empty())
+			frame = AABB(Vec3f(0), Vec3f(0));
+		node.origin = frame.pmin;
+		Float scale[3];
+		for (Uint a = 0; a < 3; a++) {
+			// Smallest power of two, which covers the frame with 255 steps
+			int e;
+			std::frexp((frame.pmax[a] - frame.pmin[a]) / 255, &e);
+			e = std::max(e, -126);
+			while (node.origin[a] + 255 * std::ldexp(Float(1), e) < frame.pmax[a])
+				e++;
+			node.exp[a] = int8_t(std::min(e, 127));
+			scale[a] = node.scale(a);
+		}
+		for (Uint i = 0; i < ch.size(); i++) {
+			for (Uint a = 0; a < 3; a++) {
+				Float o = node.origin[a];
+				Int lo = std::floor((ch[i].box.pmin[a] - o) / scale[a]);
+				Int hi = std::ceil((ch[i].box.pmax[a] - o) / scale[a]);
+				// Rounding may still land inside the box
+				while (lo > 0 && o + lo * scale[a] > ch[i].box.pmin[a])
+					lo--;
+				while (hi < 255 && o + hi * scale[a] < ch[i].box.pmax[a])
+					hi++;
+				node.lo[a][i] = uint8_t(std::clamp(lo, 0, 255));
+				node.hi[a][i] = uint8_t(std::clamp(hi, 0, 255));
+			}
+		}
+		node.used = ch.size();
+		node.inner = 0;
+		while (node.inner < ch.size() && ch[node.inner].inner)
+			node.inner++;
+		node.child = m_qbvh.size();
+		node.prim = m_order.size();
+		for (Uint i = node.inner; i < ch.size(); i++) {
+			node.cnt[i] = ch[i].rng[1] - ch[i].rng[0];
+			m_order.insert(m_order.end(), m_poly.begin() + ch[i].rng[0], m_poly.begin() + ch[i].rng[1]);
+		}
+		m_qbvh[qnode] = node;
+		m_qbvh.resize(m_qbvh.size() + node.inner);
+	}
+
+	std::vector<Uint> m_order; // Polygon order being built by collapse()
+	Float m_sah = 0;
+};
+
+using AccelBvh8Q = AccelQbvh<8>;
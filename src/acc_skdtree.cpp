@@ -0,0 +1,703 @@
+/**
+ * @file acc_skdtree.cpp
+ * @brief Spatial kd-tree acceleration structure implementation.
+ *
+ * Planes are found by the O(n log n) SAH event sweep of Wald and Havran,
+ * "On building fast kd-trees for ray tracing, and on doing that in O(N log N)", 2006.
+ *
+ * @author Jozef Bilko
+ * @date 2025-05-08
+ */
+ #include "acc_skdtree.h"
+ #include <algorithm>
+
+ /* side of a polygon relative to the split plane while splitting events */
+ enum : unsigned char { sideBoth, sideBelow, sideAbove };
+
+ AccelSpatialKd::AccelSpatialKd(const Scene& scene, const BuildParams& params)
+     : Accel(scene, Accel_t::SpatialKd, params)
+ {
+     /* built by make_accel() */
+ }
+
+ /* override */
+ size_t AccelSpatialKd::nodes_cnt() const
+ {
+     return m_nodes.size();
+ }
+
+ /* override */
+ double AccelSpatialKd::build_time() const
+ {
+     return buildTime;
+ }
+
+ /* override */
+ size_t AccelSpatialKd::mem_size() const
+ {
+     return poly_mem() + m_nodes.size() * sizeof(Node) + m_ropes.size() * sizeof(Rope);
+ }
+
+ /* override */
+ Float AccelSpatialKd::sah_cost() const
+ {
+     return m_box.area() > 0 ? buildCost / m_box.area() : 0;
+ }
+
+ /* override, planes can't follow moving polygons, so the tree is built again */
+ void AccelSpatialKd::update()
+ {
+     double elapsedTime = timer();
+     build();
+     m_refit.rebuilds++;
+     m_refit.time = timer(elapsedTime);
+ }
+
+ /* override */
+ void AccelSpatialKd::build()
+ {
+     double elapsedTime = timer();
+
+     m_nodes.clear();
+     m_ropes.clear();
+     m_box = AABB();
+     buildCost = 0;
+
+     /* events of all polygons are sorted once, children keep the order by merging */
+     set_range(m_range);
+     prepare_prims();
+     unsigned count = m_poly.size();
+     std::vector<Event> events;
+     events.reserve(6 * size_t(count));
+     for (unsigned i = 0; i < count; i++)
+     {
+         AABB box = prim_bbox(i);
+         m_box.expand(box);
+         addEvents(events, m_poly[i], box);
+     }
+     release_prims();
+     m_poly.clear();
+     std::sort(events.begin(), events.end());
+
+     std::vector<unsigned char> sides(count);
+     unsigned maxDepth = std::min(60u, unsigned(8 + 1.3f * std::log2(float(std::max(count, 1u)))));
+     m_nodes.reserve(2 * size_t(count) + 1);
+     buildNode(events, m_box, 0, maxDepth, sides);
+
+     if (m_params.kd_ropes)
+     {
+         unsigned ropes[6] = {noRope, noRope, noRope, noRope, noRope, noRope};
+         m_ropes.resize(m_nodes.size());
+         buildRopes(0, m_box, ropes);
+     }
+     cache_poly();
+     m_built = true;
+
+     buildTime = timer(elapsedTime);
+ }
+
+ /* override */
+ bool AccelSpatialKd::save(BinWriter& out) const
+ {
+     out.write(m_poly);
+     out.write(m_nodes);
+     out.write(m_ropes);
+     out.write(m_box);
+     out.write(buildCost);
+     out.write(buildTime);
+     return out.ok();
+ }
+
+ /* override */
+ bool AccelSpatialKd::load(BinReader& in)
+ {
+     if (!in.read(m_poly) || !in.read(m_nodes) || !in.read(m_ropes) || !in.read(m_box) || !in.read(buildCost) ||
+         !in.read(buildTime) || m_nodes.empty() || m_ropes.empty() == m_params.kd_ropes)
+     {
+         return false;
+     }
+     cache_poly();
+     m_built = true;
+     return true;
+ }
+
+ /* override */
+ bool AccelSpatialKd::intersect(const Ray& r, HitInfo& rec) const
+ {
+     NoStats stats;
+     return m_ropes.empty() ? closestHit(r, rec, stats) : closestHitRopes(r, rec, stats);
+ }
+
+ /* override */
+ bool AccelSpatialKd::intersect_stats(const Ray& r, HitInfo& rec, TraceStats& stats) const
+ {
+     return m_ropes.empty() ? closestHit(r, rec, stats) : closestHitRopes(r, rec, stats);
+ }
+
+ /* override */
+ bool AccelSpatialKd::ray_test(const Ray& r, float t) const
+ {
+     NoStats stats;
+     return m_ropes.empty() ? anyHit(r, t, stats) : anyHitRopes(r, t, stats);
+ }
+
+ /* override */
+ bool AccelSpatialKd::ray_test_stats(const Ray& r, float t, TraceStats& stats) const
+ {
+     return m_ropes.empty() ? anyHit(r, t, stats) : anyHitRopes(r, t, stats);
+ }
+
+ bool AccelSpatialKd::clipRay(const Ray& r, float tMax, float& tEnter, float& tExit) const
+ {
+     Vec3f t1 = (m_box.pmin - r.O) * r.iD;
+     Vec3f t2 = (m_box.pmax - r.O) * r.iD;
+     tEnter = std::max(min(t1, t2).max(), 0.0f);
+     tExit = std::min(max(t1, t2).min(), tMax);
+     return !m_nodes.empty() && tEnter <= tExit;
+ }
+
+ template <class Stats>
+ bool AccelSpatialKd::closestHit(const Ray& r, HitInfo& rec, Stats& stats) const
+ {
+     struct StackEntry
+     {
+         unsigned idx;
+         float tMin;
+         float tMax;
+     };
+     StackEntry stack[64];
+     unsigned sptr = 0;
+
+     float tMin, tMax;
+     stats.box();
+     if (!clipRay(r, rec.t(), tMin, tMax))
+     {
+         return rec.idx != Uint(-1);
+     }
+     Mailbox mail;
+     unsigned idx = 0;
+
+     /* walk leaves front to back along [tMin, tMax] */
+     while (true)
+     {
+         const Node* node = &m_nodes[idx];
+         while (!node->isLeaf())
+         {
+             stats.node();
+             unsigned axis = node->axis();
+             float tPlane = (node->split - r.O[axis]) * r.iD[axis];
+             bool below = belowFirst(r, axis, node->split);
+             unsigned nearChild = below ? idx + 1 : node->above();
+             unsigned farChild = below ? node->above() : idx + 1;
+
+             /* plane behind the interval (or parallel ray), then before it, otherwise both sides */
+             if (!(tPlane <= tMax) || tPlane <= 0)
+             {
+                 idx = nearChild;
+             }
+             else if (tPlane < tMin)
+             {
+                 idx = farChild;
+             }
+             else
+             {
+                 stack[sptr++] = {farChild, tPlane, tMax};
+                 idx = nearChild;
+                 tMax = tPlane;
+             }
+             node = &m_nodes[idx];
+         }
+
+         stats.node();
+         for (unsigned i = node->first; i < node->first + node->count(); i++)
+         {
+             if (mail.visit(m_poly[i]))
+             {
+                 stats.tri();
+                 poly(i).intersect(r, rec);
+             }
+         }
+
+         /* a hit behind the leaf can still be covered by a closer polygon in the next leaves */
+         if (rec.t() <= tMax || !sptr)
+         {
+             break;
+         }
+         sptr--;
+         idx = stack[sptr].idx;
+         tMin = stack[sptr].tMin;
+         tMax = std::min(stack[sptr].tMax, rec.t());
+         /* leaves left on the stack are all behind the hit */
+         if (tMin > tMax)
+         {
+             break;
+         }
+     }
+     return rec.idx != Uint(-1);
+ }
+
+ template <class Stats>
+ bool AccelSpatialKd::anyHit(const Ray& r, float t, Stats& stats) const
+ {
+     struct StackEntry
+     {
+         unsigned idx;
+         float tMin;
+         float tMax;
+     };
+     StackEntry stack[64];
+     unsigned sptr = 0;
+
+     float tMin, tMax;
+     stats.box();
+     if (!clipRay(r, t, tMin, tMax))
+     {
+         return false;
+     }
+     Mailbox mail;
+     unsigned idx = 0;
+
+     while (true)
+     {
+         const Node* node = &m_nodes[idx];
+         while (!node->isLeaf())
+         {
+             stats.node();
+             unsigned axis = node->axis();
+             float tPlane = (node->split - r.O[axis]) * r.iD[axis];
+             bool below = belowFirst(r, axis, node->split);
+             unsigned nearChild = below ? idx + 1 : node->above();
+             unsigned farChild = below ? node->above() : idx + 1;
+
+             if (!(tPlane <= tMax) || tPlane <= 0)
+             {
+                 idx = nearChild;
+             }
+             else if (tPlane < tMin)
+             {
+                 idx = farChild;
+             }
+             else
+             {
+                 stack[sptr++] = {farChild, tPlane, tMax};
+                 idx = nearChild;
+                 tMax = tPlane;
+             }
+             node = &m_nodes[idx];
+         }
+
+         stats.node();
+         for (unsigned i = node->first; i < node->first + node->count(); i++)
+         {
+             if (mail.visit(m_poly[i]))
+             {
+                 stats.tri();
+                 if (poly(i).ray_test(r, t))
+                 {
+                     return true;
+                 }
+             }
+         }
+
+         if (!sptr)
+         {
+             break;
+         }
+         sptr--;
+         idx = stack[sptr].idx;
+         tMin = stack[sptr].tMin;
+         tMax = stack[sptr].tMax;
+     }
+     return false;
+ }
+
+ template <class Stats>
+ bool AccelSpatialKd::closestHitRopes(const Ray& r, HitInfo& rec, Stats& stats) const
+ {
+     float tEnter, tExit;
+     stats.box();
+     if (!clipRay(r, rec.t(), tEnter, tExit))
+     {
+         return rec.idx != Uint(-1);
+     }
+     Mailbox mail;
+     unsigned idx = 0;
+
+     /* no stack, from each leaf the ray jumps to the neighbor behind its exit face */
+     while (true)
+     {
+         Vec3f p = r.O + Vec3f(tEnter) * r.D;
+         const Node* node = &m_nodes[idx];
+         while (!node->isLeaf())
+         {
+             stats.node();
+             unsigned axis = node->axis();
+             bool below = p[axis] < node->split || (p[axis] == node->split && r.D[axis] <= 0);
+             idx = below ? idx + 1 : node->above();
+             node = &m_nodes[idx];
+         }
+
+         stats.node();
+         for (unsigned i = node->first; i < node->first + node->count(); i++)
+         {
+             if (mail.visit(m_poly[i]))
+             {
+                 stats.tri();
+                 poly(i).intersect(r, rec);
+             }
+         }
+
+         /* nearest face in the direction of the ray */
+         const Rope& rope = m_ropes[idx];
+         float tLeaf = tExit;
+         unsigned face = 6;
+         for (unsigned axis = 0; axis < 3; axis++)
+         {
+             float plane = r.sgn[axis] ? rope.box.pmin[axis] : rope.box.pmax[axis];
+             float tPlane = (plane - r.O[axis]) * r.iD[axis];
+             if (tPlane < tLeaf)
+             {
+                 tLeaf = tPlane;
+                 face = 2 * axis + !r.sgn[axis];
+             }
+         }
+         if (rec.t() <= tLeaf || face == 6 || rope.next[face] == noRope)
+         {
+             break;
+         }
+         idx = rope.next[face];
+         tEnter = std::max(tEnter, tLeaf);
+     }
+     return rec.idx != Uint(-1);
+ }
+
+ template <class Stats>
+ bool AccelSpatialKd::anyHitRopes(const Ray& r, float t, Stats& stats) const
+ {
+     float tEnter, tExit;
+     stats.box();
+     if (!clipRay(r, t, tEnter, tExit))
+     {
+         return false;
+     }
+     Mailbox mail;
+     unsigned idx = 0;
+
+     while (true)
+     {
+         Vec3f p = r.O + Vec3f(tEnter) * r.D;
+         const Node* node = &m_nodes[idx];
+         while (!node->isLeaf())
+         {
+             stats.node();
+             unsigned axis = node->axis();
+             bool below = p[axis] < node->split || (p[axis] == node->split && r.D[axis] <= 0);
+             idx = below ? idx + 1 : node->above();
+             node = &m_nodes[idx];
+         }
+
+         stats.node();
+         for (unsigned i = node->first; i < node->first + node->count(); i++)
+         {
+             if (mail.visit(m_poly[i]))
+             {
+                 stats.tri();
+                 if (poly(i).ray_test(r, t))
+                 {
+                     return true;
+                 }
+             }
+         }
+
+         const Rope& rope = m_ropes[idx];
+         float tLeaf = tExit;
+         unsigned face = 6;
+         for (unsigned axis = 0; axis < 3; axis++)
+         {
+             float plane = r.sgn[axis] ? rope.box.pmin[axis] : rope.box.pmax[axis];
+             float tPlane = (plane - r.O[axis]) * r.iD[axis];
+             if (tPlane < tLeaf)
+             {
+                 tLeaf = tPlane;
+                 face = 2 * axis + !r.sgn[axis];
+             }
+         }
+         if (face == 6 || rope.next[face] == noRope)
+         {
+             break;
+         }
+         idx = rope.next[face];
+         tEnter = std::max(tEnter, tLeaf);
+     }
+     return false;
+ }
+
+ void AccelSpatialKd::addEvents(std::vector<Event>& events, unsigned poly, const AABB& box)
+ {
+     for (unsigned char axis = 0; axis < 3; axis++)
+     {
+         if (box.pmin[axis] == box.pmax[axis])
+         {
+             events.push_back({box.pmin[axis], poly, axis, Event::Planar});
+         }
+         else
+         {
+             events.push_back({box.pmin[axis], poly, axis, Event::Start});
+             events.push_back({box.pmax[axis], poly, axis, Event::End});
+         }
+     }
+ }
+
+ AccelSpatialKd::Plane AccelSpatialKd::findPlane(const std::vector<Event>& events, const AABB& box, unsigned count) const
+ {
+     Plane best;
+     Vec3f size = box.pmax - box.pmin;
+     float area = box.area();
+     if (!(area > 0))
+     {
+         return best;
+     }
+     float invArea = 1 / area;
+
+     /* half surface area of the box cut to length along axis */
+     auto sideArea = [&](unsigned axis, float length)
+     {
+         Vec3f s = size;
+         s[axis] = length;
+         return dot(s, s.lrotate());
+     };
+     auto cost = [&](float pBelow, float pAbove, unsigned nBelow, unsigned nAbove)
+     {
+         float bonus = (nBelow == 0 || nAbove == 0) ? emptyBonus : 1.0f;
+         return bonus * (traversalCost + intersectCost * (pBelow * nBelow + pAbove * nAbove));
+     };
+
+     /* sweep all three axes at once, events are sorted by position, axis and type */
+     unsigned nBelow[3] = {0, 0, 0};
+     unsigned nAbove[3] = {count, count, count};
+     size_t n = events.size();
+     for (size_t i = 0; i < n;)
+     {
+         float pos = events[i].pos;
+         unsigned axis = events[i].axis;
+         unsigned ends = 0, planars = 0, starts = 0;
+         while (i < n && events[i].pos == pos && events[i].axis == axis && events[i].type == Event::End)
+         {
+             ends++;
+             i++;
+         }
+         while (i < n && events[i].pos == pos && events[i].axis == axis && events[i].type == Event::Planar)
+         {
+             planars++;
+             i++;
+         }
+         while (i < n && events[i].pos == pos && events[i].axis == axis && events[i].type == Event::Start)
+         {
+             starts++;
+             i++;
+         }
+
+         nAbove[axis] -= planars + ends;
+         /* planes on the border of the voxel would make an empty flat child */
+         if (pos > box.pmin[axis] && pos < box.pmax[axis])
+         {
+             float pBelow = sideArea(axis, pos - box.pmin[axis]) * invArea;
+             float pAbove = sideArea(axis, box.pmax[axis] - pos) * invArea;
+             float costBelow = cost(pBelow, pAbove, nBelow[axis] + planars, nAbove[axis]);
+             float costAbove = cost(pBelow, pAbove, nBelow[axis], nAbove[axis] + planars);
+             if (costBelow < best.cost)
+             {
+                 best = {pos, axis, true, costBelow};
+             }
+             if (costAbove < best.cost)
+             {
+                 best = {pos, axis, false, costAbove};
+             }
+         }
+         nBelow[axis] += starts + planars;
+     }
+     return best;
+ }
+
+ void AccelSpatialKd::splitEvents(std::vector<Event>& events, const Plane& plane, const AABB& below, const AABB& above,
+                                  std::vector<unsigned char>& sides, std::vector<Event>& belowEvents,
+                                  std::vector<Event>& aboveEvents) const
+ {
+     /* classify polygons by their events on the split axis */
+     unsigned base = m_range[0];
+     for (const Event& e : events)
+     {
+         sides[e.poly - base] = sideBoth;
+     }
+     for (const Event& e : events)
+     {
+         if (e.axis != plane.axis)
+         {
+             continue;
+         }
+         unsigned char& side = sides[e.poly - base];
+         if (e.type == Event::End && e.pos <= plane.pos)
+         {
+             side = sideBelow;
+         }
+         else if (e.type == Event::Start && e.pos >= plane.pos)
+         {
+             side = sideAbove;
+         }
+         else if (e.type == Event::Planar)
+         {
+             bool toBelow = e.pos < plane.pos || (e.pos == plane.pos && plane.planarBelow);
+             side = toBelow ? sideBelow : sideAbove;
+         }
+     }
+
+     /* events of one sided polygons stay sorted, straddling ones get new events from the clipped polygon */
+     std::vector<Event> belowOnly, aboveOnly, belowNew, aboveNew;
+     for (const Event& e : events)
+     {
+         unsigned char side = sides[e.poly - base];
+         if (side == sideBelow)
+         {
+             belowOnly.push_back(e);
+         }
+         else if (side == sideAbove)
+         {
+             aboveOnly.push_back(e);
+         }
+         else if (e.axis == 0 && e.type != Event::End)
+         {
+             Vert3 vert = m_scene.get_vert(e.poly);
+             AABB bounds(vert.data, 3);
+             const AABB* voxels[2] = {&below, &above};
+             std::vector<Event>* lists[2] = {&belowNew, &aboveNew};
+             for (unsigned child = 0; child < 2; child++)
+             {
+                 AABB clipped = vert.clip_bbox(*voxels[child]);
+                 if (!clipped.valid())
+                 {
+                     /* clipping lost the polygon to rounding, fall back to its bounds */
+                     clipped.pmin = max(bounds.pmin, voxels[child]->pmin);
+                     clipped.pmax = min(bounds.pmax, voxels[child]->pmax);
+                 }
+                 if (clipped.valid())
+                 {
+                     addEvents(*lists[child], e.poly, clipped);
+                 }
+             }
+         }
+     }
+     std::sort(belowNew.begin(), belowNew.end());
+     std::sort(aboveNew.begin(), aboveNew.end());
+
+     belowEvents.resize(belowOnly.size() + belowNew.size());
+     std::merge(belowOnly.begin(), belowOnly.end(), belowNew.begin(), belowNew.end(), belowEvents.begin());
+     aboveEvents.resize(aboveOnly.size() + aboveNew.size());
+     std::merge(aboveOnly.begin(), aboveOnly.end(), aboveNew.begin(), aboveNew.end(), aboveEvents.begin());
+ }
+
+ void AccelSpatialKd::buildNode(std::vector<Event>& events, const AABB& box, unsigned depth, unsigned maxDepth,
+                                std::vector<unsigned char>& sides)
+ {
+     /* every polygon has exactly one start or planar event per axis */
+     unsigned count = 0;
+     for (const Event& e : events)
+     {
+         count += e.axis == 0 && e.type != Event::End;
+     }
+
+     unsigned idx = m_nodes.size();
+     m_nodes.emplace_back();
+     Plane plane;
+     if (depth < maxDepth && count > 0)
+     {
+         plane = findPlane(events, box, count);
+     }
+
+     /* no plane is cheaper than intersecting all polygons */
+     if (plane.cost >= intersectCost * count)
+     {
+         m_nodes[idx].first = m_poly.size();
+         m_nodes[idx].flags = count << 2 | 3;
+         for (const Event& e : events)
+         {
+             if (e.axis == 0 && e.type != Event::End)
+             {
+                 m_poly.push_back(e.poly);
+             }
+         }
+         buildCost += box.area() * leaf_cost(count);
+         add_progress(count);
+         return;
+     }
+
+     AABB below = box;
+     AABB above = box;
+     below.pmax[plane.axis] = plane.pos;
+     above.pmin[plane.axis] = plane.pos;
+     std::vector<Event> belowEvents, aboveEvents;
+     splitEvents(events, plane, below, above, sides, belowEvents, aboveEvents);
+     std::vector<Event>().swap(events);
+
+     m_nodes[idx].split = plane.pos;
+     buildNode(belowEvents, below, depth + 1, maxDepth, sides);
+     m_nodes[idx].flags = unsigned(m_nodes.size()) << 2 | plane.axis;
+     buildNode(aboveEvents, above, depth + 1, maxDepth, sides);
+ }
+
+ void AccelSpatialKd::buildRopes(unsigned idx, const AABB& box, const unsigned (&ropes)[6])
+ {
+     const Node& node = m_nodes[idx];
+     if (node.isLeaf())
+     {
+         Rope& rope = m_ropes[idx];
+         rope.box = box;
+         /* push each rope down to the smallest node that still covers the whole face */
+         for (unsigned face = 0; face < 6; face++)
+         {
+             unsigned next = ropes[face];
+             unsigned faceAxis = face / 2;
+             bool up = face & 1;
+             while (next != noRope && !m_nodes[next].isLeaf())
+             {
+                 const Node& n = m_nodes[next];
+                 unsigned axis = n.axis();
+                 if (axis == faceAxis)
+                 {
+                     next = up ? next + 1 : n.above();
+                 }
+                 else if (n.split <= box.pmin[axis])
+                 {
+                     next = n.above();
+                 }
+                 else if (n.split >= box.pmax[axis])
+                 {
+                     next = next + 1;
+                 }
+                 else
+                 {
+                     break;
+                 }
+             }
+             rope.next[face] = next;
+         }
+         return;
+     }
+
+     unsigned axis = node.axis();
+     unsigned aboveIdx = node.above();
+     AABB below = box;
+     AABB above = box;
+     below.pmax[axis] = node.split;
+     above.pmin[axis] = node.split;
+
+     unsigned belowRopes[6], aboveRopes[6];
+     for (unsigned face = 0; face < 6; face++)
+     {
+         belowRopes[face] = ropes[face];
+         aboveRopes[face] = ropes[face];
+     }
+     belowRopes[2 * axis + 1] = aboveIdx;
+     aboveRopes[2 * axis] = idx + 1;
+     buildRopes(idx + 1, below, belowRopes);
+     buildRopes(aboveIdx, above, aboveRopes);
+ }
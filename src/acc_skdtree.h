@@ -0,0 +1,153 @@
+/**
+ * @file acc_skdtree.h
+ * @brief Spatial kd-tree acceleration structure header.
+ *
+ * Unlike AccelKdTree, nodes split space (not polygons) by a single plane,
+ * polygons straddling the plane are referenced by both children.
+ *
+ * @author Jozef Bilko
+ * @date 2025-05-08
+ */
+ #pragma once
+ #include "accel.h"
+ #include <cmath>
+ #include <limits>
+
+ class AccelSpatialKd : public Accel
+ {
+     /* 8 bytes, the below child follows its parent, the above child is stored in flags */
+     struct Node
+     {
+         union
+         {
+             /* inner node: position of the split plane */
+             float split;
+             /* leaf: first polygon reference in m_poly */
+             unsigned first;
+         };
+         /* inner: above child << 2 | axis, leaf: polygon count << 2 | 3 */
+         unsigned flags;
+
+         bool isLeaf() const { return (flags & 3) == 3; }
+         unsigned axis() const { return flags & 3; }
+         unsigned above() const { return flags >> 2; }
+         unsigned count() const { return flags >> 2; }
+     };
+
+     /* leaf neighbors for stackless traversal, only built with BuildParams::kd_ropes */
+     struct Rope
+     {
+         AABB box;
+         /* node behind faces -x, +x, -y, +y, -z, +z, noRope at the border of the tree */
+         unsigned next[6];
+     };
+
+     /* start / end of polygon bounds along one axis, planar when it is flat */
+     struct Event
+     {
+         enum Type : unsigned char { End, Planar, Start };
+         float pos;
+         unsigned poly;
+         unsigned char axis;
+         unsigned char type;
+
+         bool operator<(const Event& e) const
+         {
+             return pos < e.pos || (pos == e.pos && (axis < e.axis || (axis == e.axis && type < e.type)));
+         }
+     };
+
+     /* best plane found by the sweep */
+     struct Plane
+     {
+         float pos = 0;
+         unsigned axis = 0;
+         /* polygons lying in the plane go to the below child */
+         bool planarBelow = true;
+         float cost = std::numeric_limits<float>::infinity();
+     };
+
+     /* last tested polygons of a ray, so references duplicated in neighbor leaves are tested once */
+     struct Mailbox
+     {
+         unsigned ids[16];
+
+         Mailbox()
+         {
+             for (unsigned& id : ids)
+             {
+                 id = ~0u;
+             }
+         }
+         /* false when the polygon was already tested */
+         bool visit(unsigned id)
+         {
+             unsigned& slot = ids[id & 15];
+             if (slot == id)
+             {
+                 return false;
+             }
+             slot = id;
+             return true;
+         }
+     };
+
+ public:
+     AccelSpatialKd(const Scene& scene, const BuildParams& params = BuildParams());
+
+     size_t nodes_cnt() const override;
+     double build_time() const override;
+     size_t mem_size() const override;
+     Float sah_cost() const override;
+
+     bool intersect(const Ray& r, HitInfo& rec) const override;
+     bool ray_test(const Ray& r, float t = InfF) const override;
+     bool intersect_stats(const Ray& r, HitInfo& rec, TraceStats& stats) const override;
+     bool ray_test_stats(const Ray& r, float t, TraceStats& stats) const override;
+     void update() override;
+     void build() override;
+     bool save(BinWriter& out) const override;
+     bool load(BinReader& in) override;
+
+ private:
+     static constexpr unsigned noRope = ~0u;
+     /* SAH constants, traversal step is cheaper than in the BVH, as there are no box tests */
+     static constexpr float traversalCost = 1.0f;
+     static constexpr float intersectCost = 1.5f;
+     /* cost factor of planes, that cut off empty space */
+     static constexpr float emptyBonus = 0.8f;
+
+     std::vector<Node> m_nodes;
+     /* per node, empty without ropes */
+     std::vector<Rope> m_ropes;
+     AABB m_box;
+     float buildCost = 0;
+     double buildTime = 0;
+
+     /* traversal kernels, counters compile out with NoStats */
+     template <class Stats>
+     bool closestHit(const Ray& r, HitInfo& rec, Stats& stats) const;
+     template <class Stats>
+     bool anyHit(const Ray& r, float t, Stats& stats) const;
+     template <class Stats>
+     bool closestHitRopes(const Ray& r, HitInfo& rec, Stats& stats) const;
+     template <class Stats>
+     bool anyHitRopes(const Ray& r, float t, Stats& stats) const;
+
+     /* parametric interval of the ray inside the tree, false when it misses */
+     bool clipRay(const Ray& r, float tMax, float& tEnter, float& tExit) const;
+     /* near child first by the ray origin, ties in the plane go by direction */
+     static bool belowFirst(const Ray& r, unsigned axis, float split)
+     {
+         return r.O[axis] < split || (r.O[axis] == split && r.D[axis] <= 0);
+     }
+
+     static void addEvents(std::vector<Event>& events, unsigned poly, const AABB& box);
+     Plane findPlane(const std::vector<Event>& events, const AABB& box, unsigned count) const;
+     void splitEvents(std::vector<Event>& events, const Plane& plane, const AABB& below, const AABB& above,
+                      std::vector<unsigned char>& sides, std::vector<Event>& belowEvents,
+                      std::vector<Event>& aboveEvents) const;
+     void buildNode(std::vector<Event>& events, const AABB& box, unsigned depth, unsigned maxDepth,
+                    std::vector<unsigned char>& sides);
+     void buildRopes(unsigned node, const AABB& box, const unsigned (&ropes)[6]);
+ };
@@ -0,0 +1,273 @@
+#pragma once
+// Created by Ondrej Ac (xacond00)
+#include "acc_bvh.h"
+#include <algorithm>
+#include <memory>
+
+// Two-level structure: a BVH per mesh (bottom level) and a BVH over mesh instances (top level)
+// Instances share the geometry of their mesh, moving them only rebuilds the top level
+class AccelTlas : public Accel {
+  public:
+	// Top level node, leaf when cnt > 0
+	struct TNode {
+		AABB bbox;
+		Uint first = 0; // Leaf: first instance in m_order, inner: left child (right is next)
+		Uint cnt = 0;
+	};
+
+	AccelTlas(const Scene &scene, const BuildParams &params = BuildParams()) : Accel(scene, Accel_t::TLAS, params) {}
+
+	bool intersect(const Ray &r, HitInfo &rec) const override {
+		NoStats st;
+		return closest_hit(r, rec, st);
+	}
+	bool intersect_stats(const Ray &r, HitInfo &rec, TraceStats &st) const override { return closest_hit(r, rec, st); }
+	bool ray_test(const Ray &r, Float t = InfF) const override {
+		NoStats st;
+		return any_hit(r, t, st);
+	}
+	bool ray_test_stats(const Ray &r, Float t, TraceStats &st) const override { return any_hit(r, t, st); }
+
+	template <class S>
+	bool closest_hit(const Ray &r, HitInfo &rec, S &st) const {
+		Uint stack[1024];
+		Uint sptr = 0;
+		st.box();
+		if (m_top.empty() || !m_top[0].bbox.ray_test(r, rec.t()))
+			return rec.idx != Uint(-1);
+		stack[sptr++] = 0;
+		while (sptr) {
+			const TNode &node = m_top[stack[--sptr]];
+			st.node();
+			if (node.cnt) {
+				for (Uint i = node.first; i < node.first + node.cnt; i++) {
+					Uint inst = m_order[i];
+					Float t = rec.t();
+					m_blas[instance(inst).m_mesh]->closest_hit(instance(inst).local(r), rec, st);
+					if (rec.t() < t)
+						rec.inst = inst;
+				}
+				continue;
+			}
+			// Nearer child goes on top of the stack
+			Float tl = rec.t(), tr = rec.t();
+			st.box(2);
+			bool hl = m_top[node.first].bbox.ray_dist(r, tl);
+			bool hr = m_top[node.first + 1].bbox.ray_dist(r, tr);
+			if (hl && hr) {
+				stack[sptr++] = tl < tr ? node.first + 1 : node.first;
+				stack[sptr++] = tl < tr ? node.first : node.first + 1;
+			} else if (hl || hr) {
+				stack[sptr++] = hl ? node.first : node.first + 1;
+			}
+		}
+		return rec.idx != Uint(-1);
+	}
+
+	template <class S>
+	bool any_hit(const Ray &r, Float t, S &st) const {
+		Uint stack[1024];
+		Uint sptr = 0;
+		if (m_top.empty())
+			return false;
+		stack[sptr++] = 0;
+		while (sptr) {
+			const TNode &node = m_top[stack[--sptr]];
+			st.node();
+			st.box();
+			if (!node.bbox.ray_test(r, t))
+				continue;
+			if (node.cnt) {
+				for (Uint i = node.first; i < node.first + node.cnt; i++) {
+					const Instance &in = instance(m_order[i]);
+					if (m_blas[in.m_mesh]->any_hit(in.local(r), t, st))
+						return true;
+				}
+				continue;
+			}
+			stack[sptr++] = node.first + 1;
+			stack[sptr++] = node.first;
+		}
+		return false;
+	}
+
+	// Edges of the top level boxes
+	int hit_edge(const Ray &r) const override {
+		Uint stack[1024];
+		Uint sptr = 0;
+		if (m_top.empty())
+			return -1;
+		stack[sptr++] = 0;
+		int depth = 0;
+		while (sptr) {
+			const TNode &node = m_top[stack[--sptr]];
+			auto [hit, edge] = node.bbox.hit_edge2(r);
+			if (edge)
+				return depth;
+			if (hit && !node.cnt) {
+				depth++;
+				stack[sptr++] = node.first + 1;
+				stack[sptr++] = node.first;
+			}
+		}
+		return -1;
+	}
+
+	// Builds a BVH for every non-empty mesh, then the top level
+	void build() override {
+		double build_timer = timer();
+		m_blas.clear();
+		m_blas.resize(m_scene.mesh_cnt());
+		for (Uint m = 0; m < m_scene.mesh_cnt(); m++) {
+			const Mesh &mesh = m_scene.m_mesh[m];
+			if (!mesh.m_cnt)
+				continue;
+			m_blas[m] = std::make_unique<AccelBvh>(m_scene, mesh.range(), m_params.leaf_size, m_params);
+			m_blas[m]->build();
+			add_progress(mesh.m_cnt);
+		}
+		build_top();
+		m_built = true;
+		m_build_time = timer(build_timer);
+	}
+
+	// Refits meshes with vertices marked by Scene::mark_dirty(), then rebuilds the top level
+	// Without marked vertices every mesh is refit, like in the other structures
+	void update() override {
+		if (m_blas.size() != m_scene.mesh_cnt())
+			return build();
+		double t1 = timer();
+		m_refit.rotations = 0;
+		for (auto &blas : m_blas) {
+			if (!blas)
+				continue;
+			size_t rebuilds = blas->refit_stats().rebuilds;
+			blas->update();
+			m_refit.rebuilds += blas->refit_stats().rebuilds - rebuilds;
+			m_refit.rotations += blas->refit_stats().rotations;
+		}
+		build_top();
+		m_refit.refits++;
+		m_refit.time = timer(t1);
+	}
+	// Only instances moved, meshes are kept and the top level is rebuilt
+	void update_top() {
+		if (m_blas.size() != m_scene.mesh_cnt())
+			return build();
+		build_top();
+	}
+
+	// Top level over current instances, default ones are made when the scene has none
+	void build_top() {
+		double top_timer = timer();
+		m_default.clear();
+		if (m_scene.m_inst.empty()) {
+			for (Uint m = 0; m < m_scene.mesh_cnt(); m++) {
+				Instance in(m, Transform(Vec3f(0), Vec3f(0), 1));
+				if (m_blas[m])
+					in.m_bbox = m_blas[m]->m_bvh[0].bbox;
+				m_default.push_back(in);
+			}
+		}
+		m_order.clear();
+		for (Uint i = 0; i < inst_cnt(); i++) {
+			if (m_blas[instance(i).m_mesh])
+				m_order.push_back(i);
+		}
+		m_top.clear();
+		if (!m_order.empty()) {
+			m_top.reserve(2 * m_order.size());
+			m_top.emplace_back();
+			split_top(0, 0, m_order.size());
+		}
+		m_top_time = timer(top_timer);
+	}
+
+	const Instance &instance(Uint i) const { return m_scene.m_inst.empty() ? m_default[i] : m_scene.m_inst[i]; }
+	Uint inst_cnt() const { return m_scene.m_inst.empty() ? m_default.size() : m_scene.m_inst.size(); }
+
+	void set_traversal(Traversal_t traversal) {
+		for (auto &blas : m_blas)
+			if (blas)
+				blas->set_traversal(traversal);
+	}
+
+	size_t nodes_cnt() const override {
+		size_t cnt = m_top.size();
+		for (auto &blas : m_blas)
+			cnt += blas ? blas->nodes_cnt() : 0;
+		return cnt;
+	}
+	size_t refs_cnt() const override {
+		size_t cnt = 0;
+		for (auto &blas : m_blas)
+			cnt += blas ? blas->refs_cnt() : 0;
+		return cnt;
+	}
+	size_t poly_mem() const override {
+		size_t mem = 0;
+		for (auto &blas : m_blas)
+			mem += blas ? blas->poly_mem() : 0;
+		return mem;
+	}
+	double build_time() const override { return m_build_time; }
+	// Seconds spent by the last top level build
+	double top_time() const { return m_top_time; }
+	size_t mem_size() const override {
+		size_t mem = m_top.size() * sizeof(TNode) + m_order.size() * sizeof(Uint) + inst_cnt() * sizeof(Instance);
+		for (auto &blas : m_blas)
+			mem += blas ? blas->mem_size() : 0;
+		return mem;
+	}
+
+  private:
+	// Sorts instances [beg, end) by centers along the longest axis and splits them by SAH
+	void split_top(Uint node, Uint beg, Uint end) {
+		AABB box, cbox;
+		for (Uint i = beg; i < end; i++) {
+			box.expand(instance(m_order[i]).m_bbox);
+			cbox.expand(instance(m_order[i]).m_bbox.center());
+		}
+		m_top[node].bbox = box;
+		Uint cnt = end - beg;
+		if (cnt <= 2) {
+			m_top[node].first = beg;
+			m_top[node].cnt = cnt;
+			return;
+		}
+		Uint axis = cbox.longest_axis();
+		std::sort(m_order.begin() + beg, m_order.begin() + end,
+				  [&](Uint a, Uint b) { return instance(a).m_bbox.center()[axis] < instance(b).m_bbox.center()[axis]; });
+		// Right areas from the back, then sweep from the front
+		std::vector<Float> rarea(cnt);
+		AABB acc;
+		for (Uint i = cnt - 1; i > 0; i--) {
+			acc.expand(instance(m_order[beg + i]).m_bbox);
+			rarea[i] = acc.area();
+		}
+		acc = AABB();
+		Float best = InfF;
+		Uint split = beg + cnt / 2;
+		for (Uint i = 0; i + 1 < cnt; i++) {
+			acc.expand(instance(m_order[beg + i]).m_bbox);
+			Float cost = acc.area() * (i + 1) + rarea[i + 1] * (cnt - i - 1);
+			if (cost < best) {
+				best = cost;
+				split = beg + i + 1;
+			}
+		}
+		Uint left = m_top.size();
+		m_top[node].first = left;
+		m_top.emplace_back();
+		m_top.emplace_back();
+		split_top(left, beg, split);
+		split_top(left + 1, split, end);
+	}
+
+	std::vector<std::unique_ptr<AccelBvh>> m_blas; // Per mesh, nullptr for empty meshes
+	std::vector<TNode> m_top;
+	std::vector<Uint> m_order;		// Instance indices in top level leaf order
+	std::vector<Instance> m_default; // Every mesh once in place, when the scene has no instances
+	double m_build_time = 0;
+	double m_top_time = 0;
+};
@@ -0,0 +1,233 @@
+#pragma once
+#include "acc_bvh.h"
+#include "simd.h"
+// Wide BVH (BVH4 / BVH8)
+// Collapses the binary SAH tree into W-wide nodes,
+// all child boxes of a node are tested at once with one SIMD slab test
+template <Uint W>
+class AccelWbvh : public AccelBvh {
+	using Lane = Lane_t<W>;
+
+	// SoA child bounds + child refs (128B for BVH4, 256B for BVH8)
+	struct alignas(64) WNode {
+		// Unused lanes hold a degenerate box far away, which never passes the slab test
+		WNode() {
+			for (Uint a = 0; a < 3; a++) {
+				for (Uint i = 0; i < W; i++) {
+					lo[a][i] = hi[a][i] = Float(1e30);
+				}
+			}
+		}
+		void set_box(Uint i, const AABB &box) {
+			for (Uint a = 0; a < 3; a++) {
+				lo[a][i] = box.pmin[a];
+				hi[a][i] = box.pmax[a];
+			}
+		}
+		// Returns mask of children hit before t, entry distances go to mint
+		Uint hit(const Lane O[3], const Lane iD[3], Float t, Lane &mint) const {
+			Lane t1 = (Lane::load(lo[0]) - O[0]) * iD[0];
+			Lane t2 = (Lane::load(hi[0]) - O[0]) * iD[0];
+			Lane tmin = min(t1, t2);
+			Lane tmax = max(t1, t2);
+			for (Uint a = 1; a < 3; a++) {
+				t1 = (Lane::load(lo[a]) - O[a]) * iD[a];
+				t2 = (Lane::load(hi[a]) - O[a]) * iD[a];
+				tmin = max(tmin, min(t1, t2));
+				tmax = min(tmax, max(t1, t2));
+			}
+			mint = tmin;
+			return slab_hit(tmin, tmax, Lane(t));
+		}
+		Float lo[3][W];
+		Float hi[3][W];
+		// When cnt > 0, child points to triangle indices
+		// When cnt == 0, child points to next wide node
+		Uint child[W] = {};
+		Uint cnt[W] = {};
+	};
+
+	struct Stack {
+		Uint child;
+		Uint cnt;
+		Float t;
+	};
+
+  public:
+	AccelWbvh(const Scene &scene, Uint node_size = 8, const BuildParams &params = BuildParams())
+		: AccelBvh(scene, W == 4 ? Accel_t::BVH4 : Accel_t::BVH8, node_size, params) {}
+
+	bool intersect(const Ray &r, HitInfo &rec) const override {
+		NoStats st;
+		return closest_hit(r, rec, st);
+	}
+	bool intersect_stats(const Ray &r, HitInfo &rec, TraceStats &st) const override { return closest_hit(r, rec, st); }
+
+	// One wide node visit counts W box tests
+	template <class S>
+	bool closest_hit(const Ray &r, HitInfo &rec, S &st) const {
+		constexpr Uint stack_size = 64 * W;
+		Stack stack[stack_size];
+		Uint sptr = 0;
+		stack[sptr++] = {0, 0, 0};
+		const Lane O[3] = {Lane(r.O[0]), Lane(r.O[1]), Lane(r.O[2])};
+		const Lane iD[3] = {Lane(r.iD[0]), Lane(r.iD[1]), Lane(r.iD[2])};
+		while (sptr) {
+			Stack top = stack[--sptr];
+			if (top.t >= rec.t())
+				continue;
+			st.node();
+			if (top.cnt) {
+				intersect_leaf(top.child, top.child + top.cnt, r, rec, st);
+				continue;
+			}
+			const WNode &node = m_wbvh[top.child];
+			st.box(W);
+			Lane mint;
+			Uint mask = node.hit(O, iD, rec.t(), mint);
+			if (!mask)
+				continue;
+			Float t[W];
+			mint.store(t);
+			// Push hit children sorted far to near, so the nearest one is popped first
+			Uint beg = sptr;
+			while (mask) {
+				Uint i = lane_first(mask);
+				mask &= mask - 1;
+				Stack item{node.child[i], node.cnt[i], t[i]};
+				Uint j = sptr++;
+				while (j > beg && stack[j - 1].t < item.t) {
+					stack[j] = stack[j - 1];
+					j--;
+				}
+				stack[j] = item;
+			}
+		}
+		return rec.idx != Uint(-1);
+	}
+
+	bool ray_test(const Ray &r, Float t = InfF) const override {
+		NoStats st;
+		return any_hit(r, t, st);
+	}
+	bool ray_test_stats(const Ray &r, Float t, TraceStats &st) const override { return any_hit(r, t, st); }
+
+	template <class S>
+	bool any_hit(const Ray &r, Float t, S &st) const {
+		constexpr Uint stack_size = 64 * W;
+		Stack stack[stack_size];
+		Uint sptr = 0;
+		stack[sptr++] = {0, 0, 0};
+		const Lane O[3] = {Lane(r.O[0]), Lane(r.O[1]), Lane(r.O[2])};
+		const Lane iD[3] = {Lane(r.iD[0]), Lane(r.iD[1]), Lane(r.iD[2])};
+		while (sptr) {
+			Stack top = stack[--sptr];
+			st.node();
+			if (top.cnt) {
+				if (test_leaf(top.child, top.child + top.cnt, r, t, st))
+					return true;
+				continue;
+			}
+			const WNode &node = m_wbvh[top.child];
+			st.box(W);
+			Lane mint;
+			Uint mask = node.hit(O, iD, t, mint);
+			while (mask) {
+				Uint i = lane_first(mask);
+				mask &= mask - 1;
+				stack[sptr++] = {node.child[i], node.cnt[i], 0};
+			}
+		}
+		return false;
+	}
+
+	// Rebuilds wide nodes from the binary tree
+	void collapse() {
+		m_wbvh.clear();
+		m_wbvh.reserve(2 * m_bvh.size() / W + 1);
+		m_wbvh.emplace_back();
+		collapse_node(0, 0);
+	}
+
+	void update() override {
+		AccelBvh::update();
+		collapse();
+	}
+
+	void build() override {
+		double build_timer = timer();
+		AccelBvh::build();
+		collapse();
+		m_build_time = timer(build_timer);
+	}
+
+	// Binary tree is kept for updates, so both are stored
+	bool save(BinWriter &out) const override {
+		if (!AccelBvh::save(out))
+			return false;
+		out.write(m_wbvh);
+		return out.ok();
+	}
+
+	bool load(BinReader &in) override { return AccelBvh::load(in) && in.read(m_wbvh) && !m_wbvh.empty(); }
+
+	size_t nodes_cnt() const override { return m_wbvh.size(); }
+	size_t mem_size() const override { return AccelBvh::mem_size() + m_wbvh.size() * sizeof(WNode); }
+
+	std::vector<WNode> m_wbvh;
+
+  private:
+	// Fills wide node from binary subtree with root bnode
+	void collapse_node(Uint wnode, Uint bnode) {
+		Uint child[W];
+		Uint cnt = 0;
+		const Node &root = m_bvh[bnode];
+		if (root.parent()) {
+			child[cnt++] = root.left();
+			child[cnt++] = root.right();
+		} else {
+			child[cnt++] = bnode;
+		}
+		// Open interior child with the largest surface until node is full
+		while (cnt < W) {
+			Int best = -1;
+			Float best_area = -1;
+			for (Uint i = 0; i < cnt; i++) {
+				const Node &n = m_bvh[child[i]];
+				if (n.parent() && n.bbox.area() > best_area) {
+					best = i;
+					best_area = n.bbox.area();
+				}
+			}
+			if (best < 0)
+				break;
+			const Node &n = m_bvh[child[best]];
+			child[best] = n.left();
+			child[cnt++] = n.right();
+		}
+		// Allocate inner children next to each other first, then descend
+		Uint first = m_wbvh.size();
+		for (Uint i = 0; i < cnt; i++) {
+			const Node &n = m_bvh[child[i]];
+			if (n.empty())
+				continue;
+			m_wbvh[wnode].set_box(i, n.bbox);
+			if (n.parent()) {
+				m_wbvh[wnode].child[i] = m_wbvh.size();
+				m_wbvh.emplace_back();
+			} else {
+				m_wbvh[wnode].child[i] = n.rng[0];
+				m_wbvh[wnode].cnt[i] = n.rng[1] - n.rng[0];
+			}
+		}
+		for (Uint i = 0; i < cnt; i++) {
+			const Node &n = m_bvh[child[i]];
+			if (n.parent()) {
+				collapse_node(first++, child[i]);
+			}
+		}
+	}
+};
+
+using AccelBvh4 = AccelWbvh<4>;
+using AccelBvh8 = AccelWbvh<8>;
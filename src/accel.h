@@ -1,8 +1,14 @@
 #pragma once
 // Created by Ondrej Ac (xacond00)
 #include "aabb.h"
+#include "binary_io.h"
+#include "poly_pack.h"
 #include "ray.h"
 #include "scene.h"
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <thread>
 #include <typeinfo>
 
 
@@ -12,35 +18,142 @@ struct PolyPtr{
 	Uint mesh_idx;
 };*/
 
-enum class Accel_t { None, Bbox, BVH, KdTree, BIH, LAST };
-static const char* accel_t_names[] = {"None", "Bbox", "BVH", "KdTree", "BIH"};
+// BVH construction strategy
+// Lazy splits nodes by binned SAH only once a ray reaches them (binary BVH only, wide ones build eagerly)
+enum class BvhBuild_t { Binned, LBVH, HLBVH, SBVH, Lazy, LAST };
+static const char* bvh_build_names[] = {"Binned SAH", "LBVH", "HLBVH", "SBVH", "Lazy SAH"};
+
+// Tree traversal algorithm
+enum class Traversal_t { Stack, Ordered, Stackless, LAST };
+static const char* traversal_names[] = {"Stack", "Ordered", "Stackless"};
+
+// Build settings passed to accelerators
+struct BuildParams {
+	bool parallel = true; // Build independent subtrees on multiple threads
+	BvhBuild_t bvh_build = BvhBuild_t::Binned;
+	Float sbvh_budget = 0.3f; // SBVH: max. duplicated references relative to polygon count
+	Float sbvh_alpha = 1e-2f; // SBVH: child overlap relative to root area, that allows spatial splits
+	Uint leaf_size = 8; // Max. polygons in a leaf (BVH family, KdTree and BIHCompact)
+	Uint pack_width = 0; // Leaf polygons intersected by SIMD packs of 4 or 8, 0 = one by one
+	bool kd_ropes = false; // SpatialKd: stackless traversal over links between neighbor leaves
+	Uint bins = 32; // Buckets per axis of binned SAH (BVH family, KdTree and BIH), at most max_bins
+};
+
+// Bin arrays are sized for this, BuildParams::bins picks how many of them are used
+constexpr Uint max_bins = 64;
+
+// Cost of one pack test relative to one polygon test, used by SAH with pack_width
+constexpr Float pack_cost = 2;
+
+// Per-ray traversal counters, filled by intersect_stats() / ray_test_stats()
+struct TraceStats {
+	size_t nodes = 0; // Visited nodes
+	size_t boxes = 0; // Ray-box tests
+	size_t tris = 0;  // Ray-triangle tests
+	void node() { nodes++; }
+	void box(Uint n = 1) { boxes += n; }
+	void tri(Uint n = 1) { tris += n; }
+	TraceStats &operator+=(const TraceStats &o) {
+		nodes += o.nodes;
+		boxes += o.boxes;
+		tris += o.tris;
+		return *this;
+	}
+};
+
+// Stand-in for TraceStats in production kernels, so the counting compiles out
+struct NoStats {
+	void node() {}
+	void box(Uint = 1) {}
+	void tri(Uint = 1) {}
+};
+
+// Counters of update() on moving geometry
+struct RefitStats {
+	double time = 0;	  // Seconds spent by the last update
+	size_t refits = 0;	  // Updates done by refitting
+	size_t rebuilds = 0;  // Updates, that fell back to a full build
+	size_t rotations = 0; // Tree rotations done by the last update
+};
+
+// Polygon centers and bounds in SoA, computed once per build and shared by all builders
+// Indexed by scene polygon minus the range start, so partitioning m_poly doesn't move them
+struct BuildPrims {
+	std::vector<Float> cent[3];
+	std::vector<Float> pmin[3];
+	std::vector<Float> pmax[3];
+	bool empty() const { return cent[0].empty(); }
+	size_t mem_size() const { return 9 * cent[0].size() * sizeof(Float); }
+	void clear() {
+		for (Uint a = 0; a < 3; a++) {
+			cent[a] = {};
+			pmin[a] = {};
+			pmax[a] = {};
+		}
+	}
+};
+
+enum class Accel_t { None, Bbox, BVH, BVH4, BVH8, BVH8Q, KdTree, SpatialKd, BIH, BIHCompact, TLAS, LAST };
+static const char* accel_t_names[] = {"None", "Bbox", "BVH", "BVH4", "BVH8", "BVH8Q", "KdTree", "SpatialKd", "BIH", "BIHCompact", "TLAS"};
 
 
 // Acceleration structure base interface
 class Accel {
   public:
 
-	Accel(const Scene &scene, Accel_t type) : m_scene(scene), m_type(type), m_built(false) {
-		if (m_type <= Accel_t::Bbox)
+	Accel(const Scene &scene, Accel_t type, const BuildParams &params = BuildParams())
+		: m_scene(scene), m_type(type), m_built(false), m_params(params) {
+		// Two-level structure keeps polygons in its per mesh structures
+		if (m_type <= Accel_t::Bbox || m_type == Accel_t::TLAS)
 			return;
+		set_range(Vec2u(0, m_scene.poly_cnt()));
+	}
+	// Over the polygons in range only, bottom levels of two-level structures skip the whole scene range
+	Accel(const Scene &scene, Accel_t type, Vec2u range, const BuildParams &params)
+		: m_scene(scene), m_type(type), m_built(false), m_params(params) {
+		set_range(range);
+	}
+	// Renderer deletes replaced structures through the base pointer
+	virtual ~Accel() {}
+	virtual bool intersect(const Ray &, HitInfo &) const{return false;} 
+	virtual bool ray_test(const Ray &, Float = InfF) const{return false;}
+	virtual int hit_edge(const Ray &) const{return -1;}
+	// Same as intersect() / ray_test(), but counts traversal steps in st
+	// Structures without counters just trace
+	virtual bool intersect_stats(const Ray &r, HitInfo &rec, TraceStats &) const { return intersect(r, rec); }
+	virtual bool ray_test_stats(const Ray &r, Float t, TraceStats &) const { return ray_test(r, t); }
+	virtual void update(){}
+	// Constructors don't build, make_accel() builds or loads from the scene cache
+	virtual void build(){}
+	// Stores the built structure for the scene cache, false if it can't be cached
+	virtual bool save(BinWriter &) const { return false; }
+	// Restores what save() wrote instead of building, false if the data don't fit
+	virtual bool load(BinReader &) { return false; }
+
+	// Restricts the structure to scene polygons in range (one mesh for two-level structures)
+	// Has to be called before build()
+	void set_range(Vec2u range) {
+		m_range = range;
 		// This array is actually going to get modified
 		// As opposed to the original vertices/indices
-		Uint size = m_scene.poly_cnt();
-		m_poly.reserve(size);
-		for (Uint i = 0; i < size; i++) {
+		m_poly.clear();
+		m_poly.reserve(range[1] - range[0]);
+		for (Uint i = range[0]; i < range[1]; i++) {
 			m_poly.emplace_back(i);
 		}
 	}
-	//virtual ~Accel() {}
-	virtual bool intersect(const Ray &r, HitInfo &rec) const{return false;} 
-	virtual bool ray_test(const Ray &r, Float t = InfF) const{return false;}
-	virtual int hit_edge(const Ray &r) const{return -1;}
-	virtual void update(){}
-	virtual void build(){}
+	Vec2u range() const { return m_range; }
+	// Bounds of the polygons in range
+	AABB range_bbox() const {
+		if (m_range[0] == 0 && m_range[1] == m_scene.poly_cnt())
+			return m_scene.m_bbox;
+		return m_scene.bbox_in(m_range[0], m_range[1]);
+	}
 
 	// Scene getters from poly indices
 	Vert3 vert(Uint i) const { return m_scene.get_vert(m_poly[i]); }
-	Poly poly(Uint i) const { return m_scene.get_poly(m_poly[i]); }
+	// Reads the precomputed copy when cached, otherwise goes through the scene
+	Poly poly(Uint i) const { return m_tris.empty() ? m_scene.get_poly(m_poly[i]) : m_tris[i]; }
 	Vec3f cent(Uint i) const { return m_scene.get_center(m_poly[i]); }
 	
 	// Compute bbox from the range of stored indices
@@ -60,16 +173,236 @@ class Accel {
 		return AABB(pmin, pmax);
 	}
 
+	// Stores polygons in leaf order with precomputed edges and normal, and the leaf packs
+	// Has to be called again, whenever m_poly or vertices change
+	void cache_poly() {
+		pack_leaves();
+		m_tris.clear();
+		if (!m_cache)
+			return;
+		m_tris.reserve(m_poly.size());
+		for (Uint i = 0; i < m_poly.size(); i++) {
+			m_tris.push_back(m_scene.get_poly(m_poly[i]));
+		}
+	}
+
+	// Leaves as ranges of m_poly, needed for packing
+	virtual void leaf_ranges(std::vector<Vec2u> &) const {}
+
+	// SAH cost of intersecting a leaf with n polygons
+	Float leaf_cost(Uint n) const {
+		Uint w = m_params.pack_width;
+		return w ? Float((n + w - 1) / w) * pack_cost : Float(n);
+	}
+
+	// Number of binned SAH buckets from the build settings
+	Uint bin_cnt() const { return std::clamp(m_params.bins, Uint(2), max_bins); }
+
+	// Closest hit among leaf polygons [beg, end), by packs when they exist
+	template <class S>
+	void intersect_leaf(Uint beg, Uint end, const Ray &r, HitInfo &rec, S &st) const {
+		st.tri(end - beg);
+		if (!m_packs8.empty()) {
+			for (Uint p = m_leaf_pack[beg], n = (end - beg + 7) / 8; n; n--, p++)
+				m_packs8[p].intersect(r, rec);
+		} else if (!m_packs4.empty()) {
+			for (Uint p = m_leaf_pack[beg], n = (end - beg + 3) / 4; n; n--, p++)
+				m_packs4[p].intersect(r, rec);
+		} else {
+			for (Uint i = beg; i < end; i++)
+				poly(i).intersect(r, rec);
+		}
+	}
+
+	// Any hit among leaf polygons [beg, end) before t
+	template <class S>
+	bool test_leaf(Uint beg, Uint end, const Ray &r, Float t, S &st) const {
+		if (!m_packs8.empty()) {
+			for (Uint p = m_leaf_pack[beg], n = (end - beg + 7) / 8; n; n--, p++) {
+				st.tri(m_packs8[p].cnt);
+				if (m_packs8[p].ray_test(r, t))
+					return true;
+			}
+		} else if (!m_packs4.empty()) {
+			for (Uint p = m_leaf_pack[beg], n = (end - beg + 3) / 4; n; n--, p++) {
+				st.tri(m_packs4[p].cnt);
+				if (m_packs4[p].ray_test(r, t))
+					return true;
+			}
+		} else {
+			for (Uint i = beg; i < end; i++) {
+				st.tri();
+				if (poly(i).ray_test(r, t))
+					return true;
+			}
+		}
+		return false;
+	}
+
+	void set_poly_cache(bool enable) {
+		m_cache = enable;
+		cache_poly();
+		if (!enable)
+			m_tris.shrink_to_fit();
+	}
+
 	// Getters
 	bool built() { return m_built; }
+	bool poly_cached() const { return !m_tris.empty(); }
+	// Polygon references in leaves (more than polygons when they are duplicated)
+	virtual size_t refs_cnt() const { return m_poly.size(); }
+	// Memory used for polygon lookup (indices + cached polygons)
+	virtual size_t poly_mem() const {
+		return m_poly.size() * sizeof(Uint) + m_tris.size() * sizeof(Poly) + m_leaf_pack.size() * sizeof(Uint) +
+			   m_packs4.size() * sizeof(PolyPack<4>) + m_packs8.size() * sizeof(PolyPack<8>);
+	}
 	Accel_t type() const { return m_type; }
+	const BuildParams &params() const { return m_params; }
+	const RefitStats &refit_stats() const { return m_refit; }
+	// Part of build() done, from polygons already placed in leaves
+	// Safe to read from another thread while building
+	float progress() const {
+		Uint total = m_type == Accel_t::TLAS ? m_scene.poly_cnt() : m_range[1] - m_range[0];
+		return total ? std::min(float(m_progress.load(std::memory_order_relaxed)) / total, 1.f) : 0.f;
+	}
 
 	virtual size_t nodes_cnt()  const { fprintf(stderr, "Warning: nodes_cnt()  not implemented for %s\n", typeid(*this).name()); return 0; }
 	virtual double build_time() const { fprintf(stderr, "Warning: build_time() not implemented for %s\n", typeid(*this).name()); return 0; }
+	// SAH cost of leaves relative to the root area (0 if not tracked)
+	virtual Float sah_cost() const { return 0; }
+	// Total memory of the structure in bytes (nodes + polygon lookup)
+	virtual size_t mem_size() const { return poly_mem(); }
 
   protected:
+	// Builders call it for every finished leaf, references duplicated by spatial splits count more than once
+	void add_progress(Uint polys) { m_progress.fetch_add(polys, std::memory_order_relaxed); }
+
+	// Fills m_prims from the polygons in range, has to be called by build() before the builders use them
+	void prepare_prims() {
+		Uint n = m_range[1] - m_range[0];
+		for (Uint a = 0; a < 3; a++) {
+			m_prims.cent[a].resize(n);
+			m_prims.pmin[a].resize(n);
+			m_prims.pmax[a].resize(n);
+		}
+		auto fill = [&](Uint beg, Uint end) {
+			for (Uint i = beg; i < end; i++) {
+				Vert3 V = m_scene.get_vert(m_range[0] + i);
+				Vec3f c = V.center();
+				AABB box(V.data, 3);
+				for (Uint a = 0; a < 3; a++) {
+					m_prims.cent[a][i] = c[a];
+					m_prims.pmin[a][i] = box.pmin[a];
+					m_prims.pmax[a][i] = box.pmax[a];
+				}
+			}
+		};
+		Uint tasks = m_params.parallel && n >= prim_task_size ? std::max(1u, std::thread::hardware_concurrency()) : 1;
+		if (tasks > 1) {
+			std::vector<std::future<void>> fut;
+			for (Uint t = 0; t < tasks; t++)
+				fut.push_back(std::async(std::launch::async, fill, size_t(n) * t / tasks, size_t(n) * (t + 1) / tasks));
+			for (auto &f : fut)
+				f.wait();
+		} else {
+			fill(0, n);
+		}
+	}
+	// Frees m_prims once the build is done
+	void release_prims() { m_prims.clear(); }
+
+	// Center and bounds of polygon m_poly[i] from m_prims
+	Float prim_cent(Uint i, Uint axis) const { return m_prims.cent[axis][m_poly[i] - m_range[0]]; }
+	Vec3f prim_cent(Uint i) const {
+		Uint p = m_poly[i] - m_range[0];
+		return Vec3f(m_prims.cent[0][p], m_prims.cent[1][p], m_prims.cent[2][p]);
+	}
+	// Center of the bounds along axis
+	Float prim_mid(Uint i, Uint axis) const {
+		Uint p = m_poly[i] - m_range[0];
+		return (m_prims.pmin[axis][p] + m_prims.pmax[axis][p]) * Float(0.5);
+	}
+	AABB prim_bbox(Uint i) const {
+		Uint p = m_poly[i] - m_range[0];
+		return AABB(Vec3f(m_prims.pmin[0][p], m_prims.pmin[1][p], m_prims.pmin[2][p]),
+					Vec3f(m_prims.pmax[0][p], m_prims.pmax[1][p], m_prims.pmax[2][p]));
+	}
+	// bbox_in() from m_prims, without going through the vertices
+	AABB prim_bbox_in(Vec2u range) const {
+		Vec3f pmin(InfF);
+		Vec3f pmax(-InfF);
+		for (Uint a = 0; a < 3; a++) {
+			const Float *lo = m_prims.pmin[a].data();
+			const Float *hi = m_prims.pmax[a].data();
+			for (Uint i = range[0]; i < range[1]; i++) {
+				Uint p = m_poly[i] - m_range[0];
+				pmin[a] = std::min(pmin[a], lo[p]);
+				pmax[a] = std::max(pmax[a], hi[p]);
+			}
+		}
+		return AABB(pmin, pmax);
+	}
+
+	// Refreshes cached polygons and packs of leaf [beg, end) after its vertices moved
+	void recache_leaf(Vec2u leaf) {
+		if (!m_tris.empty()) {
+			for (Uint i = leaf[0]; i < leaf[1]; i++)
+				m_tris[i] = m_scene.get_poly(m_poly[i]);
+		}
+		Uint w = m_params.pack_width;
+		if (m_packs4.empty() && m_packs8.empty())
+			return;
+		for (Uint i = leaf[0]; i < leaf[1]; i++) {
+			Uint pack = m_leaf_pack[leaf[0]] + (i - leaf[0]) / w;
+			if (w == 8)
+				m_packs8[pack].set((i - leaf[0]) % w, m_scene.get_poly(m_poly[i]));
+			else
+				m_packs4[pack].set((i - leaf[0]) % w, m_scene.get_poly(m_poly[i]));
+		}
+	}
+
+	// Every leaf starts a new pack, so a leaf is a run of packs
+	void pack_leaves() {
+		m_packs4.clear();
+		m_packs8.clear();
+		m_leaf_pack.clear();
+		Uint w = m_params.pack_width;
+		if (w != 4 && w != 8)
+			return;
+		std::vector<Vec2u> leaves;
+		leaf_ranges(leaves);
+		m_leaf_pack.assign(m_poly.size() + 1, 0);
+		for (const Vec2u &leaf : leaves) {
+			m_leaf_pack[leaf[0]] = w == 8 ? m_packs8.size() : m_packs4.size();
+			for (Uint i = leaf[0]; i < leaf[1]; i++) {
+				Poly p = m_scene.get_poly(m_poly[i]);
+				Uint lane = (i - leaf[0]) % w;
+				if (w == 8) {
+					if (!lane)
+						m_packs8.emplace_back();
+					m_packs8.back().set(lane, p);
+				} else {
+					if (!lane)
+						m_packs4.emplace_back();
+					m_packs4.back().set(lane, p);
+				}
+			}
+		}
+	}
+
 	const Scene &m_scene;
 	std::vector<Uint> m_poly;
+	Vec2u m_range = Vec2u(0, 0); // Scene polygons the structure is built over
+	std::vector<Poly> m_tris; // Cached polygons in m_poly order
+	std::vector<PolyPack<4>> m_packs4; // Leaf packs, when pack_width is 4
+	std::vector<PolyPack<8>> m_packs8; // Leaf packs, when pack_width is 8
+	std::vector<Uint> m_leaf_pack; // First pack of the leaf starting at a m_poly position
 	const Accel_t m_type;
 	bool m_built = false;
+	bool m_cache = true;
+	BuildParams m_params;
+	RefitStats m_refit;
+	BuildPrims m_prims; // Valid only during build()
+	std::atomic<Uint> m_progress{0}; // Polygons in finished leaves, see progress()
+	static constexpr Uint prim_task_size = 1 << 16;
 };
\ No newline at end of file
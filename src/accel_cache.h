@@ -0,0 +1,88 @@
+#pragma once
+// Created by Ondrej Ac (xacond00)
+// Built accelerators kept in memory, so switching back to one doesn't build it again
+// Least recently used structures are freed, once all of them take more than the memory budget
+#include "scene_cache.h"
+#include <list>
+
+class AccelCache {
+  public:
+	// Structures reference their scene, so it is a part of the key
+	struct Key {
+		const Scene *scene = nullptr;
+		Accel_t type = Accel_t::None;
+		uint64_t params = 0; // Hash of build parameters, see scene_cache::params_hash()
+		bool operator==(const Key &o) const { return scene == o.scene && type == o.type && params == o.params; }
+	};
+	static Key key(const Scene &scene, Accel_t type, const BuildParams &params) {
+		return {&scene, type, scene_cache::params_hash(type, params, scene.m_scale)};
+	}
+
+	AccelCache() {}
+	AccelCache(const AccelCache &) = delete;
+	AccelCache &operator=(const AccelCache &) = delete;
+	~AccelCache() { clear(); }
+
+	// Returns the structure and makes it the most recently used one, nullptr when it is not cached
+	Accel *get(const Key &key) {
+		for (auto it = m_list.begin(); it != m_list.end(); ++it) {
+			if (it->key == key) {
+				m_list.splice(m_list.begin(), m_list, it);
+				return it->acc;
+			}
+		}
+		return nullptr;
+	}
+	// Takes ownership of acc, an older structure with the same key is freed
+	void put(const Key &key, Accel *acc) {
+		for (auto it = m_list.begin(); it != m_list.end(); ++it) {
+			if (it->key == key) {
+				if (it->acc != acc)
+					delete it->acc;
+				m_list.erase(it);
+				break;
+			}
+		}
+		m_list.push_front({key, acc});
+	}
+	// Frees least recently used structures until the rest fits into budget bytes, pinned one is never freed
+	void trim(size_t budget, const Accel *pinned) {
+		size_t mem = mem_size();
+		for (auto it = m_list.end(); it != m_list.begin() && mem > budget;) {
+			--it;
+			if (it->acc == pinned)
+				continue;
+			mem -= it->acc->mem_size();
+			delete it->acc;
+			it = m_list.erase(it);
+		}
+	}
+	// Frees everything except pinned, when the cached structures don't match the scene anymore
+	void drop_except(const Accel *pinned) {
+		for (auto it = m_list.begin(); it != m_list.end();) {
+			if (it->acc == pinned) {
+				++it;
+				continue;
+			}
+			delete it->acc;
+			it = m_list.erase(it);
+		}
+	}
+	void clear() { drop_except(nullptr); }
+
+	// Memory of all structures, it changes with the lazy BVH and the polygon cache, so it is not stored
+	size_t mem_size() const {
+		size_t mem = 0;
+		for (const Entry &e : m_list)
+			mem += e.acc->mem_size();
+		return mem;
+	}
+	size_t size() const { return m_list.size(); }
+
+  private:
+	struct Entry {
+		Key key;
+		Accel *acc;
+	};
+	std::list<Entry> m_list; // Most recently used first
+};
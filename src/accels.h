@@ -0,0 +1,96 @@
+#pragma once
+// All acceleration structures, their construction by type
+// and dispatch to the concrete class, so per-ray calls are not virtual
+#include "acc_bbox.h"
+#include "acc_bih.h"
+#include "acc_bih_compact.h"
+#include "acc_bvh.h"
+#include "acc_kdtree.h"
+#include "acc_none.h"
+#include "acc_qbvh.h"
+#include "acc_skdtree.h"
+#include "acc_tlas.h"
+#include "acc_wbvh.h"
+
+// Returns an accelerator of the given type before build, nullptr for invalid type
+inline Accel *new_accel(const Scene &scene, Accel_t type, const BuildParams &params = BuildParams()) {
+	Accel *acc = nullptr;
+	switch (type) {
+		case Accel_t::None:
+			acc = new AccelNone(scene);
+			break;
+		case Accel_t::Bbox:
+			acc = new AccelBbox(scene);
+			break;
+		case Accel_t::BVH:
+			acc = new AccelBvh(scene, params.leaf_size, params);
+			break;
+		case Accel_t::BVH4:
+			acc = new AccelBvh4(scene, params.leaf_size, params);
+			break;
+		case Accel_t::BVH8:
+			acc = new AccelBvh8(scene, params.leaf_size, params);
+			break;
+		case Accel_t::BVH8Q:
+			acc = new AccelBvh8Q(scene, params.leaf_size, params);
+			break;
+		case Accel_t::KdTree:
+			acc = new AccelKdTree(scene, params.leaf_size, params);
+			break;
+		case Accel_t::SpatialKd:
+			acc = new AccelSpatialKd(scene, params);
+			break;
+		case Accel_t::BIH:
+			acc = new AccelBih(scene, 4, params);
+			break;
+		case Accel_t::BIHCompact:
+			acc = new AccelBihCompact(scene, params);
+			break;
+		case Accel_t::TLAS:
+			acc = new AccelTlas(scene, params);
+			break;
+		default:
+			return nullptr;
+	};
+	return acc;
+}
+
+// Returns a built accelerator of the given type, nullptr for invalid type
+inline Accel *make_accel(const Scene &scene, Accel_t type, const BuildParams &params = BuildParams()) {
+	Accel *acc = new_accel(scene, type, params);
+	if (acc && !acc->built())
+		acc->build();
+	return acc;
+}
+
+// Calls fn with pointer to the concrete type of acc, returns false for unknown type
+// Derived classes have to be checked before their bases
+template <class F>
+bool dispatch_accel(Accel *acc, F &&fn) {
+	if (auto a = dynamic_cast<AccelNone *>(acc)) {
+		fn(a);
+	} else if (auto a = dynamic_cast<AccelBbox *>(acc)) {
+		fn(a);
+	} else if (auto a = dynamic_cast<AccelBvh4 *>(acc)) {
+		fn(a);
+	} else if (auto a = dynamic_cast<AccelBvh8 *>(acc)) {
+		fn(a);
+	} else if (auto a = dynamic_cast<AccelBvh8Q *>(acc)) {
+		fn(a);
+	} else if (auto a = dynamic_cast<AccelBvh *>(acc)) {
+		fn(a);
+	} else if (auto a = dynamic_cast<AccelKdTree *>(acc)) {
+		fn(a);
+	} else if (auto a = dynamic_cast<AccelSpatialKd *>(acc)) {
+		fn(a);
+	} else if (auto a = dynamic_cast<AccelBih *>(acc)) {
+		fn(a);
+	} else if (auto a = dynamic_cast<AccelBihCompact *>(acc)) {
+		fn(a);
+	} else if (auto a = dynamic_cast<AccelTlas *>(acc)) {
+		fn(a);
+	} else {
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,286 @@
+#pragma once
+// Created by Ondrej Ac (xacond00)
+// Picks the accelerator type, leaf size and bin count for a scene
+// Candidates are built over the scene (or its subset) and timed on a short probe render from the camera,
+// the fastest one is stored next to the OBJ, so later loads of the scene skip the probing
+#include "camera.h"
+#include "rng.h"
+#include "scene_cache.h"
+#include "thread_pool.h"
+#include <atomic>
+
+namespace autotune {
+constexpr uint32_t magic = 0x54524756; // "VGRT"
+constexpr uint32_t version = 1;
+
+struct Settings {
+	bool subset = true;		 // Build candidates over every subset_step-th polygon of each mesh
+	Uint subset_step = 8;	 // Scenes under subset_min polygons are probed whole
+	bool with_build = false; // Build time counts as well, spread over frames probe renders
+	Uint frames = 60;
+	Uint probe_width = 128; // Probe film width in pixels, height keeps the camera aspect
+};
+constexpr Uint subset_min = 20000;
+
+// Result of the probe, tuned fields replace the ones in BuildParams
+struct Choice {
+	Accel_t type = Accel_t::BVH;
+	Uint leaf_size = 8;
+	Uint bins = 32;
+	float mrays = 0;	 // Probe rays/s of the choice, 0 before any probe
+	float build_ms = 0;	 // Build time of the choice, scaled up from the subset
+	bool stored = false; // Read from the file next to the scene instead of probing
+};
+
+inline BuildParams apply(BuildParams params, const Choice &choice) {
+	params.leaf_size = choice.leaf_size;
+	params.bins = choice.bins;
+	return params;
+}
+
+// Structures taking leaf_size, BIH keeps its own leaf limit and SpatialKd stops by SAH
+inline bool uses_leaf(Accel_t type) {
+	return (type >= Accel_t::BVH && type <= Accel_t::KdTree) || type == Accel_t::BIHCompact;
+}
+// Structures building by binned SAH, LBVH sorts by Morton codes only
+inline bool uses_bins(Accel_t type, const BuildParams &params) {
+	if (type >= Accel_t::BVH && type <= Accel_t::BVH8Q)
+		return params.bvh_build != BvhBuild_t::LBVH;
+	return type == Accel_t::KdTree || type == Accel_t::BIH;
+}
+
+// Same meshes with every step-th polygon, vertices are copied whole
+// Has no file name, so neither the scene cache nor the autotune file is written for it
+inline Scene subset(const Scene &scene, Uint step) {
+	Scene sub;
+	sub.m_vert = scene.m_vert;
+	sub.m_scale = scene.m_scale;
+	for (const Mesh &mesh : scene.m_mesh) {
+		Mesh m = mesh;
+		m.m_off = sub.m_poly.size();
+		for (Uint i = mesh.beg(); i < mesh.end(); i += step)
+			sub.m_poly.push_back(scene.m_poly[i]);
+		m.m_cnt = sub.m_poly.size() - m.m_off;
+		if (!m.m_cnt)
+			continue;
+		m.m_bbox = sub.bbox_in(m.range());
+		sub.m_bbox.expand(m.m_bbox);
+		sub.m_mesh.push_back(m);
+	}
+	return sub;
+}
+
+// Primary rays of a probe render and one diffuse bounce from their hits
+// Bounces are found with a reference BVH, so every candidate traces the same rays
+// hits: rays hit by the reference, a candidate hitting a different number is broken
+inline std::vector<Ray> probe_rays(const Scene &scene, const Camera &cam, Uint width, size_t &hits) {
+	Vec2u dims = cam.film_size();
+	Uint w = std::max(1u, std::min(width, dims[0]));
+	Uint h = std::max(1u, Uint(size_t(w) * dims[1] / std::max(dims[0], 1u)));
+	std::vector<Ray> rays;
+	rays.reserve(2 * w * h);
+	for (Uint i = 0; i < h; i++) {
+		for (Uint j = 0; j < w; j++)
+			rays.push_back(cam.sample_ray(Vec2f(j + 0.5f, i + 0.5f) * cam.wh / Vec2f(Float(w), Float(h))));
+	}
+	AccelBvh ref(scene);
+	ref.build();
+	RNG rng(1234);
+	Uint primary = rays.size();
+	hits = 0;
+	for (Uint i = 0; i < primary; i++) {
+		HitInfo rec;
+		if (!ref.intersect(rays[i], rec))
+			continue;
+		hits++;
+		SurfaceInfo si = scene.surface_info(rec);
+		rays.push_back(Ray(si.P + si.N * EpsF, si.frame.world(rng.sample_cos_distribution())));
+	}
+	for (Uint i = primary; i < rays.size(); i++) {
+		HitInfo rec;
+		hits += ref.intersect(rays[i], rec);
+	}
+	return rays;
+}
+
+// Seconds of the first trace of rays and the best of the next reps, returns number of hit rays
+// First one includes refinement of the lazy BVH
+template <class Acc>
+inline size_t trace(const Acc *acc, const std::vector<Ray> &rays, ThreadPool &pool, Uint reps, double &first,
+					double &best) {
+	best = 1e30;
+	std::vector<size_t> worker_hits(pool.size(), 0);
+	for (Uint rep = 0; rep <= reps; rep++) {
+		std::fill(worker_hits.begin(), worker_hits.end(), 0);
+		double t = timer();
+		pool.parallel_for(rays.size(), 256, [&](Uint begin, Uint end, Uint worker) {
+			size_t h = 0;
+			for (Uint i = begin; i < end; i++) {
+				HitInfo rec;
+				h += acc->intersect(rays[i], rec);
+			}
+			worker_hits[worker] += h;
+		});
+		t = timer(t);
+		if (rep == 0)
+			first = t;
+		else
+			best = std::min(best, t);
+	}
+	size_t hits = 0;
+	for (size_t h : worker_hits)
+		hits += h;
+	return hits;
+}
+
+// Builds candidates over scene (or its subset) and measures them on the probe from cam
+// Type is picked first with the leaf size and bins of base, then leaf size and bins of the best type
+// progress: part of the candidates done
+// Returns the best structure when it was built over the whole scene, nullptr otherwise
+inline Accel *tune(const Scene &scene, const Camera &cam, const BuildParams &base, const Settings &set,
+				   Choice &choice, std::atomic<float> *progress = nullptr) {
+	choice = {Accel_t::BVH, base.leaf_size, base.bins};
+	if (!scene.poly_cnt())
+		return nullptr;
+	Uint step = set.subset ? std::min(std::max(set.subset_step, 1u), std::max(scene.poly_cnt() / subset_min, 1u)) : 1;
+	Scene sub;
+	if (step > 1)
+		sub = subset(scene, step);
+	const Scene &probed = step > 1 ? sub : scene;
+	size_t ref_hits = 0;
+	std::vector<Ray> rays = probe_rays(probed, cam, set.probe_width, ref_hits);
+	ThreadPool pool;
+
+	static const Accel_t types[] = {Accel_t::BVH,	 Accel_t::BVH4,		 Accel_t::BVH8, Accel_t::BVH8Q,
+									Accel_t::KdTree, Accel_t::SpatialKd, Accel_t::BIH,	Accel_t::BIHCompact};
+	static const Uint leaf_sizes[] = {1, 2, 4, 8, 16};
+	static const Uint bin_cnts[] = {8, 16, 32, 64};
+	const Uint total = std::size(types) + std::size(leaf_sizes) + std::size(bin_cnts);
+	Uint done = 0;
+
+	Accel *best = nullptr;
+	double best_cost = 1e30;
+	auto probe = [&](Accel_t type, Uint leaf, Uint bins) {
+		BuildParams params = base;
+		params.leaf_size = leaf;
+		params.bins = bins;
+		Accel *acc = make_accel(probed, type, params);
+		double first = 0, sec = 0;
+		size_t hits = 0;
+		dispatch_accel(acc, [&](auto a) { hits = trace(a, rays, pool, 2, first, sec); });
+		// Builds scale about linearly, the lazy BVH builds during its first trace
+		double build = (acc->build_time() + first - sec) * step;
+		double cost = sec + (set.with_build ? build / std::max(set.frames, 1u) : 0);
+		// Fast but wrong structure is never picked
+		if (hits == ref_hits && cost < best_cost) {
+			best_cost = cost;
+			choice = {type, leaf, bins, float(rays.size() / sec * 1e-6), float(build * 1e3)};
+			std::swap(best, acc);
+		}
+		delete acc;
+		if (progress)
+			progress->store(float(++done) / total);
+	};
+
+	for (Accel_t type : types)
+		probe(type, base.leaf_size, base.bins);
+	Accel_t type = choice.type;
+	if (uses_leaf(type)) {
+		for (Uint leaf : leaf_sizes) {
+			if (leaf != base.leaf_size)
+				probe(type, leaf, base.bins);
+		}
+	}
+	Uint leaf = choice.leaf_size;
+	if (uses_bins(type, base)) {
+		for (Uint bins : bin_cnts) {
+			if (bins != base.bins)
+				probe(type, leaf, bins);
+		}
+	}
+	if (progress)
+		progress->store(1);
+	if (step > 1) {
+		delete best;
+		return nullptr;
+	}
+	return best;
+}
+
+// Stored choice
+/////
+
+struct Key {
+	uint32_t magic = autotune::magic;
+	uint32_t version = autotune::version;
+	uint64_t source = 0;   // Hash of the OBJ file
+	uint64_t settings = 0; // Hash of the untuned build parameters, scale and probe settings
+	bool operator==(const Key &o) const {
+		return magic == o.magic && version == o.version && source == o.source && settings == o.settings;
+	}
+};
+
+inline uint64_t settings_hash(BuildParams params, const Settings &set, Float scale) {
+	params.leaf_size = 0;
+	params.bins = 0;
+	uint64_t h = scene_cache::params_hash(Accel_t::None, params, scale);
+	h = hash_bytes(&set.subset, sizeof(set.subset), h);
+	h = hash_bytes(&set.with_build, sizeof(set.with_build), h);
+	if (set.with_build)
+		h = hash_bytes(&set.frames, sizeof(set.frames), h);
+	return h;
+}
+
+// scene.obj -> scene.obj.autotune.vgc
+inline std::string path(const std::string &obj) { return obj + ".autotune.vgc"; }
+
+// Stores choice for scene, false if the scene has no source file or the file can't be written
+inline bool save(const Scene &scene, const BuildParams &params, const Settings &set, const Choice &choice) {
+	if (scene.m_filename.empty() || !scene.m_source_hash)
+		return false;
+	Key key;
+	key.source = scene.m_source_hash;
+	key.settings = settings_hash(params, set, scene.m_scale);
+	std::string file = path(scene.m_filename);
+	std::string tmp = file + ".tmp";
+	bool ok;
+	{
+		BinWriter out(tmp);
+		out.write(key);
+		out.write(choice);
+		ok = out.ok();
+	}
+	std::error_code ec;
+	if (ok)
+		std::filesystem::rename(tmp, file, ec);
+	if (!ok || ec)
+		std::filesystem::remove(tmp, ec);
+	return ok && !ec;
+}
+
+// Reads the choice stored for obj, source is the hash of the OBJ (0 hashes the file)
+inline bool load(const std::string &obj, uint64_t source, Float scale, const BuildParams &params, const Settings &set,
+				 Choice &choice) {
+	if (obj.empty())
+		return false;
+	if (!source) {
+		MappedFile src(obj);
+		if (!src.ok())
+			return false;
+		source = hash_bytes(src.data(), src.size());
+	}
+	Key key;
+	key.source = source;
+	key.settings = settings_hash(params, set, scale);
+	BinReader in(path(obj));
+	Key stored;
+	Choice read;
+	if (!in.ok() || !in.read(stored) || !(stored == key) || !in.read(read))
+		return false;
+	if (read.type < Accel_t::BVH || read.type >= Accel_t::LAST)
+		return false;
+	choice = read;
+	choice.stored = true;
+	return true;
+}
+} // namespace autotune
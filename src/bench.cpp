@@ -0,0 +1,366 @@
+// Headless benchmark of acceleration structures (vgert_bench), does not need SDL
+// Builds every selected accelerator over an OBJ scene and traces fixed workloads:
+// primary camera rays, diffuse bounce from primary hits, shadow rays (any hit) and random rays
+// Usage: vgert_bench scene.obj [--scale s] [--size px] [--rays n] [--threads 1,8] [--accels BVH,KdTree|all]
+//                              [--build Binned|LBVH|HLBVH|SBVH|Lazy] [--leaf n] [--bins n] [--pack 0|4|8] [--ropes 0|1] [--reps n]
+//                              [--traversal Stack,Ordered,Stackless|all] [--check n] [--csv]
+// With --traversal, BVH and TLAS are timed with each of the traversals, reported as BVH-Stackless etc.
+// With --check, n rays of every workload are compared with the brute force AccelNone, mismatches fail the run,
+// BVH and TLAS are checked with every traversal, primary rays of BVH are also traced in packets and compared with single rays
+#include "accels.h"
+#include "rng.h"
+#include "thread_pool.h"
+#include <cstring>
+#include <string>
+#include <vector>
+
+struct Workload {
+	const char *name;
+	std::vector<Ray> rays;
+	std::vector<Float> tmax; // Non-empty for any hit (ray_test) workloads
+};
+
+struct Result {
+	std::string accel;
+	double build_ms;
+	size_t nodes, memory;
+	const char *workload;
+	Uint threads;
+	size_t rays, hits;
+	double mrays;
+};
+
+static std::vector<std::string> split(const std::string &s, char sep) {
+	std::vector<std::string> out;
+	size_t beg = 0;
+	while (beg <= s.size()) {
+		size_t end = s.find(sep, beg);
+		if (end == std::string::npos)
+			end = s.size();
+		if (end > beg)
+			out.push_back(s.substr(beg, end - beg));
+		beg = end + 1;
+	}
+	return out;
+}
+
+// Fixed pinhole camera looking at the scene center from outside of its bounds
+static std::vector<Ray> camera_rays(const Scene &scene, Uint size) {
+	Vec3f c = scene.m_bbox.center();
+	Float diag = (scene.m_bbox.pmax - scene.m_bbox.pmin).len();
+	Vec3f eye = c + norm(Vec3f(0.3f, 0.4f, 1.f)) * diag;
+	Vec3f fwd = norm(c - eye);
+	Vec3f right = norm(cross(fwd, Vec3f(0, 1, 0)));
+	Vec3f up = cross(right, fwd);
+	Float scl = std::tan(0.5f * torad(Float(45)));
+	std::vector<Ray> rays;
+	rays.reserve(size * size);
+	for (Uint i = 0; i < size; i++) {
+		for (Uint j = 0; j < size; j++) {
+			Float x = (2.f * (j + 0.5f) / size - 1.f) * scl;
+			Float y = (1.f - 2.f * (i + 0.5f) / size) * scl;
+			rays.push_back(Ray(eye, fwd + right * x + up * y, true));
+		}
+	}
+	return rays;
+}
+
+// Workloads are generated once with the reference BVH, so every accelerator traces the same rays
+static std::vector<Workload> make_workloads(const Scene &scene, Uint size, Uint random_cnt) {
+	std::vector<Workload> wl(4);
+	wl[0].name = "primary";
+	wl[0].rays = camera_rays(scene, size);
+	wl[1].name = "diffuse";
+	wl[2].name = "shadow";
+	wl[3].name = "random";
+
+	AccelBvh ref(scene);
+	ref.build();
+	RNG rng(1234);
+	Vec3f ext = scene.m_bbox.pmax - scene.m_bbox.pmin;
+	Vec3f light = scene.m_bbox.center() + Vec3f(0.2f, 1.f, 0.3f) * ext;
+	for (const Ray &r : wl[0].rays) {
+		HitInfo rec;
+		if (!ref.intersect(r, rec))
+			continue;
+		SurfaceInfo si = scene.surface_info(rec);
+		Vec3f O = si.P + si.N * EpsF;
+		wl[1].rays.push_back(Ray(O, si.frame.world(rng.sample_cos_distribution())));
+		Vec3f L = light - O;
+		wl[2].rays.push_back(Ray(O, L, true));
+		wl[2].tmax.push_back(L.len());
+	}
+	for (Uint i = 0; i < random_cnt; i++) {
+		Vec3f O = scene.m_bbox.pmin + Vec3f(rng.rafl(), rng.rafl(), rng.rafl()) * ext;
+		Vec3f D = Vec3f(rng.rafl(), rng.rafl(), rng.rafl()) * 2.f - Vec3f(1);
+		wl[3].rays.push_back(Ray(O, D, true));
+	}
+	return wl;
+}
+
+// Returns number of hits, best time of reps goes to seconds
+template <class Acc>
+static size_t trace(const Acc *acc, const Workload &wl, ThreadPool &pool, Uint reps, double &seconds) {
+	size_t hits = 0;
+	seconds = 1e30;
+	const Uint n = wl.rays.size();
+	for (Uint rep = 0; rep < reps; rep++) {
+		std::vector<size_t> worker_hits(pool.size(), 0);
+		double t = timer();
+		pool.parallel_for(n, 1024, [&](Uint begin, Uint end, Uint worker) {
+			size_t h = 0;
+			for (Uint i = begin; i < end; i++) {
+				if (wl.tmax.empty()) {
+					HitInfo rec;
+					h += acc->intersect(wl.rays[i], rec);
+				} else {
+					h += acc->ray_test(wl.rays[i], wl.tmax[i]);
+				}
+			}
+			worker_hits[worker] += h;
+		});
+		seconds = std::min(seconds, timer(t));
+		hits = 0;
+		for (size_t h : worker_hits)
+			hits += h;
+	}
+	return hits;
+}
+
+// Closest hit distance (InfF for a miss), 1 / 0 for any hit workloads
+template <class Acc>
+static Float hit_of(const Acc *acc, const Workload &wl, Uint i) {
+	if (!wl.tmax.empty())
+		return acc->ray_test(wl.rays[i], wl.tmax[i]);
+	HitInfo rec;
+	return acc->intersect(wl.rays[i], rec) ? rec.t() : InfF;
+}
+
+// Hits of cnt rays spread over each workload
+static std::vector<std::vector<Float>> check_hits(Accel *acc, const std::vector<Workload> &wls, Uint cnt) {
+	std::vector<std::vector<Float>> hits(wls.size());
+	for (size_t w = 0; w < wls.size(); w++) {
+		Uint n = wls[w].rays.size(), m = std::min(cnt, n);
+		for (Uint i = 0; i < m; i++)
+			dispatch_accel(acc, [&](auto a) { hits[w].push_back(hit_of(a, wls[w], Uint(size_t(i) * n / m))); });
+	}
+	return hits;
+}
+
+// Number of checked rays, which hit something else than the reference
+static size_t check_mismatch(const std::vector<std::vector<Float>> &hits, const std::vector<std::vector<Float>> &ref) {
+	size_t bad = 0;
+	for (size_t w = 0; w < ref.size(); w++) {
+		for (size_t i = 0; i < ref[w].size(); i++)
+			bad += std::abs(hits[w][i] - ref[w][i]) > 1e-4f * std::max(Float(1), ref[w][i]);
+	}
+	return bad;
+}
+
+// Primary rays traced in 8x8 pixel packets, number of rays whose hit differs from single ray traversal
+static size_t check_packets(const AccelBvh *acc, const std::vector<Ray> &rays, Uint size) {
+	size_t bad = 0;
+	RayPacket packet;
+	for (Uint i0 = 0; i0 < size; i0 += 8) {
+		for (Uint j0 = 0; j0 < size; j0 += 8) {
+			packet.clear();
+			for (Uint i = i0; i < std::min(i0 + 8, size); i++) {
+				for (Uint j = j0; j < std::min(j0 + 8, size); j++)
+					packet.add(rays[i * size + j]);
+			}
+			acc->intersect_packet(packet);
+			for (Uint k = 0; k < packet.cnt; k++) {
+				HitInfo rec;
+				Float t = acc->intersect(packet.rays[k], rec) ? rec.t() : InfF;
+				bad += std::abs(packet.rec[k].t() - t) > 1e-4f * std::max(Float(1), t);
+			}
+		}
+	}
+	return bad;
+}
+
+static void print_results(const std::string &scene, const std::vector<Result> &res, bool csv) {
+	if (csv) {
+		printf("scene,accel,build_ms,nodes,memory,workload,threads,rays,hits,mrays\n");
+		for (auto &r : res)
+			printf("%s,%s,%.3f,%zu,%zu,%s,%u,%zu,%zu,%.3f\n", scene.c_str(), r.accel.c_str(), r.build_ms, r.nodes,
+				   r.memory, r.workload, r.threads, r.rays, r.hits, r.mrays);
+		return;
+	}
+	printf("[\n");
+	for (size_t i = 0; i < res.size(); i++) {
+		auto &r = res[i];
+		printf("  {\"scene\": \"%s\", \"accel\": \"%s\", \"build_ms\": %.3f, \"nodes\": %zu, \"memory\": %zu, "
+			   "\"workload\": \"%s\", \"threads\": %u, \"rays\": %zu, \"hits\": %zu, \"mrays\": %.3f}%s\n",
+			   scene.c_str(), r.accel.c_str(), r.build_ms, r.nodes, r.memory, r.workload, r.threads, r.rays, r.hits,
+			   r.mrays, i + 1 < res.size() ? "," : "");
+	}
+	printf("]\n");
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s scene.obj [--scale s] [--size px] [--rays n] [--threads 1,8] "
+						"[--accels BVH,KdTree|all] [--build Binned|LBVH|HLBVH|SBVH|Lazy] [--leaf n] [--bins n] [--pack 0|4|8] "
+						"[--ropes 0|1] [--reps n] [--traversal Stack,Ordered,Stackless|all] [--check n] [--csv]\n",
+				argv[0]);
+		return 1;
+	}
+	std::string path = argv[1];
+	Float scale = 1;
+	Uint size = 512, random_cnt = 1 << 18, reps = 3, check_cnt = 0;
+	bool csv = false;
+	std::vector<Uint> threads = {1};
+	if (std::thread::hardware_concurrency() > 1)
+		threads.push_back(std::thread::hardware_concurrency());
+	// Brute force ones are too slow for real scenes, so they have to be asked for
+	std::vector<Accel_t> accels;
+	for (int t = int(Accel_t::BVH); t < int(Accel_t::LAST); t++)
+		accels.push_back(Accel_t(t));
+	BuildParams params;
+	// Empty keeps the default traversal
+	std::vector<Traversal_t> traversals;
+
+	for (int i = 2; i < argc; i++) {
+		std::string arg = argv[i];
+		std::string val = i + 1 < argc ? argv[i + 1] : "";
+		if (arg == "--csv") {
+			csv = true;
+			continue;
+		}
+		i++;
+		if (arg == "--scale") {
+			scale = std::stof(val);
+		} else if (arg == "--size") {
+			size = std::stoul(val);
+		} else if (arg == "--rays") {
+			random_cnt = std::stoul(val);
+		} else if (arg == "--reps") {
+			reps = std::max(1ul, std::stoul(val));
+		} else if (arg == "--threads") {
+			threads.clear();
+			for (auto &t : split(val, ','))
+				threads.push_back(std::stoul(t));
+		} else if (arg == "--accels") {
+			accels.clear();
+			for (int t = 0; t < int(Accel_t::LAST); t++) {
+				for (auto &name : split(val, ','))
+					if (name == "all" || name == accel_t_names[t])
+						accels.push_back(Accel_t(t));
+			}
+		} else if (arg == "--build") {
+			for (int b = 0; b < int(BvhBuild_t::LAST); b++)
+				if (!strncmp(bvh_build_names[b], val.c_str(), val.size()))
+					params.bvh_build = BvhBuild_t(b);
+		} else if (arg == "--leaf") {
+			params.leaf_size = std::max(1ul, std::stoul(val));
+		} else if (arg == "--bins") {
+			params.bins = std::stoul(val);
+		} else if (arg == "--pack") {
+			params.pack_width = std::stoul(val);
+		} else if (arg == "--check") {
+			check_cnt = std::stoul(val);
+		} else if (arg == "--ropes") {
+			params.kd_ropes = std::stoul(val);
+		} else if (arg == "--traversal") {
+			traversals.clear();
+			for (int t = 0; t < int(Traversal_t::LAST); t++) {
+				for (auto &name : split(val, ','))
+					if (name == "all" || name == traversal_names[t])
+						traversals.push_back(Traversal_t(t));
+			}
+		} else {
+			fprintf(stderr, "Unknown option %s\n", arg.c_str());
+			return 1;
+		}
+	}
+
+	Scene scene;
+	if (!scene.load_obj(path, scale) || scene.poly_cnt() == 0) {
+		fprintf(stderr, "Failed to load %s\n", path.c_str());
+		return 1;
+	}
+	fprintf(stderr, "Loaded %s: %u polygons in %.3f s (%.1f MB/s)\n", path.c_str(), scene.poly_cnt(), scene.m_load_time,
+			scene.load_speed());
+	auto workloads = make_workloads(scene, size, random_cnt);
+	std::vector<std::vector<Float>> reference;
+	if (check_cnt) {
+		AccelNone none(scene);
+		reference = check_hits(&none, workloads, check_cnt);
+	}
+	size_t mismatch = 0;
+
+	std::vector<Result> results;
+	for (Accel_t type : accels) {
+		Accel *acc = make_accel(scene, type, params);
+		// Time to the first image: build and one pass of primary rays, which refines the lazy BVH
+		double first = 0;
+		{
+			ThreadPool pool(threads[0]);
+			dispatch_accel(acc, [&](auto a) { trace(a, workloads[0], pool, 1, first); });
+		}
+		fprintf(stderr, "%s: build %.3f ms, first frame %.3f ms, %zu nodes", accel_t_names[int(type)],
+				acc->build_time() * 1e3, (acc->build_time() + first) * 1e3, acc->nodes_cnt());
+		auto bvh = dynamic_cast<AccelBvh *>(acc);
+		if (bvh && bvh->lazy())
+			fprintf(stderr, ", %.1f %% of polygons in leaves", bvh->progress() * 100);
+		fprintf(stderr, "\n");
+		// Binary BVH and the bottom levels of TLAS can switch the traversal, -1 keeps the default one
+		auto tlas = dynamic_cast<AccelTlas *>(acc);
+		bool has_traversal = type == Accel_t::BVH || tlas;
+		auto set_traversal = [&](Traversal_t t) {
+			if (tlas)
+				tlas->set_traversal(t);
+			else
+				bvh->set_traversal(t);
+		};
+		auto label = [&](int t) {
+			std::string name = accel_t_names[int(type)];
+			return t < 0 ? name : name + "-" + traversal_names[t];
+		};
+		if (check_cnt) {
+			std::vector<int> checked = {-1};
+			if (has_traversal)
+				checked = {int(Traversal_t::Stack), int(Traversal_t::Ordered), int(Traversal_t::Stackless)};
+			for (int t : checked) {
+				if (t >= 0)
+					set_traversal(Traversal_t(t));
+				size_t bad = check_mismatch(check_hits(acc, workloads, check_cnt), reference);
+				if (bad)
+					fprintf(stderr, "%s: %zu checked rays differ from brute force\n", label(t).c_str(), bad);
+				mismatch += bad;
+			}
+			if (type == Accel_t::BVH) {
+				size_t bad = check_packets(bvh, workloads[0].rays, size);
+				if (bad)
+					fprintf(stderr, "%s: %zu packet rays differ from single rays\n", accel_t_names[int(type)], bad);
+				mismatch += bad;
+			}
+			if (has_traversal)
+				set_traversal(Traversal_t::Ordered);
+		}
+		std::vector<int> timed = {-1};
+		if (has_traversal && !traversals.empty()) {
+			timed.clear();
+			for (Traversal_t t : traversals)
+				timed.push_back(int(t));
+		}
+		for (int t : timed) {
+			if (t >= 0)
+				set_traversal(Traversal_t(t));
+			for (Uint th : threads) {
+				ThreadPool pool(th);
+				for (auto &wl : workloads) {
+					double sec = 0;
+					size_t hits = 0;
+					dispatch_accel(acc, [&](auto a) { hits = trace(a, wl, pool, reps, sec); });
+					results.push_back({label(t), acc->build_time() * 1e3, acc->nodes_cnt(), acc->mem_size(), wl.name,
+									   pool.size(), wl.rays.size(), hits, wl.rays.size() / sec * 1e-6});
+				}
+			}
+		}
+		delete acc;
+	}
+	print_results(path, results, csv);
+	return mismatch ? 2 : 0;
+}
@@ -0,0 +1,131 @@
+#pragma once
+// Created by Ondrej Ac (xacond00)
+// Sectioned binary files for the scene cache
+// Every array is stored as element size, count and raw bytes starting at 64B aligned offset,
+// so a mapped file can be read back with one copy per array
+#include "defines.h"
+#include "obj_parser.h"
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+
+class BinWriter {
+  public:
+	explicit BinWriter(const std::string &filename) : m_file(filename, std::ios::binary | std::ios::trunc) {}
+
+	bool ok() const { return bool(m_file); }
+
+	template <class T>
+	void write(const T &val) {
+		static_assert(std::is_trivially_copyable_v<T>, "Only plain data can be written");
+		raw(&val, sizeof(T));
+	}
+
+	template <class T>
+	void write(const std::vector<T> &vec) {
+		static_assert(std::is_trivially_copyable_v<T>, "Only plain data can be written");
+		write(uint64_t(sizeof(T)));
+		write(uint64_t(vec.size()));
+		align();
+		raw(vec.data(), vec.size() * sizeof(T));
+	}
+
+	void write(const std::string &str) {
+		write(uint64_t(str.size()));
+		raw(str.data(), str.size());
+	}
+
+  private:
+	void raw(const void *data, size_t size) {
+		m_file.write(static_cast<const char *>(data), size);
+		m_pos += size;
+	}
+	void align() {
+		static const char zeros[64] = {};
+		raw(zeros, (64 - m_pos % 64) % 64);
+	}
+
+	std::ofstream m_file;
+	size_t m_pos = 0;
+};
+
+// Reads back what BinWriter wrote, every read fails once the data don't match
+class BinReader {
+  public:
+	explicit BinReader(const std::string &filename) : m_file(filename) { m_ok = m_file.ok(); }
+
+	bool ok() const { return m_ok; }
+	size_t size() const { return m_file.size(); }
+
+	template <class T>
+	bool read(T &val) {
+		static_assert(std::is_trivially_copyable_v<T>, "Only plain data can be read");
+		return raw(&val, sizeof(T));
+	}
+
+	template <class T>
+	bool read(std::vector<T> &vec) {
+		static_assert(std::is_trivially_copyable_v<T>, "Only plain data can be read");
+		uint64_t elem = 0, cnt = 0;
+		if (!read(elem) || !read(cnt) || elem != sizeof(T))
+			return m_ok = false;
+		m_pos += (64 - m_pos % 64) % 64;
+		if (m_pos > m_file.size() || cnt > (m_file.size() - m_pos) / sizeof(T))
+			return m_ok = false;
+		vec.resize(cnt);
+		return raw(vec.data(), cnt * sizeof(T));
+	}
+
+	// Skips an array written by write(vector)
+	bool skip_array() {
+		uint64_t elem = 0, cnt = 0;
+		if (!read(elem) || !read(cnt))
+			return false;
+		m_pos += (64 - m_pos % 64) % 64;
+		if (m_pos > m_file.size() || elem * cnt > m_file.size() - m_pos)
+			return m_ok = false;
+		m_pos += elem * cnt;
+		return true;
+	}
+
+	bool read(std::string &str) {
+		uint64_t len = 0;
+		if (!read(len) || len > m_file.size() - m_pos)
+			return m_ok = false;
+		str.resize(len);
+		return raw(str.data(), len);
+	}
+
+  private:
+	bool raw(void *data, size_t size) {
+		if (!m_ok || size > m_file.size() - m_pos)
+			return m_ok = false;
+		if (size)
+			memcpy(data, m_file.data() + m_pos, size);
+		m_pos += size;
+		return true;
+	}
+
+	MappedFile m_file;
+	size_t m_pos = 0;
+	bool m_ok = false;
+};
+
+// 64-bit hash of a byte range, keys cached files by their source
+inline uint64_t hash_bytes(const void *data, size_t size, uint64_t h = 0x9E3779B97F4A7C15ull) {
+	const char *p = static_cast<const char *>(data);
+	auto mix = [&](uint64_t w) {
+		h ^= w * 0xC2B2AE3D27D4EB4Full;
+		h = ((h << 31) | (h >> 33)) * 0x9E3779B97F4A7C15ull;
+	};
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, 8);
+		mix(w);
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, p + i, size - i);
+	mix(tail ^ size);
+	return h;
+}
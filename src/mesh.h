@@ -2,6 +2,7 @@
 // Created by Ondrej Ac (xacond00)
 #include "aabb.h"
 #include "ray.h"
+#include "transform.h"
 #include "vec.h"
 
 struct Mesh {
@@ -14,4 +15,17 @@ struct Mesh {
 	Uint m_off = 0;
 	Uint m_cnt = 0;
 	AABB m_bbox;
-};
\ No newline at end of file
+};
+
+// Placement of a mesh, all instances of a mesh share its polygons
+struct Instance {
+	Instance() {}
+	Instance(Uint mesh, const Transform &xf) : m_mesh(mesh), m_xf(xf) {}
+	Vec3f point(Vec3f p) const { return m_xf.point<true>(p); }
+	Vec3f vec(Vec3f v) const { return m_xf.vec<true>(v); }
+	// Ray in the mesh space, keeps the world distance along the ray
+	Ray local(const Ray &r) const { return Ray(m_xf.inv_point(r.O), m_xf.inv_vec(r.D)); }
+	Uint m_mesh = 0;
+	Transform m_xf = Transform(Vec3f(0), Vec3f(0), 1);
+	AABB m_bbox; // World bounds, see Scene::update_inst_bbox()
+};
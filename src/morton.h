@@ -0,0 +1,68 @@
+#pragma once
+// Morton codes and radix sort used by linear builders and ray sorting
+#include "vec.h"
+#include <cstdint>
+
+// Spreads lower 10 bits, so there are 2 zero bits between each of them
+inline uint32_t expand_bits(uint32_t v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// 30-bit morton code of point normalized to <0, 1>
+// Bit 3k+2 belongs to x, 3k+1 to y and 3k to z
+inline uint32_t morton3(const Vec3f &p) {
+	uint32_t c[3];
+	for (Uint i = 0; i < 3; i++) {
+		c[i] = uint32_t(std::min(std::max(p[i] * 1024.f, 0.f), 1023.f));
+	}
+	return (expand_bits(c[0]) << 2) | (expand_bits(c[1]) << 1) | expand_bits(c[2]);
+}
+
+// Axis, which the given bit of morton3() code splits
+inline Uint morton_axis(Uint bit) { return 2 - bit % 3; }
+
+// Index of the highest set bit (v != 0)
+inline Uint highest_bit(uint32_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+	return 31 - __builtin_clz(v);
+#else
+	Uint i = 0;
+	while (v >>= 1)
+		i++;
+	return i;
+#endif
+}
+
+// LSD radix sort of keys together with their values
+// Only the lowest "bits" bits of the keys are sorted
+template <class T>
+void radix_sort(std::vector<uint32_t> &keys, std::vector<T> &vals, Uint bits = 32) {
+	constexpr Uint digit = 8;
+	constexpr Uint buckets = 1 << digit;
+	size_t n = keys.size();
+	std::vector<uint32_t> tkeys(n);
+	std::vector<T> tvals(n);
+	for (Uint shift = 0; shift < bits; shift += digit) {
+		size_t cnt[buckets] = {};
+		for (size_t i = 0; i < n; i++) {
+			cnt[(keys[i] >> shift) & (buckets - 1)]++;
+		}
+		size_t sum = 0;
+		for (Uint b = 0; b < buckets; b++) {
+			size_t c = cnt[b];
+			cnt[b] = sum;
+			sum += c;
+		}
+		for (size_t i = 0; i < n; i++) {
+			size_t dst = cnt[(keys[i] >> shift) & (buckets - 1)]++;
+			tkeys[dst] = keys[i];
+			tvals[dst] = vals[i];
+		}
+		keys.swap(tkeys);
+		vals.swap(tvals);
+	}
+}
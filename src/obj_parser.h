@@ -0,0 +1,165 @@
+#pragma once
+// Fast OBJ parsing: file is mapped into memory, split at line boundaries into chunks,
+// which are parsed concurrently and merged by Scene::load_obj in file order
+#include "aabb.h"
+#include "vec.h"
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file, memory mapped where available
+class MappedFile {
+  public:
+	explicit MappedFile(const std::string &filename) {
+#ifdef _WIN32
+		std::ifstream file(filename, std::ios::binary | std::ios::ate);
+		if (!file)
+			return;
+		m_buffer.resize(size_t(file.tellg()));
+		file.seekg(0);
+		file.read(m_buffer.data(), m_buffer.size());
+		m_data = m_buffer.data();
+		m_size = m_buffer.size();
+		m_ok = true;
+#else
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+		struct stat st;
+		if (fstat(fd, &st) == 0) {
+			m_size = st.st_size;
+			m_ok = true;
+			if (m_size) {
+				void *ptr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (ptr == MAP_FAILED) {
+					m_ok = false;
+					m_size = 0;
+				} else {
+					m_data = static_cast<const char *>(ptr);
+					madvise(ptr, m_size, MADV_SEQUENTIAL);
+				}
+			}
+		}
+		close(fd);
+#endif
+	}
+	~MappedFile() {
+#ifndef _WIN32
+		if (m_data)
+			munmap(const_cast<char *>(m_data), m_size);
+#endif
+	}
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	bool ok() const { return m_ok; }
+	const char *data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+  private:
+	const char *m_data = nullptr;
+	size_t m_size = 0;
+	bool m_ok = false;
+#ifdef _WIN32
+	std::vector<char> m_buffer;
+#endif
+};
+
+// Parsed content of one chunk of lines
+struct ObjChunk {
+	// "o" / "g" line, starting a new mesh before face number face (chunk local)
+	struct Group {
+		Uint face;
+		std::string name;
+		bool named;
+	};
+	std::vector<Vec3f> vert;
+	// Face indices as written in the file (1-based, negative ones are relative),
+	// together with chunk local vertex count at that line to resolve the relative ones
+	std::vector<Vec3i> face;
+	std::vector<Uint> face_vert;
+	std::vector<Group> groups;
+	AABB bbox;
+};
+
+namespace obj {
+inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char *skip_space(const char *p, const char *end) {
+	while (p < end && is_space(*p))
+		p++;
+	return p;
+}
+
+inline const char *skip_token(const char *p, const char *end) {
+	while (p < end && !is_space(*p) && *p != '\n')
+		p++;
+	return p;
+}
+
+// Parses number of a whitespace separated token, value stays 0 when there is none
+inline const char *parse_float(const char *p, const char *end, Float &val) {
+	p = skip_space(p, end);
+	const char *tok = skip_token(p, end);
+	val = 0;
+	// from_chars does not accept leading '+'
+	if (p < tok && *p == '+')
+		p++;
+	std::from_chars(p, tok, val);
+	return tok;
+}
+
+// Vertex index of "v", "v/vt", "v//vn" or "v/vt/vn" token
+inline const char *parse_index(const char *p, const char *end, Int &val) {
+	p = skip_space(p, end);
+	const char *tok = skip_token(p, end);
+	val = 0;
+	std::from_chars(p, tok, val);
+	return tok;
+}
+
+// Parses lines in [beg, end), beg has to be at the start of a line
+inline void parse_chunk(const char *beg, const char *end, Float scale, ObjChunk &out) {
+	const char *p = beg;
+	while (p < end) {
+		const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+		if (!eol)
+			eol = end;
+		p = skip_space(p, eol);
+		const char *key_end = skip_token(p, eol);
+		size_t key_len = key_end - p;
+		if (key_len == 1 && p[0] == 'v') {
+			Vec3f v;
+			const char *q = key_end;
+			for (Uint i = 0; i < 3; i++)
+				q = parse_float(q, eol, v[i]);
+			v = v * scale;
+			out.vert.push_back(v);
+			out.bbox.expand(v);
+		} else if (key_len == 1 && p[0] == 'f') {
+			// Only the first triangle of a polygon is used
+			Vec3i f;
+			const char *q = key_end;
+			for (Uint i = 0; i < 3; i++)
+				q = parse_index(q, eol, f[i]);
+			out.face.push_back(f);
+			out.face_vert.push_back(out.vert.size());
+		} else if (key_len == 1 && (p[0] == 'o' || p[0] == 'g')) {
+			const char *name = skip_space(key_end, eol);
+			const char *name_end = skip_token(name, eol);
+			out.groups.push_back({Uint(out.face.size()), std::string(name, name_end), name < name_end});
+		}
+		p = eol + 1;
+	}
+}
+} // namespace obj
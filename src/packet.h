@@ -0,0 +1,131 @@
+#pragma once
+// Packet of coherent rays (8x8 pixel tile) traced through the tree together
+// Rays are kept in SoA layout, so each group of 8 rays is tested against a box with one SIMD slab test
+#include "aabb.h"
+#include "ray.h"
+#include "simd.h"
+#include <cmath>
+#include <cstdint>
+
+struct RayPacket {
+	static constexpr Uint size = 64;
+	static constexpr Uint width = 8;
+	static constexpr Uint groups = size / width;
+	using Lane = Lane_t<width>;
+
+	void clear() { cnt = 0; }
+	void add(const Ray &r) {
+		rays[cnt] = r;
+		rec[cnt] = HitInfo();
+		cnt++;
+	}
+
+	// Fills SoA arrays and packet bounds, unused slots repeat the first ray and stay inactive
+	void finalize() {
+		coherent = true;
+		sgn = rays[0].sgn;
+		omin = omax = rays[0].O;
+		imin = imax = rays[0].iD;
+		for (Uint i = 0; i < size; i++) {
+			const Ray &r = rays[i < cnt ? i : 0];
+			for (Uint a = 0; a < 3; a++) {
+				O[a][i] = r.O[a];
+				iD[a][i] = r.iD[a];
+				coherent &= r.sgn[a] == sgn[a] && std::isfinite(r.iD[a]);
+			}
+			t[i] = i < cnt ? InfF : 0;
+			omin = min(omin, r.O);
+			omax = max(omax, r.O);
+			imin = min(imin, r.iD);
+			imax = max(imax, r.iD);
+		}
+		tmax = InfF;
+	}
+
+	uint64_t active() const { return cnt == size ? ~uint64_t(0) : (uint64_t(1) << cnt) - 1; }
+
+	// Conservative packet test with interval arithmetic over origins and inverse directions
+	// Returns false only if no ray of the packet can hit the box, needs equal direction signs
+	bool interval_test(const AABB &box) const {
+		if (!coherent)
+			return true;
+		Float tnear = -InfF, tfar = InfF;
+		for (Uint a = 0; a < 3; a++) {
+			Float lo = sgn[a] ? box.pmax[a] : box.pmin[a];
+			Float hi = sgn[a] ? box.pmin[a] : box.pmax[a];
+			// Lower bound of entry and upper bound of exit distance along this axis
+			tnear = std::max(tnear, interval_min(lo - omax[a], lo - omin[a], imin[a], imax[a]));
+			tfar = std::min(tfar, interval_max(hi - omax[a], hi - omin[a], imin[a], imax[a]));
+		}
+		return tnear <= tfar && tfar > 0 && tnear < tmax;
+	}
+
+	// Mask of rays from mask, which hit the box before their closest hit
+	uint64_t hit(const AABB &box, uint64_t mask) const {
+		uint64_t res = 0;
+		for (Uint g = 0; g < groups; g++) {
+			if (!((mask >> (g * width)) & 0xFF))
+				continue;
+			Uint o = g * width;
+			Lane t1 = (Lane(box.pmin[0]) - Lane::load(O[0] + o)) * Lane::load(iD[0] + o);
+			Lane t2 = (Lane(box.pmax[0]) - Lane::load(O[0] + o)) * Lane::load(iD[0] + o);
+			Lane tmin = min(t1, t2);
+			Lane tmx = max(t1, t2);
+			for (Uint a = 1; a < 3; a++) {
+				t1 = (Lane(box.pmin[a]) - Lane::load(O[a] + o)) * Lane::load(iD[a] + o);
+				t2 = (Lane(box.pmax[a]) - Lane::load(O[a] + o)) * Lane::load(iD[a] + o);
+				tmin = max(tmin, min(t1, t2));
+				tmx = min(tmx, max(t1, t2));
+			}
+			Uint bits = slab_hit(tmin, tmx, Lane::load(t + o));
+			res |= uint64_t(bits) << o;
+		}
+		return res & mask;
+	}
+
+	// Pulls closest hits back after a leaf was intersected by rays in mask
+	void update(uint64_t mask) {
+		while (mask) {
+			Uint i = lane_first64(mask);
+			mask &= mask - 1;
+			t[i] = rec[i].t();
+		}
+		tmax = 0;
+		for (Uint i = 0; i < cnt; i++)
+			tmax = std::max(tmax, t[i]);
+	}
+
+	static Uint lane_first64(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_ctzll(mask);
+#else
+		Uint i = 0;
+		while (!(mask & 1)) {
+			mask >>= 1;
+			i++;
+		}
+		return i;
+#endif
+	}
+
+	Ray rays[size];
+	HitInfo rec[size];
+	Uint cnt = 0;
+	alignas(32) Float O[3][size];
+	alignas(32) Float iD[3][size];
+	alignas(32) Float t[size];
+	// Bounds of the packet, used by interval_test()
+	Vec3f omin, omax, imin, imax;
+	Vec3u sgn;
+	Float tmax = InfF;
+	bool coherent = false;
+
+  private:
+	// Bounds of product of intervals [a0, a1] * [b0, b1]
+	static Float interval_min(Float a0, Float a1, Float b0, Float b1) {
+		return std::min(std::min(a0 * b0, a0 * b1), std::min(a1 * b0, a1 * b1));
+	}
+	static Float interval_max(Float a0, Float a1, Float b0, Float b1) {
+		return std::max(std::max(a0 * b0, a0 * b1), std::max(a1 * b0, a1 * b1));
+	}
+};
@@ -14,14 +14,51 @@ struct Vert3{
 	}
 	Vec3f center() const { return  (data[0] + data[1] + data[2]) * Float(1.0 / 3.0); }
 
+	// Bounds of the triangle part inside box (invalid AABB when outside)
+	// Sutherland-Hodgman against the 6 box planes
+	AABB clip_bbox(const AABB &box) const {
+		Vec3f pts[9], tmp[9];
+		Uint n = 3;
+		for (Uint i = 0; i < 3; i++)
+			pts[i] = data[i];
+		for (Uint a = 0; a < 3 && n; a++) {
+			for (Uint side = 0; side < 2 && n; side++) {
+				Float plane = side ? box.pmax[a] : box.pmin[a];
+				auto in = [&](const Vec3f &p) { return side ? p[a] <= plane : p[a] >= plane; };
+				Uint m = 0;
+				for (Uint i = 0; i < n; i++) {
+					const Vec3f &p = pts[i];
+					const Vec3f &q = pts[(i + 1) % n];
+					bool pin = in(p), qin = in(q);
+					if (pin)
+						tmp[m++] = p;
+					if (pin != qin) {
+						Vec3f x = p + (q - p) * ((plane - p[a]) / (q[a] - p[a]));
+						x[a] = plane;
+						tmp[m++] = x;
+					}
+				}
+				n = m;
+				for (Uint i = 0; i < n; i++)
+					pts[i] = tmp[i];
+			}
+		}
+		AABB res(pts, n);
+		if (n) {
+			res.pmin = max(res.pmin, box.pmin);
+			res.pmax = min(res.pmax, box.pmax);
+		}
+		return res;
+	}
 };
 
-struct Poly {
+// Padded to a cache line, so accelerators can keep a flat array of them
+struct alignas(64) Poly {
 	// 3 points and index
 	Poly(Vec3f a, Vec3f b, Vec3f c, Uint idx) : Q(a), U(b - a), V(c - a), N(cross(U, V)), idx(idx) {}
 	Poly(const Vert3& v, Uint idx = -1) : Poly(v.data[0], v.data[1], v.data[2], idx){}
 
-	bool intersect(const Ray &r, HitInfo &rec) {
+	bool intersect(const Ray &r, HitInfo &rec) const {
 		auto si = bounds_check(r);
 		if (within(si.u(), 0.f, 1.f) && within(si.v(), 0.f, 1.f - si.u()) && inside(si.t(), Eps6F, rec.t())) {
 			rec = si;
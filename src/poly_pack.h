@@ -0,0 +1,85 @@
+#pragma once
+// Created by Ondrej Ac (xacond00)
+// Leaf polygons packed by W in SoA layout, intersected at once with SIMD Moller-Trumbore
+// Lanes compute exactly the same operations as Poly, so hits don't depend on the packing
+#include "poly.h"
+#include "simd.h"
+
+template <Uint W>
+struct alignas(32) PolyPack {
+	using Lane = Lane_t<W>;
+
+	// Lanes past cnt keep zero edges, which never pass the test
+	void set(Uint lane, const Poly &p) {
+		for (Uint a = 0; a < 3; a++) {
+			Q[a][lane] = p.Q[a];
+			U[a][lane] = p.U[a];
+			V[a][lane] = p.V[a];
+		}
+		idx[lane] = p.idx;
+		cnt = std::max(cnt, lane + 1);
+	}
+
+	// Closest hit of lanes before rec.t(), ties go to the lower lane like in a scalar loop
+	bool intersect(const Ray &r, HitInfo &rec) const {
+		Lane t, u, v, det;
+		Uint mask = test(r, rec.t(), t, u, v, det);
+		if (!mask)
+			return false;
+		Float tt[W], uu[W], vv[W], dd[W];
+		t.store(tt);
+		u.store(uu);
+		v.store(vv);
+		det.store(dd);
+		Uint best = lane_first(mask);
+		for (mask &= mask - 1; mask; mask &= mask - 1) {
+			Uint i = lane_first(mask);
+			if (tt[i] < tt[best])
+				best = i;
+		}
+		rec = HitInfo(tt[best], uu[best], vv[best], idx[best], dd[best] > 0);
+		return true;
+	}
+
+	bool ray_test(const Ray &r, Float tmax) const {
+		Lane t, u, v, det;
+		return test(r, tmax, t, u, v, det) != 0;
+	}
+
+	Float Q[3][W] = {};
+	Float U[3][W] = {};
+	Float V[3][W] = {};
+	Uint idx[W] = {};
+	Uint cnt = 0;
+
+  private:
+	static Lane dot(const Lane a[3], const Lane b[3]) { return Lane(0) + a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; }
+	static void cross(const Lane a[3], const Lane b[3], Lane out[3]) {
+		out[0] = a[1] * b[2] - a[2] * b[1];
+		out[1] = a[2] * b[0] - a[0] * b[2];
+		out[2] = a[0] * b[1] - a[1] * b[0];
+	}
+
+	// Returns mask of lanes hit in (Eps6F, tmax)
+	Uint test(const Ray &r, Float tmax, Lane &t, Lane &u, Lane &v, Lane &det) const {
+		Lane D[3] = {Lane(r.D[0]), Lane(r.D[1]), Lane(r.D[2])};
+		Lane Ul[3], Vl[3], tV[3];
+		for (Uint a = 0; a < 3; a++) {
+			Ul[a] = Lane::load(U[a]);
+			Vl[a] = Lane::load(V[a]);
+			tV[a] = Lane(r.O[a]) - Lane::load(Q[a]);
+		}
+		Lane pV[3], qV[3];
+		cross(D, Vl, pV);
+		det = dot(Ul, pV);
+		Lane inv = Lane(1) / det;
+		cross(tV, Ul, qV);
+		u = dot(tV, pV) * inv;
+		v = dot(D, qV) * inv;
+		t = dot(Vl, qV) * inv;
+		const Lane zero(0), one(1);
+		Uint mask = (u >= zero) & (u <= one) & (v >= zero) & (v <= one - u);
+		mask &= (t > Lane(Eps6F)) & (t < Lane(tmax));
+		return mask & ((1u << cnt) - 1);
+	}
+};
@@ -43,6 +43,10 @@ class Program {
 		m_running = true;
 		while (m_running) {
 			double start_t = timer();
+			// Structure finished on the build thread replaces the current one between frames
+			bool new_scene;
+			if (renderer.poll_build(new_scene))
+				build_finished(new_scene);
 			while (SDL_PollEvent(&event)) {
 				if (event.type == SDL_EVENT_QUIT) {
 					m_running = false;
@@ -73,6 +77,13 @@ class Program {
 				renderer.m_cam.T.rotate(rot * m_dt * 2);
 				renderer.m_reset = true;
 			}
+			if (m_spin && renderer.m_scene->inst_cnt())
+				renderer.spin_instances(m_dt);
+			if (renderer.m_deform && !renderer.building()) {
+				m_time += m_dt;
+				renderer.deform(m_time);
+				update_stats();
+			}
 			m_save_hit = renderer.m_reset;
 			if ((!renderer.m_pause || renderer.m_reset) && m_view->valid() && m_view->shown() && !m_view->minimized()) {
 				auto [pixels, pitch, height] = m_view->get_surf();
@@ -85,6 +96,18 @@ class Program {
 			if(m_save_hit){
 				m_accel_hit_time = m_dt;
 				m_save_hit = false;
+				// Time to the first image of a new structure, the lazy BVH is built by this frame
+				if (m_first_frame) {
+					m_first_frame = false;
+					int b = bvh_build_idx();
+					if (b >= 0)
+						m_bvh_build_stats[b].first = m_curr_accel_build_time + m_dt;
+				}
+				// Preview traces exactly one primary ray per pixel
+				if (renderer.m_preview && !renderer.m_bboxes && !renderer.m_heatmap) {
+					Vec2u dims = renderer.m_cam.film_size();
+					m_accel_stats[int(renderer.m_acc->type())].mrays = dims[0] * dims[1] / m_dt * 1e-6;
+				}
 			}
 			m_view->render();
 			m_menu->render();
@@ -109,21 +132,56 @@ class Program {
 			throw std::runtime_error("No " + ext + " files found in " + path);
 	}
 
+	// Stats are updated by build_finished(), once the new structure is published
 	void set_accelerator(Accel_t type) {
 		m_curr_accel_type = type;
-
-		renderer.m_reset = true;
 		renderer.set_accelerator(type);
+	}
 
-		// set stats
-		m_curr_accel_build_time = renderer.m_acc->build_time();
-		m_curr_poly_cnt = renderer.m_scene.poly_cnt();
-		m_curr_accel_nodes_cnt = renderer.m_acc->nodes_cnt();
+	void build_finished(bool new_scene) {
+		if (new_scene) {
+			m_inst_grid = 1;
+			// Stats of builders from the previous scene are no longer comparable
+			for (auto &st : m_bvh_build_stats)
+				st = {};
+			for (auto &st : m_accel_stats)
+				st = {};
+		}
+		// Autotune may have picked another type
+		m_curr_accel_type = renderer.m_acc_type;
+		update_stats();
 		m_save_hit = true;
+		m_first_frame = true;
 		//println("Build in:", m_curr_accel_build_time,"s | Polygons", m_curr_poly_cnt, m_curr_accel_nodes_cnt);
 	}
 
-	// swap in a new Scene and rebuild accel
+	// Reads stats of the current accelerator
+	void update_stats() {
+		m_curr_accel_build_time = renderer.m_acc->build_time();
+		m_curr_poly_cnt = renderer.m_scene->poly_cnt();
+		m_curr_accel_nodes_cnt = renderer.m_acc->nodes_cnt();
+		m_curr_poly_mem = renderer.m_acc->poly_mem();
+		m_curr_accel_mem = renderer.m_acc->mem_size();
+		m_curr_refs_cnt = renderer.m_acc->refs_cnt();
+		if (int b = bvh_build_idx(); b >= 0) {
+			auto &st = m_bvh_build_stats[b];
+			st.time = m_curr_accel_build_time;
+			st.cost = renderer.m_acc->sah_cost();
+		}
+		m_accel_stats[int(renderer.m_acc->type())].node_mem = m_curr_accel_mem - m_curr_poly_mem;
+	}
+
+	// Strategy the current BVH was built with, -1 for other structures
+	int bvh_build_idx() const {
+		auto bvh = dynamic_cast<AccelBvh *>(renderer.m_acc);
+		if (!bvh)
+			return -1;
+		BvhBuild_t build = bvh->params().bvh_build;
+		// Wide trees are always built eagerly
+		return build == BvhBuild_t::Lazy && !bvh->lazy() ? int(BvhBuild_t::Binned) : int(build);
+	}
+
+	// swap in a new Scene and rebuild accel, both are published by build_finished()
 	void load_scene(int scene_idx) {
 		// set default camera and scale
 		Float scale = 1.0f;
@@ -139,20 +197,15 @@ class Program {
 		} else if (m_scene_labels[scene_idx] == "dragon.obj") {
 			renderer.m_cam = Camera(600, 600, 80, Transform(Vec3f(5.8, 0.2, -3), Vec3f(0, -4, 0), 1));
 			scale = 0.05f;
+		} else if (m_scene_labels[scene_idx] == "walls.obj") {
+			renderer.m_cam = Camera(600, 600, 80, Transform(Vec3f(1, 1, 4.2), Vec3f(0), 1));
 		} /* else if {
 			more configs...
 		} */
 
 		const auto &path = m_scene_paths[scene_idx];
 		renderer.m_reset = true;
-		renderer.m_scene = Scene(path, scale);
-		// reinit accelerator to properly load the polys, etc... could be done better
-		renderer.set_accelerator(renderer.m_acc->type());
-
-		// set stats
-		m_curr_accel_build_time = renderer.m_acc->build_time();
-		m_curr_poly_cnt = renderer.m_scene.poly_cnt();
-		m_curr_accel_nodes_cnt = renderer.m_acc->nodes_cnt();
+		renderer.load_scene(path, scale);
 	}
 
 	// imgui menu callback
@@ -172,6 +225,39 @@ class Program {
 		if(Checkbox("Show bbox", &renderer.m_bboxes)){
 			renderer.m_reset = true;
 		}
+		SameLine();
+		if (Checkbox("Heatmap", &renderer.m_heatmap)) {
+			renderer.m_reset = true;
+		}
+		SameLine();
+		if (Checkbox("Poly cache", &renderer.m_poly_cache)) {
+			renderer.m_acc->set_poly_cache(renderer.m_poly_cache);
+			m_curr_poly_mem = renderer.m_acc->poly_mem();
+			m_curr_accel_mem = renderer.m_acc->mem_size();
+			renderer.m_reset = true;
+		}
+		SameLine();
+		// Primary rays in 8x8 packets, only used by the binary BVH
+		if (Checkbox("Packets", &renderer.m_packets)) {
+			renderer.m_reset = true;
+		}
+		// Breadth-first rendering, rays of each bounce are sorted and traced as one batch
+		if (Checkbox("Wavefront", &renderer.m_wavefront)) {
+			renderer.m_reset = true;
+		}
+		if (renderer.m_wavefront) {
+			SameLine();
+			Checkbox("Sort rays", &renderer.m_wave_sort);
+		}
+		if (renderer.m_heatmap) {
+			if (Combo("Heat metric", (int *)&renderer.m_heat_metric, heat_metric_names, int(HeatMetric::LAST)))
+				renderer.m_reset = true;
+			if (SliderFloat("Heat scale", &renderer.m_heat_scale, 1, 1000, "%.0f"))
+				renderer.m_reset = true;
+		}
+		// 0 threads = one per hardware thread, pool is recreated on the next frame
+		SliderInt("Threads", (int *)&renderer.m_threads, 0, 2 * std::thread::hardware_concurrency());
+		SliderInt("Tile size", (int *)&renderer.m_tile_size, 8, 128);
 
 		Spacing();
 
@@ -186,6 +272,75 @@ class Program {
 		// accelerator selector
 		if (Combo("Accelerator", (int *)&m_curr_accel_type, accel_t_names, int(Accel_t::LAST)))
 			set_accelerator(m_curr_accel_type);
+		if (Combo("BVH build", (int *)&renderer.m_build_params.bvh_build, bvh_build_names, int(BvhBuild_t::LAST)))
+			set_accelerator(m_curr_accel_type);
+		if (renderer.m_build_params.bvh_build == BvhBuild_t::SBVH &&
+			SliderFloat("SBVH budget", &renderer.m_build_params.sbvh_budget, 0, 1, "%.2f"))
+			set_accelerator(m_curr_accel_type);
+		if (SliderInt("Leaf size", (int *)&renderer.m_build_params.leaf_size, 1, 32))
+			set_accelerator(m_curr_accel_type);
+		if (SliderInt("SAH bins", (int *)&renderer.m_build_params.bins, 2, max_bins))
+			set_accelerator(m_curr_accel_type);
+		static const char *pack_names[] = {"Off", "4", "8"};
+		int pack = renderer.m_build_params.pack_width / 4;
+		if (Combo("Leaf packs", &pack, pack_names, 3)) {
+			renderer.m_build_params.pack_width = pack * 4;
+			set_accelerator(m_curr_accel_type);
+		}
+		if (m_curr_accel_type == Accel_t::SpatialKd && Checkbox("Kd ropes", &renderer.m_build_params.kd_ropes))
+			set_accelerator(m_curr_accel_type);
+		if (Checkbox("Parallel build", &renderer.m_build_params.parallel))
+			set_accelerator(m_curr_accel_type);
+		SameLine();
+		Checkbox("Scene cache", &renderer.m_scene_cache);
+		SameLine();
+		if (Checkbox("Prebuild all", &renderer.m_prebuild) && renderer.m_prebuild)
+			renderer.prebuild();
+		// Built structures stay in memory up to the budget, switching back to them doesn't rebuild
+		if (SliderInt("Accel. cache MB", (int *)&renderer.m_cache_mb, 0, 8192))
+			renderer.trim_cache();
+		// Probe renders from the camera pick type, leaf size and bins, the choice is stored next to the OBJ
+		if (Button("Autotune"))
+			renderer.autotune(true);
+		SameLine();
+		Checkbox("On load", &renderer.m_autotune);
+		SameLine();
+		Checkbox("Subset", &renderer.m_tune.subset);
+		SameLine();
+		Checkbox("With build", &renderer.m_tune.with_build);
+		if (Combo("BVH traversal", (int *)&renderer.m_traversal, traversal_names, int(Traversal_t::LAST))) {
+			renderer.set_traversal(renderer.m_traversal);
+			renderer.m_reset = true;
+		}
+
+		// Build thread reads the scene, so it can't be modified until the build is published
+		if (renderer.building()) {
+			char label[64];
+			int len;
+			if (renderer.tuning())
+				len = snprintf(label, sizeof(label), "Tuning structure");
+			else
+				len = snprintf(label, sizeof(label), "%s %s", renderer.build_started() ? "Building" : "Loading",
+							   accel_t_names[int(renderer.build_type())]);
+			if (renderer.build_cnt() > 1)
+				snprintf(label + len, sizeof(label) - len, " (+%u more)", renderer.build_cnt() - 1);
+			ProgressBar(renderer.build_progress(), ImVec2{-1, 0}, label);
+		}
+		BeginDisabled(renderer.building());
+		// Instances are traced only by the TLAS accelerator
+		if (SliderInt("Instances", &m_inst_grid, 1, 16)) {
+			renderer.set_instances(m_inst_grid);
+			update_stats();
+		}
+		SameLine();
+		Checkbox("Spin", &m_spin);
+		// Moving geometry, refit every frame
+		Checkbox("Deform", &renderer.m_deform);
+		if (renderer.m_scene->mesh_cnt() > 1) {
+			SameLine();
+			SliderInt("Mesh", (int *)&renderer.m_deform_mesh, 0, renderer.m_scene->mesh_cnt() - 1);
+		}
+		EndDisabled();
 
 		//large spacer
 		Text(" ");
@@ -203,9 +358,51 @@ class Program {
 
 		// scene stats
 		Text("Polygons:     %u", m_curr_poly_cnt);
+		Text("References:   %lu", m_curr_refs_cnt);
 		Text("Accel. nodes: %lu", m_curr_accel_nodes_cnt);
 		Text("Accel. build: %.3f ms", m_curr_accel_build_time * 1000);
 		Text("Accel. render: %.3f ms", m_accel_hit_time * 1000);
+		// Traversal totals of the last heatmap frame
+		if (renderer.m_heatmap && renderer.m_frame_rays) {
+			const auto &st = renderer.m_frame_stats;
+			double rays = renderer.m_frame_rays;
+			Text("Nodes:  %.2f M (%.1f / ray)", st.nodes * 1e-6, st.nodes / rays);
+			Text("Boxes:  %.2f M (%.1f / ray)", st.boxes * 1e-6, st.boxes / rays);
+			Text("Tris:   %.2f M (%.1f / ray)", st.tris * 1e-6, st.tris / rays);
+		}
+		// Last BVH build of each strategy on this scene
+		for (int i = 0; i < int(BvhBuild_t::LAST); i++) {
+			if (m_bvh_build_stats[i].time > 0)
+				Text("%-10s build: %8.3f ms | SAH: %.2f | first frame: %8.3f ms", bvh_build_names[i],
+					 m_bvh_build_stats[i].time * 1000, m_bvh_build_stats[i].cost, m_bvh_build_stats[i].first * 1000);
+		}
+		Text("Scene load: %.3f s (%.1f MB/s)%s", renderer.m_scene->m_load_time, renderer.m_scene->load_speed(),
+			 renderer.m_acc_cached ? " | accel. from cache" : "");
+		// Node layouts used on this scene side by side (compressed vs. uncompressed BVH)
+		for (int i = int(Accel_t::BVH); i < int(Accel_t::LAST); i++) {
+			if (m_accel_stats[i].node_mem > 0)
+				Text("%-6s nodes: %9.1f KB | %6.2f Mrays/s", accel_t_names[i], m_accel_stats[i].node_mem / 1024.0,
+					 m_accel_stats[i].mrays);
+		}
+		// Lazy BVH grows with every new view
+		if (auto bvh = dynamic_cast<AccelBvh *>(renderer.m_acc); bvh && bvh->lazy())
+			Text("Lazy BVH: %zu nodes | %.1f %% of polygons in leaves", bvh->nodes_cnt(), bvh->progress() * 100);
+		const RefitStats &rs = renderer.m_acc->refit_stats();
+		if (rs.refits || rs.rebuilds)
+			Text("Refit: %.3f ms | refits: %zu | rebuilds: %zu | rotations: %zu", rs.time * 1000, rs.refits, rs.rebuilds,
+				 rs.rotations);
+		if (auto tlas = dynamic_cast<AccelTlas *>(renderer.m_acc))
+			Text("Instances: %u | top level build: %.3f ms", tlas->inst_cnt(), tlas->top_time() * 1000);
+		const autotune::Choice &tc = renderer.m_tuned;
+		if (tc.mrays > 0)
+			Text("Autotune: %s | leaf %u | %u bins | %.1f Mrays/s | build %.1f ms%s", accel_t_names[int(tc.type)],
+				 tc.leaf_size, tc.bins, tc.mrays, tc.build_ms, tc.stored ? " | stored" : "");
+		Text("Cached structures: %zu (%.1f MB)", renderer.accel_cache().size(), renderer.accel_cache().mem_size() / 1048576.0);
+		Text("Poly memory:  %.1f KB", m_curr_poly_mem / 1024.0);
+		Text("Accel. memory: %.1f KB", m_curr_accel_mem / 1024.0);
+		// Last render time with the cached and with the indirect polygon lookup
+		m_poly_render_time[renderer.m_poly_cache] = m_accel_hit_time;
+		Text("Render cached: %.3f ms | indirect: %.3f ms", m_poly_render_time[1] * 1000, m_poly_render_time[0] * 1000);
 		Text("\nIteration: %lu", renderer.m_iteration);
 		ImGuiIO& io = ImGui::GetIO();
 		ImGui::Text("%.3f ms/frame (%.1f FPS)", io.DeltaTime * 1000, io.Framerate);
@@ -221,13 +418,31 @@ class Program {
 	Accel_t m_curr_accel_type = Accel_t::BVH;
 	double m_curr_accel_build_time = 0.0;
 	size_t m_curr_accel_nodes_cnt = 0;
+	size_t m_curr_poly_mem = 0;
+	size_t m_curr_accel_mem = 0;
+	size_t m_curr_refs_cnt = 0;
 	double m_accel_hit_time = 0;
+	double m_poly_render_time[2] = {0, 0};
+	int m_inst_grid = 1; // Instances per side of the grid
+	bool m_spin = false; // Rotate instances every frame
+	Float m_time = 0;	 // Time of the deformation demo
+	struct {
+		double time = 0;
+		Float cost = 0;
+		double first = 0; // Build and the first frame
+	} m_bvh_build_stats[int(BvhBuild_t::LAST)];
+	// Node memory and preview rays/s of each accelerator on this scene
+	struct {
+		size_t node_mem = 0;
+		double mrays = 0;
+	} m_accel_stats[int(Accel_t::LAST)];
 
 	Renderer renderer;
 	std::unique_ptr<Window> m_view;
 	std::unique_ptr<Window> m_menu;
 	SDL_Event event;
 	bool m_save_hit = true;
+	bool m_first_frame = false; // Next frame is the first one of a new structure
 	bool m_running = false;
 	double m_dt = 0.1;
 	float m_cam_speed = 2.;
@@ -4,13 +4,22 @@
 
 struct Ray{
     Ray(){}
-    Ray(Vec3f O, Vec3f D) : O(O), D(D), iD(rcp(D)){}
-    Ray(Vec3f O, Vec3f _D, bool normalized) : O(O), D(norm(_D)), iD(rcp(D)){}
+    Ray(Vec3f O, Vec3f D) : O(O){ set_dir(D); }
+    Ray(Vec3f O, Vec3f _D, bool normalized) : O(O){ set_dir(norm(_D)); }
+    // Keeps inverse direction and direction signs in sync with D
+    void set_dir(Vec3f _D){
+        D = _D;
+        iD = rcp(D);
+        for (Uint i = 0; i < 3; i++)
+            sgn[i] = D[i] < 0;
+    }
     Vec3f at(Float t){
         return O + Vec3f(t) * D;
     }
     // Origin, direction, inverse direction
     Vec3f O,D,iD;
+    // 1 where direction is negative, selects near child in ordered traversal
+    Vec3u sgn;
 };
 
 struct HitInfo{
@@ -22,5 +31,6 @@ struct HitInfo{
     Float v()const{return tuv[2];}
     Vec3f tuv = Vec3f(InfF, 0, 0);
     Uint idx = -1;
+    Uint inst = -1; // Instance of the hit polygon, set only by two-level structures
     bool face;
 };
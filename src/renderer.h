@@ -1,15 +1,26 @@
 #pragma once
 // Created by Ondrej Ac (xacond00)
-#include "acc_bbox.h"
-#include "acc_bvh.h"
-#include "acc_none.h"
-#include "acc_kdtree.h"
-#include "acc_bih.h"
-#include "accel.h"
+#include "accel_cache.h"
+#include "accels.h"
+#include "autotune.h"
 #include "camera.h"
+#include "morton.h"
 #include "scene.h"
+#include "scene_cache.h"
 #include "rng.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
 #include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+// Counter shown by the heatmap mode
+enum class HeatMetric { Nodes, Boxes, Tris, LAST };
+static const char *heat_metric_names[] = {"Visited nodes", "Box tests", "Triangle tests"};
 
 struct OutputFmt {
 	Uint *data;
@@ -22,22 +33,25 @@ class Renderer {
 	// Dynamically dispatches the correct acceleration structure.
 	// To avoid virtual call on each ray intersection.
 	Renderer() {}
-	Renderer(Scene &&scn, Camera &&cam, Accel_t acc_t) : m_scene(std::move(scn)), m_cam(std::move(cam)) {
+	Renderer(Scene &&scn, Camera &&cam, Accel_t acc_t)
+		: m_scene(std::make_unique<Scene>(std::move(scn))), m_cam(std::move(cam)) {
 		set_accelerator(acc_t);
+		wait_build();
+	}
+	~Renderer() {
+		for (auto &job : m_jobs) {
+			if (job->thread.joinable())
+				job->thread.join();
+			delete job->ready.load();
+		}
+		m_jobs.clear();
+		m_accels.clear();
 	}
 	void render() {
 		if(m_pause == true && !m_reset) return;
-		if (auto acc = dynamic_cast<AccelNone *>(m_acc)) {
-			render_internal(acc);
-		} else if (auto acc = dynamic_cast<AccelBbox *>(m_acc)) {
-			render_internal(acc);
-		} else if (auto acc = dynamic_cast<AccelBvh *>(m_acc)) {
-			render_internal(acc);
-		} else if (auto acc = dynamic_cast<AccelKdTree*>(m_acc)) {
-			render_internal(acc);
-		} else if (auto acc = dynamic_cast<AccelBih *>(m_acc)) {
-			render_internal(acc);
-		} else {
+		// Frames would slow down the probe renders
+		if (tuning()) return;
+		if (!dispatch_accel(m_acc, [this](auto acc) { render_internal(acc); })) {
 			std::cout << "Invalid acceleration structure !";
 		}
 	}
@@ -53,17 +67,32 @@ class Renderer {
 
 		m_iteration++;
 
-		const unsigned num_threads = std::thread::hardware_concurrency();
-		std::vector<std::thread> threads;
-		// Parallel for loop
-		auto render_chunk = [&](Uint start_row, Uint end_row, Uint seed) { 
-            RNG rng = RNG(seed + 1);
-			for (Uint i = start_row; i < end_row; ++i) {
-				for (Uint j = 0; j < dims[0]; ++j) {
+		if (m_wavefront && !m_bboxes && !m_heatmap) {
+			render_wavefront(acc);
+			m_reset = false;
+			return;
+		}
+
+		// Screen is split into tiles, which are balanced between workers by the pool
+		Uint tile = std::max(m_tile_size, 1u);
+		Uint tiles_x = (dims[0] + tile - 1) / tile;
+		Uint tiles_y = (dims[1] + tile - 1) / tile;
+		auto render_tile = [&](Uint idx, Uint worker) {
+			RNG &rng = m_rngs[worker];
+			Vec2u lo((idx % tiles_x) * tile, (idx / tiles_x) * tile);
+			Vec2u hi(std::min(lo[0] + tile, dims[0]), std::min(lo[1] + tile, dims[1]));
+			if constexpr (std::is_same_v<Acc, AccelBvh>) {
+				if (m_packets && !m_bboxes && !m_heatmap) {
+					render_packets(acc, rng, lo, hi);
+					return;
+				}
+			}
+			for (Uint i = lo[1]; i < hi[1]; ++i) {
+				for (Uint j = lo[0]; j < hi[0]; ++j) {
 					Vec2u xy0(j, i);
 					Vec2f xy(j + rng.rafl(), i + rng.rafl());
 					Ray r = m_cam.sample_ray(xy);
-					Vec3f col = sample(acc, rng, r);
+					Vec3f col = m_heatmap ? sample_heat(acc, r, m_worker_stats[worker]) : sample(acc, rng, r);
 					film.put(xy0, col); 
 					if (out.data) {
 						out.data[i * out.pitch + j] = vec2bgr(film.read(xy0)); 
@@ -72,56 +101,394 @@ class Renderer {
 			}
 		};
 
-		Uint rows_per_thread = dims[1] / num_threads;
-		Uint remaining_rows = dims[1] % num_threads;
+		m_worker_stats.assign(pool().size(), TraceStats());
+		pool().run(tiles_x * tiles_y, render_tile);
+		if (m_heatmap) {
+			m_frame_stats = TraceStats();
+			for (auto &st : m_worker_stats)
+				m_frame_stats += st;
+			m_frame_rays = size_t(dims[0]) * dims[1];
+		}
+		m_reset = false;
+	}
+
+	// Primary ray coloured by its traversal cost, from blue (0) to red (m_heat_scale and more)
+	template <class Acc>
+	Vec3f sample_heat(const Acc *acc, const Ray &r, TraceStats &total) const {
+		TraceStats st;
+		HitInfo rec;
+		acc->intersect_stats(r, rec, st);
+		total += st;
+		size_t val = m_heat_metric == HeatMetric::Nodes ? st.nodes : m_heat_metric == HeatMetric::Boxes ? st.boxes : st.tris;
+		Float x = std::min(Float(val) / std::max(m_heat_scale, 1.f), 1.f) * 4;
+		static const Vec3f ramp[5] = {{0, 0, 1}, {0, 1, 1}, {0, 1, 0}, {1, 1, 0}, {1, 0, 0}};
+		Uint i = std::min(Uint(x), 3u);
+		return lerp(ramp[i], ramp[i + 1], Vec3f(x - i));
+	}
 
-		Uint start_row = 0;
-		for (Uint t = 0; t < num_threads; ++t) {
-			Uint end_row = start_row + rows_per_thread + (t < remaining_rows ? 1 : 0);
-			threads.emplace_back(render_chunk, start_row, end_row, std::rand());
-			start_row = end_row;
+	// Worker pool, recreated only when the thread count setting changes
+	// Each worker gets its own RNG, which lives as long as the pool
+	ThreadPool &pool() {
+		Uint threads = m_threads ? m_threads : std::max(1u, std::thread::hardware_concurrency());
+		if (!m_pool || m_pool->size() != threads) {
+			m_pool.reset();
+			m_pool = std::make_unique<ThreadPool>(threads);
+			m_rngs.clear();
+			for (Uint i = 0; i < threads; i++)
+				m_rngs.emplace_back(std::rand() + 1);
 		}
+		return *m_pool;
+	}
+
+	// Parallel for loop over [0, n) in chunks, fn(begin, end, worker)
+	template <class F>
+	void parallel_for(Uint n, const F &fn) {
+		ThreadPool &p = pool();
+		p.parallel_for(n, std::max(n / (p.size() * 16), 1u), fn);
+	}
 
-		for (auto &t : threads) {
-			t.join();
+	// State of one path in the wavefront queue
+	struct PathState {
+		Ray r;
+		Vec3f weight;
+		Uint pixel;
+	};
+
+	// Breadth-first path tracing, every bounce goes through separate stages:
+	// sort rays by origin cell and direction octant, trace the whole queue, shade and compact
+	template <class Acc>
+	void render_wavefront(const Acc *acc) {
+		auto &film = m_cam.film;
+		auto dims = m_cam.film_size();
+		Uint n = dims[0] * dims[1];
+		m_wave_radiance.assign(n, Vec3f(0));
+		m_wave_queue.resize(n);
+		parallel_for(dims[1], [&](Uint start_row, Uint end_row, Uint worker) {
+			RNG &rng = m_rngs[worker];
+			for (Uint i = start_row; i < end_row; ++i) {
+				for (Uint j = 0; j < dims[0]; ++j) {
+					Vec2f xy(j + rng.rafl(), i + rng.rafl());
+					m_wave_queue[i * dims[0] + j] = {m_cam.sample_ray(xy), Vec3f(1), i * dims[0] + j};
+				}
+			}
+		});
+		Uint depth = m_preview ? 1 : m_depth;
+		for (Uint bounce = 0; bounce < depth && !m_wave_queue.empty(); bounce++) {
+			// Primary rays are coherent already in scanline order
+			if (bounce > 0 && m_wave_sort)
+				sort_wavefront();
+			Uint cnt = m_wave_queue.size();
+			m_wave_hits.assign(cnt, HitInfo());
+			parallel_for(cnt, [&](Uint begin, Uint end, Uint) {
+				for (Uint i = begin; i < end; i++) {
+					acc->intersect(m_wave_queue[i].r, m_wave_hits[i]);
+				}
+			});
+			// Shade in place, dead paths are marked by zero weight and compacted afterwards
+			parallel_for(cnt, [&](Uint begin, Uint end, Uint worker) {
+				RNG &rng = m_rngs[worker];
+				for (Uint i = begin; i < end; i++) {
+					PathState &ps = m_wave_queue[i];
+					const HitInfo &rec = m_wave_hits[i];
+					if (rec.idx == Uint(-1)) {
+						if (!m_preview)
+							m_wave_radiance[ps.pixel] = m_wave_radiance[ps.pixel] + ps.weight * sky(ps.r.D);
+						ps.weight = Vec3f(0);
+						continue;
+					}
+					SurfaceInfo si = m_scene->surface_info(rec);
+					if (m_preview) {
+						m_wave_radiance[ps.pixel] = Vec3f{std::abs(dot(si.N, ps.r.D))};
+						continue;
+					}
+					ps.r.set_dir(si.frame.world(rng.sample_cos_distribution()));
+					ps.r.O = si.P + si.N * EpsF;
+					ps.weight = ps.weight * 0.7f;
+				}
+			});
+			auto dead = std::remove_if(m_wave_queue.begin(), m_wave_queue.end(),
+									   [](const PathState &ps) { return ps.weight.max() == 0; });
+			m_wave_queue.erase(dead, m_wave_queue.end());
 		}
+		parallel_for(dims[1], [&](Uint start_row, Uint end_row, Uint) {
+			for (Uint i = start_row; i < end_row; ++i) {
+				for (Uint j = 0; j < dims[0]; ++j) {
+					Vec2u xy0(j, i);
+					film.put(xy0, m_wave_radiance[i * dims[0] + j]);
+					if (out.data) {
+						out.data[i * out.pitch + j] = vec2bgr(film.read(xy0));
+					}
+				}
+			}
+		});
+	}
 
-		m_reset = false;
+	// Reorders the path queue by direction octant and morton code of ray origin within the scene bounds
+	void sort_wavefront() {
+		Uint cnt = m_wave_queue.size();
+		const AABB &box = m_scene->m_bbox;
+		Vec3f scale = Vec3f(1) / max(box.pmax - box.pmin, Vec3f(Eps6F));
+		m_wave_keys.resize(cnt);
+		m_wave_order.resize(cnt);
+		parallel_for(cnt, [&](Uint begin, Uint end, Uint) {
+			for (Uint i = begin; i < end; i++) {
+				const Ray &r = m_wave_queue[i].r;
+				Uint octant = r.sgn[0] | (r.sgn[1] << 1) | (r.sgn[2] << 2);
+				m_wave_keys[i] = (octant << 27) | (morton3((r.O - box.pmin) * scale) >> 3);
+				m_wave_order[i] = i;
+			}
+		});
+		radix_sort(m_wave_keys, m_wave_order, 30);
+		m_wave_sorted.resize(cnt);
+		for (Uint i = 0; i < cnt; i++) {
+			m_wave_sorted[i] = m_wave_queue[m_wave_order[i]];
+		}
+		m_wave_queue.swap(m_wave_sorted);
+	}
+
+	static Vec3f sky(const Vec3f &D) {
+		float val = std::pow(max(D.shrink(), Vec2f(0)).len2(), 16);
+		return lerp(Vec3f(0.5, 0.8, 1.0), 5.f * Vec3f(1, 0.7, 0.2), Vec3f(val));
 	}
+	// Primary rays of 8x8 pixel tiles are traced as one packet, bounces continue ray by ray
+	template <class Acc>
+	void render_packets(const Acc *acc, RNG &rng, Vec2u lo, Vec2u hi) {
+		auto &film = m_cam.film;
+		RayPacket packet;
+		for (Uint i0 = lo[1]; i0 < hi[1]; i0 += 8) {
+			Uint i1 = std::min(i0 + 8, hi[1]);
+			for (Uint j0 = lo[0]; j0 < hi[0]; j0 += 8) {
+				Uint j1 = std::min(j0 + 8, hi[0]);
+				packet.clear();
+				for (Uint i = i0; i < i1; ++i) {
+					for (Uint j = j0; j < j1; ++j) {
+						Vec2f xy(j + rng.rafl(), i + rng.rafl());
+						packet.add(m_cam.sample_ray(xy));
+					}
+				}
+				acc->intersect_packet(packet);
+				Uint k = 0;
+				for (Uint i = i0; i < i1; ++i) {
+					for (Uint j = j0; j < j1; ++j, ++k) {
+						Vec2u xy0(j, i);
+						Vec3f col = sample(acc, rng, packet.rays[k], &packet.rec[k]);
+						film.put(xy0, col);
+						if (out.data) {
+							out.data[i * out.pitch + j] = vec2bgr(film.read(xy0));
+						}
+					}
+				}
+			}
+		}
+	}
+
 	void set_output(Uint *data, Uint pitch) { out = {data, pitch}; }
+	// Switches to type, built structures are taken from m_accels right away
+	// Others are built on a build thread, frames keep using the current structure until poll_build() publishes it
+	// Before the first build a bounding box placeholder is traced
 	void set_accelerator(Accel_t type) {
-		if (type < Accel_t::LAST && m_acc) {
-			delete m_acc;
-			m_acc = nullptr;
+		if (type >= Accel_t::LAST)
+			return;
+		m_acc_type = type;
+		request_build(BuildRequest(type, m_build_params));
+	}
+	// Replaces the scene and rebuilds the current accelerator on a build thread
+	// Both are read from the scene cache when it holds them, otherwise the OBJ is parsed
+	// The old scene is rendered until both are published together
+	// With m_autotune the structure is picked by autotune(), the stored choice is used when there is one
+	void load_scene(const std::string &path, Float scale) {
+		BuildRequest req(m_acc_type, m_build_params);
+		req.load = true;
+		req.path = path;
+		req.scale = scale;
+		if (m_autotune)
+			set_tune(req, false);
+		request_build(req);
+	}
+	// Builds candidate structures on a build thread and switches to the fastest one on the probe from the camera
+	// retune: probe even when a choice for the scene is stored
+	void autotune(bool retune) {
+		BuildRequest req(m_acc_type, m_build_params);
+		set_tune(req, retune);
+		request_build(req);
+	}
+	// Builds every structure type with the current settings concurrently, they are kept in m_accels
+	void prebuild() {
+		if (m_pending || loading())
+			return;
+		for (int t = int(Accel_t::BVH); t < int(Accel_t::LAST); t++) {
+			AccelCache::Key key = AccelCache::key(*m_scene, Accel_t(t), m_build_params);
+			if (!m_accels.get(key) && !find_job(&key))
+				start_build(BuildRequest(Accel_t(t), m_build_params), true);
 		}
-		switch (type) {
-			case Accel_t::None:
-				m_acc = new AccelNone(m_scene);
-				break;
-			case Accel_t::Bbox:
-				m_acc = new AccelBbox(m_scene);
-				break;
-			case Accel_t::BVH:
-				m_acc = new AccelBvh(m_scene);
-				break;
-				case Accel_t::KdTree:
-				m_acc = new AccelKdTree(m_scene);
-				break;
-			case Accel_t::BIH:
-				m_acc = new AccelBih(m_scene);
-				break;
-			// case None:m_acc = new AccelNone(m_scene);
-			default:
-				break;
-		};
-		if(!m_acc->built()){
-			m_acc->build();
+		// The wanted structure stays the most recently used one
+		m_accels.get(m_want);
+	}
+	// Frees least recently used structures over the budget
+	void trim_cache() { m_accels.trim(size_t(m_cache_mb) << 20, m_acc); }
+	const AccelCache &accel_cache() const { return m_accels; }
+
+	// Publishes finished builds, has to be called between frames
+	// new_scene: set when the scene was replaced as well
+	// Returns false when the current structure didn't change
+	bool poll_build(bool &new_scene) {
+		new_scene = false;
+		for (size_t i = 0; i < m_jobs.size(); i++) {
+			BuildJob &job = *m_jobs[i];
+			Accel *acc = job.ready.exchange(nullptr, std::memory_order_acquire);
+			if (!acc)
+				continue;
+			if (job.thread.joinable())
+				job.thread.join();
+			if (job.req.load) {
+				// Every cached structure references the old scene
+				m_acc = nullptr;
+				m_accels.clear();
+				m_scene = std::move(job.scene);
+				m_rest_vert.clear();
+				m_tuned = {};
+				new_scene = true;
+			}
+			AccelCache::Key key = AccelCache::key(*m_scene, acc->type(), acc->params());
+			m_accels.put(key, acc);
+			if (job.req.tune) {
+				// Later builds use the tuned settings
+				m_tuned = job.choice;
+				m_acc_type = acc->type();
+				m_build_params = acc->params();
+			}
+			if (job.req.load || job.req.tune)
+				m_want = key;
+			if (key == m_want) {
+				publish(acc);
+				m_acc_cached = job.cached;
+			}
+			m_jobs.erase(m_jobs.begin() + i--);
+		}
+		trim_cache();
+		// Waiting request starts once no other one from the menu runs, a scene load waits for all builds
+		if (m_pending && !find_job(nullptr) && (!m_pending->load || m_jobs.empty())) {
+			BuildRequest req = *m_pending;
+			m_pending.reset();
+			request_build(req);
+		}
+		if (new_scene && m_prebuild)
+			prebuild();
+		bool published = m_published;
+		m_published = false;
+		return published || new_scene;
+	}
+	// Blocks until every requested build is published
+	void wait_build() {
+		bool new_scene;
+		while (building()) {
+			for (auto &job : m_jobs) {
+				if (job->thread.joinable())
+					job->thread.join();
+			}
+			poll_build(new_scene);
+		}
+	}
+	bool building() const { return !m_jobs.empty() || m_pending; }
+	// Candidates of autotune() are being built or probed
+	bool tuning() const {
+		for (auto &job : m_jobs) {
+			if (job->probing)
+				return true;
+		}
+		return false;
+	}
+	// Builds running or waiting
+	Uint build_cnt() const { return m_jobs.size() + (m_pending ? 1 : 0); }
+	// Type of the structure being built, the one asked for from the menu when it runs
+	Accel_t build_type() const {
+		const BuildJob *job = shown_job();
+		return job ? job->req.type : m_pending ? m_pending->type : m_acc_type;
+	}
+	// False while the scene is loaded or the structure is read from the cache
+	bool build_started() const {
+		const BuildJob *job = shown_job();
+		return job && job->acc.load() != nullptr;
+	}
+	// Part of the shown build done, 0 before build_started()
+	float build_progress() const {
+		const BuildJob *job = shown_job();
+		Accel *acc = job ? job->acc.load() : nullptr;
+		if (!acc && job && job->req.tune)
+			return job->tuned.load();
+		return acc ? acc->progress() : 0.f;
+	}
+
+	// Places n x n copies of the scene, they are traced only by the two-level structure
+	// Scene modifications are skipped while the build thread reads the scene
+	void set_instances(Uint n) {
+		if (building())
+			return;
+		m_accels.drop_except(m_acc);
+		m_scene->instance_grid(n);
+		if (auto tlas = dynamic_cast<AccelTlas *>(m_acc))
+			tlas->update_top();
+		m_reset = true;
+	}
+	// Rotates every instance around the y axis of its mesh, the two-level structure rebuilds only the top level
+	void spin_instances(Float angle) {
+		if (building())
+			return;
+		m_accels.drop_except(m_acc);
+		for (Uint i = 0; i < m_scene->inst_cnt(); i++) {
+			m_scene->m_inst[i].m_xf.rotate(Vec3f(0, angle, 0));
+			m_scene->update_inst_bbox(i);
+		}
+		if (auto tlas = dynamic_cast<AccelTlas *>(m_acc))
+			tlas->update_top();
+		m_reset = true;
+	}
+	// Moving geometry demo: vertices of mesh m_deform_mesh wave around their rest positions
+	// Only the moved vertex range is marked, so the accelerator refits just the subtrees using it
+	void deform(Float time) {
+		if (building() || m_deform_mesh >= m_scene->mesh_cnt())
+			return;
+		if (m_rest_vert.empty()) {
+			m_rest_vert = m_scene->m_vert;
+			m_rest_size = (m_scene->m_bbox.pmax - m_scene->m_bbox.pmin).max();
+		}
+		Uint m = m_deform_mesh;
+		Vec2u span = m_scene->vert_span(m_scene->m_mesh[m].range());
+		if (span[0] >= span[1])
+			return;
+		Float amp = 0.02f * m_rest_size, freq = Pi2F * 2 / m_rest_size;
+		parallel_for(span[1] - span[0], [&](Uint beg, Uint end, Uint) {
+			for (Uint i = span[0] + beg; i < span[0] + end; i++) {
+				const Vec3f &p = m_rest_vert[i];
+				m_scene->m_vert[i] = p + Vec3f(0, amp * std::sin(freq * (p[0] + p[2]) + time), 0);
+			}
+		});
+		// Only the current structure is refit, the others don't match the scene anymore
+		m_accels.drop_except(m_acc);
+		m_scene->mark_dirty(span[0], span[1]);
+		m_scene->update_bbox(m);
+		m_scene->m_bbox.expand(m_scene->m_mesh[m].m_bbox);
+		for (Uint i = 0; i < m_scene->inst_cnt(); i++) {
+			if (m_scene->m_inst[i].m_mesh == m)
+				m_scene->update_inst_bbox(i);
+		}
+		m_acc->update();
+		m_scene->clear_dirty();
+		m_reset = true;
+	}
+	void set_traversal(Traversal_t traversal) {
+		m_traversal = traversal;
+		if (auto bvh = dynamic_cast<AccelBvh *>(m_acc)) {
+			bvh->set_traversal(traversal);
+		} else if (auto tlas = dynamic_cast<AccelTlas *>(m_acc)) {
+			tlas->set_traversal(traversal);
 		}
 	}
 
+	// primary: hit of r, when it was already traced within a packet
 	template <class Acc>
-	Vec3f sample(const Acc *acc, RNG &rng, Ray r) const {
-		HitInfo rec;
+	Vec3f sample(const Acc *acc, RNG &rng, Ray r, const HitInfo *primary = nullptr) const {
+		HitInfo rec = primary ? *primary : HitInfo();
 		Vec3f result(0);
 		Vec3f weight(1);
 		Uint depth = m_depth;
@@ -134,25 +501,24 @@ class Renderer {
 			else return {};
 		}
 		if(m_preview){
-			bool hit = acc->intersect(r, rec);
+			bool hit = primary ? rec.idx != Uint(-1) : acc->intersect(r, rec);
 			if(!hit){
 				return {};
 			}
-			SurfaceInfo si = m_scene.surface_info(rec);
+			SurfaceInfo si = m_scene->surface_info(rec);
 			return Vec3f{std::abs(dot(si.N, r.D))};
 		}
 		while (depth > 0) {
-			bool hit = acc->intersect(r, rec);
+			bool hit = primary ? rec.idx != Uint(-1) : acc->intersect(r, rec);
+			primary = nullptr;
 			if (!hit) { // Sky
 				//return Vec3f(0.2, 0.2, 0.2);
-				float val = std::pow(max(r.D.shrink(), Vec2f(0)).len2(), 16);
-				result = result + weight * lerp(Vec3f(0.5, 0.8, 1.0), 5.f * Vec3f(1, 0.7, 0.2), Vec3f(val));
+				result = result + weight * sky(r.D);
 				break;
 			} else {
-				SurfaceInfo si = m_scene.surface_info(rec);
+				SurfaceInfo si = m_scene->surface_info(rec);
 				//return Vec3f(dot(si.N, -r.D));
-				r.D = si.frame.world(rng.sample_cos_distribution());
-                r.iD = rcp(r.D);
+				r.set_dir(si.frame.world(rng.sample_cos_distribution()));
 				r.O = si.P + si.N * EpsF;
 				// si.N; // Replace with random reflection
 				//  emission would go here ... result += weight * emiss
@@ -164,9 +530,12 @@ class Renderer {
 		}
 		return result;
 	}
-	Scene m_scene;
+	std::unique_ptr<Scene> m_scene = std::make_unique<Scene>();
 	Camera m_cam;
 	Accel *m_acc = nullptr;
+	Accel_t m_acc_type = Accel_t::BVH; // Last requested type, the published one is m_acc->type()
+	BuildParams m_build_params;
+	Traversal_t m_traversal = Traversal_t::Ordered;
 	OutputFmt out;
 	Uint m_depth = 5;
 	Uint m_spp = 1;
@@ -174,5 +543,230 @@ class Renderer {
 	bool m_pause = true;
 	bool m_bboxes = false;
 	bool m_preview = true;
+	bool m_poly_cache = true;
+	bool m_scene_cache = false; // Read and write scene + accelerator cache files next to the OBJ
+	bool m_acc_cached = false; // Current accelerator was loaded from the cache
+	Uint m_cache_mb = 1024;	   // Memory for built structures kept in m_accels
+	bool m_prebuild = false;   // Build all structure types after a scene load
+	bool m_autotune = false;   // Pick the structure by autotune() on every scene load
+	autotune::Settings m_tune;
+	autotune::Choice m_tuned; // Last autotune() result on this scene, mrays is 0 when there is none
+	bool m_packets = true;
+	bool m_heatmap = false;
+	HeatMetric m_heat_metric = HeatMetric::Boxes;
+	Float m_heat_scale = 100; // Count mapped to red
+	bool m_deform = false;			// Deform a mesh every frame
+	Uint m_deform_mesh = 0;			// Mesh moved by deform()
+	std::vector<Vec3f> m_rest_vert; // Vertices before deformation, empty when the scene is as loaded
+	Float m_rest_size = 1;			// Largest extent of the scene before deformation
+	bool m_wavefront = false;
+	bool m_wave_sort = true;
+	Uint m_threads = 0; // 0 = one per hardware thread
+	Uint m_tile_size = 32;
 	size_t m_iteration = 0;
+	std::unique_ptr<ThreadPool> m_pool;
+	std::vector<RNG> m_rngs;
+	// Traversal counters of the last heatmap frame
+	std::vector<TraceStats> m_worker_stats;
+	TraceStats m_frame_stats;
+	size_t m_frame_rays = 0;
+	// Wavefront queues, kept between frames to avoid reallocation
+	std::vector<PathState> m_wave_queue, m_wave_sorted;
+	std::vector<HitInfo> m_wave_hits;
+	std::vector<Vec3f> m_wave_radiance;
+	std::vector<uint32_t> m_wave_keys;
+	std::vector<Uint> m_wave_order;
+
+  private:
+	// Fields other than type and params keep their defaults unless set by name
+	struct BuildRequest {
+		BuildRequest() = default;
+		BuildRequest(Accel_t type, const BuildParams &params) : type(type), params(params) {}
+		Accel_t type = Accel_t::BVH;
+		BuildParams params;
+		bool load = false; // Load path into a new scene first
+		std::string path;
+		Float scale = 1;
+		bool tune = false;	 // Type, leaf size and bins are picked by autotune::tune()
+		bool retune = false; // Probe even when a choice is stored
+		autotune::Settings tuning;
+		Camera probe; // Copy of the camera, frames may move it
+	};
+	// One build thread, results are handed over to poll_build() by ready
+	struct BuildJob {
+		BuildRequest req;
+		AccelCache::Key key; // Scene is not known yet for a load
+		bool prebuild = false;
+		std::thread thread;
+		std::atomic<Accel *> acc{nullptr};	 // Structure being built, for build_progress()
+		std::atomic<Accel *> ready{nullptr}; // Finished structure
+		// Written by the build thread before ready
+		std::unique_ptr<Scene> scene;
+		bool cached = false;
+		autotune::Choice choice;
+		std::atomic<bool> probing{false};
+		std::atomic<float> tuned{0}; // Part of the candidates probed
+	};
+
+	// Film of the probe camera is small, only its view and aspect matter
+	void set_tune(BuildRequest &req, bool retune) {
+		req.tune = true;
+		req.retune = retune;
+		req.tuning = m_tune;
+		Vec2u dims = m_cam.film_size();
+		Uint w = std::max(1u, std::min(m_tune.probe_width, dims[0]));
+		req.probe = Camera(w, std::max(1u, Uint(size_t(w) * dims[1] / std::max(dims[0], 1u))), m_cam.fov, m_cam.T);
+	}
+
+	void publish(Accel *acc) {
+		m_acc = acc;
+		if (m_acc->poly_cached() != m_poly_cache)
+			m_acc->set_poly_cache(m_poly_cache);
+		set_traversal(m_traversal);
+		m_reset = true;
+		m_published = true;
+	}
+	// Requests from the menu run one at a time, newer ones replace the waiting one
+	void request_build(BuildRequest req) {
+		if (!m_acc) {
+			m_acc = make_accel(*m_scene, Accel_t::Bbox);
+			m_accels.put(AccelCache::key(*m_scene, Accel_t::Bbox, BuildParams()), m_acc);
+		}
+		if (req.load || loading() || (m_pending && m_pending->load)) {
+			if (!req.load && m_pending && m_pending->load) {
+				// Pending scene is built with the newer settings
+				m_pending->type = req.type;
+				m_pending->params = req.params;
+				m_pending->tune = req.tune;
+				m_pending->retune = req.retune;
+				m_pending->tuning = req.tuning;
+				m_pending->probe = req.probe;
+			} else if (req.load && m_jobs.empty()) {
+				start_build(req, false);
+			} else {
+				m_pending = req;
+			}
+			return;
+		}
+		if (!req.tune) {
+			m_want = AccelCache::key(*m_scene, req.type, req.params);
+			if (Accel *acc = m_accels.get(m_want)) {
+				m_acc_cached = false;
+				publish(acc);
+				return;
+			}
+			// Already running, it is published once done
+			if (find_job(&m_want))
+				return;
+		}
+		if (find_job(nullptr))
+			m_pending = req;
+		else
+			start_build(req, false);
+	}
+	void start_build(const BuildRequest &req, bool prebuild) {
+		// Deformed vertices don't match the file anymore
+		bool pristine = req.load || m_rest_vert.empty();
+		bool cache = m_scene_cache && pristine;
+		auto job = std::make_unique<BuildJob>();
+		job->req = req;
+		job->prebuild = prebuild;
+		// Type of a tuned build is not known yet
+		if (!req.load && !req.tune)
+			job->key = AccelCache::key(*m_scene, req.type, req.params);
+		BuildJob *ptr = job.get();
+		job->thread = std::thread([this, ptr, cache, pristine]() { run_build(*ptr, cache, pristine); });
+		m_jobs.push_back(std::move(job));
+	}
+	// Runs on a build thread, reads only the scene, which is not modified while building
+	// store: the scene matches its file, so the autotune choice can be stored
+	void run_build(BuildJob &job, bool cache, bool store) {
+		const BuildRequest &req = job.req;
+		Scene *scene = m_scene.get();
+		Accel *acc = nullptr;
+		Accel_t type = req.type;
+		BuildParams params = req.params;
+		// Choice stored by an earlier autotune of the scene skips the probing
+		bool probe = req.tune;
+		if (req.tune && !req.retune) {
+			const std::string &obj = req.load ? req.path : scene->m_filename;
+			uint64_t source = req.load ? 0 : scene->m_source_hash;
+			Float scale = req.load ? req.scale : scene->m_scale;
+			if (autotune::load(obj, source, scale, params, req.tuning, job.choice)) {
+				probe = false;
+				type = job.choice.type;
+				params = autotune::apply(params, job.choice);
+			}
+		}
+		if (req.load) {
+			job.scene = std::make_unique<Scene>();
+			scene = job.scene.get();
+			if (cache)
+				acc = scene_cache::load(*scene, req.path, req.scale, type, params, true);
+			if (!acc)
+				*scene = Scene(req.path, req.scale);
+		}
+		bool built = false;
+		if (probe) {
+			job.probing = true;
+			Accel *best = autotune::tune(*scene, req.probe, params, req.tuning, job.choice, &job.tuned);
+			job.probing = false;
+			type = job.choice.type;
+			params = autotune::apply(params, job.choice);
+			if (store)
+				autotune::save(*scene, req.params, req.tuning, job.choice);
+			// Structure read with the scene is kept, when the probe picked it as well
+			if (acc && !(acc->type() == type && acc->params().leaf_size == params.leaf_size &&
+						 acc->params().bins == params.bins)) {
+				delete acc;
+				acc = nullptr;
+			}
+			if (!acc) {
+				acc = best;
+				built = best != nullptr;
+			} else {
+				delete best;
+			}
+		}
+		if (!acc && cache && (!req.load || probe))
+			acc = scene_cache::load(*scene, scene->m_filename, scene->m_scale, type, params, false);
+		job.cached = acc != nullptr && !built;
+		if (!acc) {
+			acc = new_accel(*scene, type, params);
+			job.acc.store(acc);
+			acc->build();
+			built = true;
+		}
+		if (built && cache)
+			scene_cache::save(*scene, *acc);
+		job.ready.store(acc, std::memory_order_release);
+	}
+	// Running build of key, with nullptr any build asked for from the menu
+	const BuildJob *find_job(const AccelCache::Key *key) const {
+		for (auto &job : m_jobs) {
+			if (key ? !job->req.load && job->key == *key : !job->prebuild)
+				return job.get();
+		}
+		return nullptr;
+	}
+	bool loading() const {
+		for (auto &job : m_jobs) {
+			if (job->req.load)
+				return true;
+		}
+		return false;
+	}
+	// Build shown in the menu, the wanted one when it runs
+	const BuildJob *shown_job() const {
+		const BuildJob *job = find_job(&m_want);
+		if (!job)
+			job = find_job(nullptr);
+		return job ? job : m_jobs.empty() ? nullptr : m_jobs[0].get();
+	}
+
+	AccelCache m_accels; // Built structures of the current scene, m_acc is one of them
+	AccelCache::Key m_want; // Structure asked for last, published when its build finishes
+	bool m_published = false; // m_acc changed since the last poll_build()
+	std::vector<std::unique_ptr<BuildJob>> m_jobs;
+	std::optional<BuildRequest> m_pending;
 };
\ No newline at end of file
@@ -1,3 +1,4 @@
+#pragma once
 #include <defines.h>
 #include <vec.h>
 struct RNG{
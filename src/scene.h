@@ -1,12 +1,16 @@
 #pragma once
 // Created by Ondrej Ac (xacond00)
 #include "aabb.h"
+#include "binary_io.h"
 #include "mesh.h"
 #include "poly.h"
 #include "ray.h"
 #include "vec.h"
+#include <algorithm>
 #include <fstream>
 #include <sstream>
+#include <future>
+#include <thread>
 
 // Scene stores data and provides method to construct and intersect triangle from stored faces
 struct Scene {
@@ -23,7 +27,17 @@ struct Scene {
     // Test bounding box hit
 	bool hit_bbox(const Ray &r, Float max_t = InfF) const { return m_bbox.ray_test(r, max_t); }
     // Finalize surface rec of i-th polygon from array
-	SurfaceInfo surface_info(const HitInfo &rec) const { return get_poly(rec.idx).surface_info(rec); }
+	// Hits of instances are moved from the mesh space to the world
+	SurfaceInfo surface_info(const HitInfo &rec) const {
+		SurfaceInfo si = get_poly(rec.idx).surface_info(rec);
+		if (rec.inst < m_inst.size()) {
+			const Instance &in = m_inst[rec.inst];
+			si.P = in.point(si.P);
+			si.N = norm(in.vec(si.N));
+			si.frame = ONB(si.N);
+		}
+		return si;
+	}
 
     // Getters
     /////
@@ -72,15 +86,179 @@ struct Scene {
 	void update_bbox() { m_bbox = bbox_in(0, poly_cnt()); }
     // Update bbox of i-th mesh
 	void update_bbox(Uint i) { m_mesh[i].m_bbox = bbox_in(m_mesh[i].range()); }
+	// Update world bbox of i-th instance from its mesh bbox
+	void update_inst_bbox(Uint i) {
+		Instance &in = m_inst[i];
+		const AABB &box = m_mesh[in.m_mesh].m_bbox;
+		in.m_bbox = AABB();
+		for (Uint c = 0; c < 8; c++) {
+			Vec3f p(c & 1 ? box.pmax[0] : box.pmin[0], c & 2 ? box.pmax[1] : box.pmin[1], c & 4 ? box.pmax[2] : box.pmin[2]);
+			in.m_bbox.expand(in.point(p));
+		}
+	}
+
+	// Dynamic geometry
+	/////
+
+	// Marks vertices [beg, end) as moved, so updates of accelerators refit only nodes using them
+	// When nothing is marked, updates refit everything
+	void mark_dirty(Uint beg, Uint end) {
+		Vec2u range(beg, end);
+		auto it = std::lower_bound(m_dirty.begin(), m_dirty.end(), range, [](Vec2u a, Vec2u b) { return a[1] < b[0]; });
+		// Merge with all overlapping or touching ranges
+		while (it != m_dirty.end() && (*it)[0] <= range[1]) {
+			range = Vec2u(std::min(range[0], (*it)[0]), std::max(range[1], (*it)[1]));
+			it = m_dirty.erase(it);
+		}
+		m_dirty.insert(it, range);
+	}
+	void clear_dirty() { m_dirty.clear(); }
+	// Vertices in [span[0], span[1]) moved (everything moved when nothing is marked)
+	bool dirty(Vec2u span) const {
+		if (m_dirty.empty())
+			return true;
+		auto it = std::lower_bound(m_dirty.begin(), m_dirty.end(), span, [](Vec2u a, Vec2u b) { return a[1] <= b[0]; });
+		return it != m_dirty.end() && (*it)[0] < span[1];
+	}
+	// Range of vertices used by polygons [range[0], range[1])
+	Vec2u vert_span(Vec2u range) const {
+		Vec2u span(Uint(-1), 0);
+		for (Uint i = range[0]; i < range[1]; i++) {
+			for (Uint k = 0; k < 3; k++) {
+				span[0] = std::min(span[0], m_poly[i][k]);
+				span[1] = std::max(span[1], m_poly[i][k] + 1);
+			}
+		}
+		return span;
+	}
+
+	// Instances
+	/////
+
+	Uint inst_cnt() const { return m_inst.size(); }
+	Instance &add_instance(Uint mesh, const Transform &xf) {
+		m_inst.emplace_back(mesh, xf);
+		update_inst_bbox(m_inst.size() - 1);
+		return m_inst.back();
+	}
+	// Places n x n copies of all meshes next to each other on the xz plane
+	// n <= 1 removes instances, so every mesh is traced once in place
+	void instance_grid(Uint n) {
+		m_inst.clear();
+		if (n <= 1)
+			return;
+		Vec3f step = (m_bbox.pmax - m_bbox.pmin) * Float(1.1);
+		for (Uint i = 0; i < n; i++) {
+			for (Uint j = 0; j < n; j++) {
+				for (Uint m = 0; m < mesh_cnt(); m++)
+					add_instance(m, Transform(Vec3f(step[0] * i, 0, step[2] * j), Vec3f(0), 1));
+			}
+		}
+	}
 	void reset(){
 		m_filename.clear();
 		m_vert.clear();
 		m_poly.clear();
 		m_mesh.clear();
+		m_inst.clear();
+		m_dirty.clear();
 		m_bbox = AABB();
+		m_scale = 1;
+		m_source_hash = 0;
 	}
-    // Load obj file
+	// Load obj file
+	// File is memory mapped and its chunks are parsed in parallel,
+	// the result is the same as from load_obj_stream()
 	bool load_obj(const std::string &filename, float scale = 1.0) {
+		double load_timer = timer();
+		MappedFile file(filename);
+		if (!file.ok()) {
+			println("Couln't load obj:", filename, "!");
+			return false;
+		}
+		reset();
+		m_filename = filename;
+		m_scale = scale;
+		const char *data = file.data();
+		size_t size = file.size();
+		m_source_hash = hash_bytes(data, size);
+
+		// Chunks are split at line ends
+		constexpr size_t min_chunk = 1 << 20;
+		size_t chunk_cnt = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()) * 4, size / min_chunk + 1);
+		std::vector<size_t> bounds(chunk_cnt + 1, size);
+		bounds[0] = 0;
+		for (size_t c = 1; c < chunk_cnt; c++) {
+			size_t pos = std::max(bounds[c - 1], size * c / chunk_cnt);
+			const void *eol = pos < size ? memchr(data + pos, '\n', size - pos) : nullptr;
+			bounds[c] = eol ? static_cast<const char *>(eol) - data + 1 : size;
+		}
+		std::vector<ObjChunk> chunks(chunk_cnt);
+		std::vector<std::future<void>> tasks;
+		for (size_t c = 1; c < chunk_cnt; c++) {
+			tasks.push_back(std::async(std::launch::async, obj::parse_chunk, data + bounds[c], data + bounds[c + 1], scale,
+									   std::ref(chunks[c])));
+		}
+		obj::parse_chunk(data, data + bounds[1], scale, chunks[0]);
+		for (auto &t : tasks)
+			t.wait();
+
+		// Merge in file order, relative face indices are resolved against all preceding vertices
+		size_t vert_cnt = 0, face_cnt = 0;
+		for (auto &ch : chunks) {
+			vert_cnt += ch.vert.size();
+			face_cnt += ch.face.size();
+		}
+		m_vert.reserve(vert_cnt);
+		m_poly.reserve(face_cnt);
+		bool in_mesh = false;
+		Mesh current;
+		for (auto &ch : chunks) {
+			Uint vert_off = m_vert.size();
+			Uint face_off = m_poly.size();
+			m_vert.insert(m_vert.end(), ch.vert.begin(), ch.vert.end());
+			m_bbox.expand(ch.bbox);
+			// Faces before the first "o" / "g" go to the default mesh
+			if (!in_mesh && !ch.face.empty() && (ch.groups.empty() || ch.groups[0].face > 0)) {
+				current.m_name = "default";
+				current.m_off = face_off;
+				in_mesh = true;
+			}
+			for (Uint i = 0; i < ch.face.size(); i++) {
+				Vec3u tri;
+				for (Uint k = 0; k < 3; k++) {
+					Int idx = ch.face[i][k];
+					tri[k] = idx < 0 ? vert_off + ch.face_vert[i] + idx : Uint(idx) - 1;
+				}
+				m_poly.push_back(tri);
+			}
+			for (auto &g : ch.groups) {
+				if (in_mesh) {
+					current.m_cnt = face_off + g.face - current.m_off;
+					m_mesh.push_back(current);
+				}
+				if (g.named)
+					current.m_name = g.name;
+				current.m_off = face_off + g.face;
+				in_mesh = true;
+			}
+		}
+		if (in_mesh) {
+			current.m_cnt = m_poly.size() - current.m_off;
+			m_mesh.push_back(current);
+		}
+		for (auto &mesh : m_mesh)
+			mesh.m_bbox = bbox_in(mesh.range());
+		m_load_time = timer(load_timer);
+		m_load_bytes = size;
+		return true;
+	}
+
+	// Load throughput of the last load in MB/s
+	double load_speed() const { return m_load_time > 0 ? m_load_bytes / m_load_time * 1e-6 : 0; }
+
+	// Reference loader reading the file line by line
+	bool load_obj_stream(const std::string &filename, float scale = 1.0) {
 		std::ifstream file(filename);
 		if (!file){
 			println("Couln't load obj:", filename, "!");
@@ -88,6 +266,7 @@ struct Scene {
 		}
 		reset();
 		m_filename = filename;
+		m_scale = scale;
 		auto trim = [](const std::string &s) -> std::string {
 			size_t start = s.find_first_not_of(" \t\r\n");
 			size_t end = s.find_last_not_of(" \t\r\n");
@@ -155,5 +334,11 @@ struct Scene {
 	std::vector<Vec3f> m_vert; // Raw vertices
 	std::vector<Vec3u> m_poly; // Triangle indices
 	std::vector<Mesh> m_mesh; // Meshes
+	std::vector<Vec2u> m_dirty; // Sorted disjoint vertex ranges moved since the last update
+	std::vector<Instance> m_inst; // Mesh instances of the two-level structure, empty = every mesh once in place
 	AABB m_bbox; // Global bounding box
+	Float m_scale = 1; // Scale applied to the loaded vertices
+	uint64_t m_source_hash = 0; // Hash of the source file, keys the scene cache
+	double m_load_time = 0;	 // Seconds spent by the last load (obj or cache)
+	size_t m_load_bytes = 0; // Size of the last loaded file
 };
\ No newline at end of file
@@ -0,0 +1,187 @@
+#pragma once
+// Created by Ondrej Ac (xacond00)
+// Binary scene cache, one file next to the OBJ per accelerator and build settings
+// Holds scene arrays and the built accelerator, so reopening a scene skips both parsing and building
+// File is used only if its key matches the hash of the OBJ file and of the build settings
+// Every file holds a whole copy of the scene, so only max_files newest files of one OBJ are kept
+#include "accels.h"
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+
+namespace scene_cache {
+constexpr uint32_t magic = 0x43524756; // "VGRC"
+constexpr uint32_t version = 1;
+constexpr Uint max_files = 4;
+
+struct Key {
+	uint32_t magic = scene_cache::magic;
+	uint32_t version = scene_cache::version;
+	uint64_t source = 0; // Hash of the OBJ file
+	uint64_t params = 0; // Hash of accelerator type, build parameters and scale
+	bool operator==(const Key &o) const {
+		return magic == o.magic && version == o.version && source == o.source && params == o.params;
+	}
+};
+
+// Fields are hashed one by one, so struct padding doesn't matter
+// Parallel build gives the same structure, so it is not part of the key
+inline uint64_t params_hash(Accel_t type, const BuildParams &params, Float scale) {
+	uint64_t h = hash_bytes(&type, sizeof(type));
+	h = hash_bytes(&params.bvh_build, sizeof(params.bvh_build), h);
+	h = hash_bytes(&params.sbvh_budget, sizeof(params.sbvh_budget), h);
+	h = hash_bytes(&params.sbvh_alpha, sizeof(params.sbvh_alpha), h);
+	h = hash_bytes(&params.leaf_size, sizeof(params.leaf_size), h);
+	h = hash_bytes(&params.pack_width, sizeof(params.pack_width), h);
+	h = hash_bytes(&params.kd_ropes, sizeof(params.kd_ropes), h);
+	h = hash_bytes(&params.bins, sizeof(params.bins), h);
+	return hash_bytes(&scale, sizeof(scale), h);
+}
+
+// scene.obj -> scene.obj.BVH-1a2b3c4d.vgc
+inline std::string path(const std::string &obj, Accel_t type, uint64_t params) {
+	char tag[16];
+	snprintf(tag, sizeof(tag), "%08x", uint32_t(params ^ (params >> 32)));
+	return obj + "." + accel_t_names[int(type)] + "-" + tag + ".vgc";
+}
+
+inline void write_scene(BinWriter &out, const Scene &scene) {
+	out.write(scene.m_vert);
+	out.write(scene.m_poly);
+	out.write(scene.m_bbox);
+	out.write(uint64_t(scene.m_mesh.size()));
+	for (const Mesh &mesh : scene.m_mesh) {
+		out.write(mesh.m_name);
+		out.write(mesh.m_off);
+		out.write(mesh.m_cnt);
+		out.write(mesh.m_bbox);
+	}
+}
+
+// With skip, only moves past the scene part
+inline bool read_scene(BinReader &in, Scene &scene, bool skip) {
+	if (skip) {
+		if (!in.skip_array() || !in.skip_array())
+			return false;
+	} else if (!in.read(scene.m_vert) || !in.read(scene.m_poly)) {
+		return false;
+	}
+	AABB bbox;
+	uint64_t mesh_cnt = 0;
+	if (!in.read(bbox) || !in.read(mesh_cnt))
+		return false;
+	if (!skip)
+		scene.m_bbox = bbox;
+	for (uint64_t i = 0; i < mesh_cnt; i++) {
+		Mesh mesh;
+		if (!in.read(mesh.m_name) || !in.read(mesh.m_off) || !in.read(mesh.m_cnt) || !in.read(mesh.m_bbox))
+			return false;
+		if (!skip)
+			scene.m_mesh.push_back(std::move(mesh));
+	}
+	if (skip)
+		return true;
+	// Indices are checked once here, so the tracing code can trust them
+	for (const Vec3u &idx : scene.m_poly) {
+		if (idx[0] >= scene.m_vert.size() || idx[1] >= scene.m_vert.size() || idx[2] >= scene.m_vert.size())
+			return false;
+	}
+	return true;
+}
+
+// Removes the oldest cache files of obj, so at most keep of them stay
+inline void prune(const std::string &obj, Uint keep) {
+	namespace fs = std::filesystem;
+	std::error_code ec;
+	fs::path src(obj);
+	fs::path dir = src.has_parent_path() ? src.parent_path() : fs::path(".");
+	std::string prefix = src.filename().string() + ".";
+	std::vector<std::pair<fs::file_time_type, fs::path>> files;
+	for (auto it = fs::directory_iterator(dir, ec); !ec && it != fs::directory_iterator(); it.increment(ec)) {
+		std::string name = it->path().filename().string();
+		// Autotune choice shares the prefix, but it is small and one per OBJ
+		if (name.size() <= prefix.size() + 4 || name.compare(0, prefix.size(), prefix) != 0 ||
+			name.compare(name.size() - 4, 4, ".vgc") != 0 || name == prefix + "autotune.vgc")
+			continue;
+		std::error_code tec;
+		auto time = it->last_write_time(tec);
+		if (!tec)
+			files.push_back({time, it->path()});
+	}
+	if (files.size() <= keep)
+		return;
+	std::sort(files.begin(), files.end(), [](auto &a, auto &b) { return a.first > b.first; });
+	for (size_t i = keep; i < files.size(); i++)
+		fs::remove(files[i].second, ec);
+}
+
+// Writes scene and built acc into the cache, false if acc can't be cached or the file can't be written
+// File is written under a temporary name first, so a reader never sees it half written
+inline bool save(const Scene &scene, const Accel &acc) {
+	if (scene.m_filename.empty() || !scene.m_source_hash)
+		return false;
+	Key key;
+	key.source = scene.m_source_hash;
+	key.params = params_hash(acc.type(), acc.params(), scene.m_scale);
+	std::string file = path(scene.m_filename, acc.type(), key.params);
+	std::string tmp = file + ".tmp";
+	bool ok;
+	{
+		BinWriter out(tmp);
+		out.write(key);
+		write_scene(out, scene);
+		ok = out.ok() && acc.save(out);
+	}
+	std::error_code ec;
+	if (ok)
+		std::filesystem::rename(tmp, file, ec);
+	if (!ok || ec)
+		std::filesystem::remove(tmp, ec);
+	if (ok && !ec)
+		prune(scene.m_filename, max_files);
+	return ok && !ec;
+}
+
+// Reads accelerator of type for scene from the cache, with load_scene fills scene from it as well
+// Returns nullptr when there is no matching cache file
+inline Accel *load(Scene &scene, const std::string &obj, Float scale, Accel_t type, const BuildParams &params,
+				   bool load_scene) {
+	double load_timer = timer();
+	uint64_t source = scene.m_source_hash;
+	if (!load_scene && !source)
+		return nullptr;
+	if (load_scene) {
+		MappedFile src(obj);
+		if (!src.ok())
+			return nullptr;
+		source = hash_bytes(src.data(), src.size());
+	}
+	Key key;
+	key.source = source;
+	key.params = params_hash(type, params, scale);
+	BinReader in(path(obj, type, key.params));
+	Key stored;
+	if (!in.ok() || !in.read(stored) || !(stored == key))
+		return nullptr;
+	Scene loaded;
+	if (!read_scene(in, loaded, !load_scene))
+		return nullptr;
+	if (load_scene) {
+		loaded.m_filename = obj;
+		loaded.m_scale = scale;
+		loaded.m_source_hash = source;
+		loaded.m_load_bytes = in.size();
+		scene = std::move(loaded);
+	}
+	Accel *acc = new_accel(scene, type, params);
+	if (!acc || !acc->load(in)) {
+		delete acc;
+		if (load_scene)
+			scene.reset();
+		return nullptr;
+	}
+	if (load_scene)
+		scene.m_load_time = timer(load_timer);
+	return acc;
+}
+} // namespace scene_cache
@@ -0,0 +1,177 @@
+#pragma once
+// Minimal SIMD lane wrappers for the wide traversal kernels
+// Comparisons return lane bitmasks, so callers can combine them with plain integer ops
+#include "defines.h"
+#include <cstdint>
+#include <cstring>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define VGE_SSE 1
+#include <immintrin.h>
+#endif
+
+// Portable fallback, the compiler is usually able to vectorize the loops by itself
+template <Uint W>
+struct Lane_t {
+	Lane_t() {}
+	explicit Lane_t(Float f) {
+		for (Uint i = 0; i < W; i++)
+			v[i] = f;
+	}
+	static Lane_t load(const Float *p) {
+		Lane_t r;
+		for (Uint i = 0; i < W; i++)
+			r.v[i] = p[i];
+		return r;
+	}
+	// Converts W bytes to floats
+	static Lane_t load_u8(const uint8_t *p) {
+		Lane_t r;
+		for (Uint i = 0; i < W; i++)
+			r.v[i] = p[i];
+		return r;
+	}
+	void store(Float *p) const {
+		for (Uint i = 0; i < W; i++)
+			p[i] = v[i];
+	}
+	template <class OP>
+	friend Lane_t lane_op(const Lane_t &a, const Lane_t &b, const OP &op) {
+		Lane_t r;
+		for (Uint i = 0; i < W; i++)
+			r.v[i] = op(a.v[i], b.v[i]);
+		return r;
+	}
+	template <class OP>
+	friend Uint lane_cmp(const Lane_t &a, const Lane_t &b, const OP &op) {
+		Uint m = 0;
+		for (Uint i = 0; i < W; i++)
+			m |= Uint(op(a.v[i], b.v[i])) << i;
+		return m;
+	}
+	friend Lane_t operator+(const Lane_t &a, const Lane_t &b) { return lane_op(a, b, [](Float x, Float y) { return x + y; }); }
+	friend Lane_t operator-(const Lane_t &a, const Lane_t &b) { return lane_op(a, b, [](Float x, Float y) { return x - y; }); }
+	friend Lane_t operator*(const Lane_t &a, const Lane_t &b) { return lane_op(a, b, [](Float x, Float y) { return x * y; }); }
+	friend Lane_t operator/(const Lane_t &a, const Lane_t &b) { return lane_op(a, b, [](Float x, Float y) { return x / y; }); }
+	friend Lane_t min(const Lane_t &a, const Lane_t &b) { return lane_op(a, b, [](Float x, Float y) { return x < y ? x : y; }); }
+	friend Lane_t max(const Lane_t &a, const Lane_t &b) { return lane_op(a, b, [](Float x, Float y) { return x > y ? x : y; }); }
+	friend Uint operator<(const Lane_t &a, const Lane_t &b) { return lane_cmp(a, b, [](Float x, Float y) { return x < y; }); }
+	friend Uint operator>(const Lane_t &a, const Lane_t &b) { return lane_cmp(a, b, [](Float x, Float y) { return x > y; }); }
+	friend Uint operator<=(const Lane_t &a, const Lane_t &b) { return lane_cmp(a, b, [](Float x, Float y) { return x <= y; }); }
+	friend Uint operator>=(const Lane_t &a, const Lane_t &b) { return lane_cmp(a, b, [](Float x, Float y) { return x >= y; }); }
+	Float operator[](Uint i) const { return v[i]; }
+	Float v[W];
+};
+
+#ifdef VGE_SSE
+template <>
+struct Lane_t<4> {
+	Lane_t() {}
+	Lane_t(__m128 v) : v(v) {}
+	explicit Lane_t(Float f) : v(_mm_set1_ps(f)) {}
+	static Lane_t load(const Float *p) { return _mm_loadu_ps(p); }
+	// Bytes are widened with SSE2 unpacks, so SSE4.1 is not needed
+	static Lane_t load_u8(const uint8_t *p) {
+		int32_t b;
+		memcpy(&b, p, 4);
+		__m128i x = _mm_cvtsi32_si128(b);
+		x = _mm_unpacklo_epi8(x, _mm_setzero_si128());
+		x = _mm_unpacklo_epi16(x, _mm_setzero_si128());
+		return _mm_cvtepi32_ps(x);
+	}
+	void store(Float *p) const { _mm_storeu_ps(p, v); }
+	friend Lane_t operator+(const Lane_t &a, const Lane_t &b) { return _mm_add_ps(a.v, b.v); }
+	friend Lane_t operator-(const Lane_t &a, const Lane_t &b) { return _mm_sub_ps(a.v, b.v); }
+	friend Lane_t operator*(const Lane_t &a, const Lane_t &b) { return _mm_mul_ps(a.v, b.v); }
+	friend Lane_t operator/(const Lane_t &a, const Lane_t &b) { return _mm_div_ps(a.v, b.v); }
+	friend Lane_t min(const Lane_t &a, const Lane_t &b) { return _mm_min_ps(a.v, b.v); }
+	friend Lane_t max(const Lane_t &a, const Lane_t &b) { return _mm_max_ps(a.v, b.v); }
+	friend Uint operator<(const Lane_t &a, const Lane_t &b) { return _mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)); }
+	friend Uint operator>(const Lane_t &a, const Lane_t &b) { return _mm_movemask_ps(_mm_cmpgt_ps(a.v, b.v)); }
+	friend Uint operator<=(const Lane_t &a, const Lane_t &b) { return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v)); }
+	friend Uint operator>=(const Lane_t &a, const Lane_t &b) { return _mm_movemask_ps(_mm_cmpge_ps(a.v, b.v)); }
+	Float operator[](Uint i) const {
+		alignas(16) Float f[4];
+		_mm_store_ps(f, v);
+		return f[i];
+	}
+	__m128 v;
+};
+#endif
+
+#ifdef __AVX__
+template <>
+struct Lane_t<8> {
+	Lane_t() {}
+	Lane_t(__m256 v) : v(v) {}
+	explicit Lane_t(Float f) : v(_mm256_set1_ps(f)) {}
+	static Lane_t load(const Float *p) { return _mm256_loadu_ps(p); }
+	static Lane_t load_u8(const uint8_t *p) {
+#ifdef __AVX2__
+		return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p)));
+#else
+		__m128i x = _mm_loadl_epi64((const __m128i *)p);
+		x = _mm_unpacklo_epi8(x, _mm_setzero_si128());
+		__m128i lo = _mm_unpacklo_epi16(x, _mm_setzero_si128());
+		__m128i hi = _mm_unpackhi_epi16(x, _mm_setzero_si128());
+		return _mm256_cvtepi32_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1));
+#endif
+	}
+	void store(Float *p) const { _mm256_storeu_ps(p, v); }
+	friend Lane_t operator+(const Lane_t &a, const Lane_t &b) { return _mm256_add_ps(a.v, b.v); }
+	friend Lane_t operator-(const Lane_t &a, const Lane_t &b) { return _mm256_sub_ps(a.v, b.v); }
+	friend Lane_t operator*(const Lane_t &a, const Lane_t &b) { return _mm256_mul_ps(a.v, b.v); }
+	friend Lane_t operator/(const Lane_t &a, const Lane_t &b) { return _mm256_div_ps(a.v, b.v); }
+	friend Lane_t min(const Lane_t &a, const Lane_t &b) { return _mm256_min_ps(a.v, b.v); }
+	friend Lane_t max(const Lane_t &a, const Lane_t &b) { return _mm256_max_ps(a.v, b.v); }
+	friend Uint operator<(const Lane_t &a, const Lane_t &b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+	friend Uint operator>(const Lane_t &a, const Lane_t &b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)); }
+	friend Uint operator<=(const Lane_t &a, const Lane_t &b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)); }
+	friend Uint operator>=(const Lane_t &a, const Lane_t &b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)); }
+	Float operator[](Uint i) const {
+		alignas(32) Float f[8];
+		_mm256_store_ps(f, v);
+		return f[i];
+	}
+	__m256 v;
+};
+#elif defined(VGE_SSE)
+// Without AVX the 8-wide lane is emulated by a pair of SSE lanes
+template <>
+struct Lane_t<8> {
+	Lane_t() {}
+	Lane_t(Lane_t<4> a, Lane_t<4> b) : lo(a), hi(b) {}
+	explicit Lane_t(Float f) : lo(f), hi(f) {}
+	static Lane_t load(const Float *p) { return {Lane_t<4>::load(p), Lane_t<4>::load(p + 4)}; }
+	static Lane_t load_u8(const uint8_t *p) { return {Lane_t<4>::load_u8(p), Lane_t<4>::load_u8(p + 4)}; }
+	void store(Float *p) const {
+		lo.store(p);
+		hi.store(p + 4);
+	}
+	friend Lane_t operator+(const Lane_t &a, const Lane_t &b) { return {a.lo + b.lo, a.hi + b.hi}; }
+	friend Lane_t operator-(const Lane_t &a, const Lane_t &b) { return {a.lo - b.lo, a.hi - b.hi}; }
+	friend Lane_t operator*(const Lane_t &a, const Lane_t &b) { return {a.lo * b.lo, a.hi * b.hi}; }
+	friend Lane_t operator/(const Lane_t &a, const Lane_t &b) { return {a.lo / b.lo, a.hi / b.hi}; }
+	friend Lane_t min(const Lane_t &a, const Lane_t &b) { return {min(a.lo, b.lo), min(a.hi, b.hi)}; }
+	friend Lane_t max(const Lane_t &a, const Lane_t &b) { return {max(a.lo, b.lo), max(a.hi, b.hi)}; }
+	friend Uint operator<(const Lane_t &a, const Lane_t &b) { return (a.lo < b.lo) | ((a.hi < b.hi) << 4); }
+	friend Uint operator>(const Lane_t &a, const Lane_t &b) { return (a.lo > b.lo) | ((a.hi > b.hi) << 4); }
+	friend Uint operator<=(const Lane_t &a, const Lane_t &b) { return (a.lo <= b.lo) | ((a.hi <= b.hi) << 4); }
+	friend Uint operator>=(const Lane_t &a, const Lane_t &b) { return (a.lo >= b.lo) | ((a.hi >= b.hi) << 4); }
+	Float operator[](Uint i) const { return i < 4 ? lo[i] : hi[i - 4]; }
+	Lane_t<4> lo, hi;
+};
+#endif
+
+// Index of the lowest set bit in a lane mask
+inline Uint lane_first(Uint mask) {
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctz(mask);
+#else
+	Uint i = 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
@@ -0,0 +1,123 @@
+#pragma once
+// Persistent worker pool with work stealing
+// Every job is a range of task indices split evenly between worker queues,
+// worker takes tasks from the front of its own queue and steals from the others once it is empty
+#include "defines.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+	// Queue is a contiguous range of tasks, both owner and thieves pop from the front
+	struct alignas(64) Queue {
+		std::atomic<Uint> next{0};
+		Uint end = 0;
+	};
+
+  public:
+	// 0 threads means one per hardware thread, calling thread counts as worker 0
+	explicit ThreadPool(Uint threads = 0) {
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		m_queues = std::make_unique<Queue[]>(threads);
+		m_size = threads;
+		for (Uint i = 1; i < threads; i++) {
+			m_workers.emplace_back([this, i]() { worker_loop(i); });
+		}
+	}
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit = true;
+		}
+		m_wake.notify_all();
+		for (auto &t : m_workers)
+			t.join();
+	}
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	// Runs fn(task, worker) for every task in [0, n), blocks until all are done
+	void run(Uint n, const std::function<void(Uint, Uint)> &fn) {
+		if (n == 0)
+			return;
+		for (Uint i = 0; i < m_size; i++) {
+			m_queues[i].next = Uint(size_t(n) * i / m_size);
+			m_queues[i].end = Uint(size_t(n) * (i + 1) / m_size);
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_job = &fn;
+			m_running = m_size - 1;
+			m_generation++;
+		}
+		m_wake.notify_all();
+		work(0);
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [this]() { return m_running == 0; });
+		m_job = nullptr;
+	}
+
+	// Splits [0, n) into chunks of at most grain items, calls fn(begin, end, worker)
+	template <class F>
+	void parallel_for(Uint n, Uint grain, const F &fn) {
+		grain = std::max(grain, 1u);
+		run((n + grain - 1) / grain, [&](Uint task, Uint worker) {
+			Uint begin = task * grain;
+			fn(begin, std::min(begin + grain, n), worker);
+		});
+	}
+
+	Uint size() const { return m_size; }
+	// Tasks taken from queues of other workers since construction
+	size_t steals() const { return m_steals; }
+
+  private:
+	void worker_loop(Uint id) {
+		size_t generation = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wake.wait(lock, [&]() { return m_quit || m_generation != generation; });
+				if (m_quit)
+					return;
+				generation = m_generation;
+			}
+			work(id);
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (--m_running == 0)
+				m_done.notify_one();
+		}
+	}
+
+	// Drains own queue first, then steals from the others round robin
+	void work(Uint id) {
+		const auto &fn = *m_job;
+		for (Uint k = 0; k < m_size; k++) {
+			Queue &q = m_queues[(id + k) % m_size];
+			while (true) {
+				Uint task = q.next.fetch_add(1, std::memory_order_relaxed);
+				if (task >= q.end)
+					break;
+				if (k)
+					m_steals.fetch_add(1, std::memory_order_relaxed);
+				fn(task, id);
+			}
+		}
+	}
+
+	std::unique_ptr<Queue[]> m_queues;
+	std::vector<std::thread> m_workers;
+	Uint m_size = 1;
+	std::mutex m_mutex;
+	std::condition_variable m_wake, m_done;
+	const std::function<void(Uint, Uint)> *m_job = nullptr;
+	Uint m_running = 0;
+	size_t m_generation = 0;
+	std::atomic<size_t> m_steals{0};
+	bool m_quit = false;
+};
@@ -36,6 +36,13 @@ struct Transform{
         }
         return Vec3f(dot(v, Tr[0]), dot(v, Tr[1]), dot(v, Tr[2])) + P;
     }
+    // Inverse of vec<true>() / point<true>(), rotation matrix is orthonormal
+    Vec3f inv_vec(Vec3f v)const{
+        return (v.x() * Tr[0] + v.y() * Tr[1] + v.z() * Tr[2]) * (Float(1) / S);
+    }
+    Vec3f inv_point(Vec3f v)const{
+        return inv_vec(v - P);
+    }
     Transform &rotate(Vec3f dA){
         A = A + dA;
         update_Tr();
@@ -159,6 +159,7 @@ using Vec3f = Vec_t<Float, 3>;
 using Vec4f = Vec_t<Float, 4>;
 using Vec2u = Vec_t<Uint, 2>;
 using Vec3u = Vec_t<Uint, 3>;
+using Vec3i = Vec_t<Int, 3>;
 
 template <class T, class OP, Uint N>
 inline auto un_op(Vec_t<T, N> a, const OP &op) {